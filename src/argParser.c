@@ -84,6 +84,10 @@ static void parseOption(argParser* parser, const char* current) {
 
     if(current[1] == '-') {
         // parse --arg, atleast one leter avaliable, as this is not '--' arg
+        parser->canGetArg = true;
+        parser->canGetInternalArg = false;
+        parser->hasGotArg = false;
+
         argArgument* arg = tableGet(&parser->argumentTable, &current[2], len - 2);
         invokeOption(parser, arg, &current[2], len-2);
 
@@ -0,0 +1,606 @@
+#include "byteScan.h"
+
+#include <stdint.h>
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+// the fastest searches that can be used, lowered by byteScanSetLevel
+static ByteScanLevel scanLevel = SCAN_LEVEL_AVX2;
+
+void byteScanSetLevel(ByteScanLevel level) {
+    scanLevel = level;
+}
+
+// avx2 versions are compiled regardless of the target's baseline instruction
+// set, and only used if the cpu running the program supports them
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define BYTE_SCAN_AVX2
+#include <immintrin.h>
+#define AVX2_FN __attribute__((target("avx2")))
+
+static bool hasAvx2(void) {
+    // per thread, so it can be set without a lock
+    static _Thread_local int supported = -1;
+    if(supported < 0) {
+        __builtin_cpu_init();
+        supported = __builtin_cpu_supports("avx2") != 0;
+    }
+    return supported && scanLevel >= SCAN_LEVEL_AVX2;
+}
+#endif
+
+ByteScanLevel byteScanMaxLevel(void) {
+#ifdef BYTE_SCAN_AVX2
+    __builtin_cpu_init();
+    if(__builtin_cpu_supports("avx2")) {
+        return SCAN_LEVEL_AVX2;
+    }
+#endif
+#ifdef __SSE2__
+    return SCAN_LEVEL_SSE2;
+#else
+    return SCAN_LEVEL_SCALAR;
+#endif
+}
+
+// is the byte one that Phase1Get or Phase2Get would do something with other
+// than returning it unchanged (not including '?', which is checked separately
+// as it only matters when trigraphs are enabled, or bytes found by
+// scanInvalidBytes, which phase 1 keeps track of itself)
+static bool isSpecialByte(unsigned char c) {
+    return c == '\\' || c == '\r';
+}
+
+size_t scanSpecialBytes(const unsigned char* buf, size_t start, size_t end, bool trigraphs) {
+    size_t i = start;
+
+#ifdef __SSE2__
+    if(scanLevel >= SCAN_LEVEL_SSE2) {
+        const __m128i backslash = _mm_set1_epi8('\\');
+        const __m128i carriageReturn = _mm_set1_epi8('\r');
+        const __m128i question = _mm_set1_epi8('?');
+
+        for(; i + 16 <= end; i += 16) {
+            __m128i v = _mm_loadu_si128((const __m128i*)&buf[i]);
+
+            __m128i special = _mm_or_si128(
+                _mm_cmpeq_epi8(v, backslash),
+                _mm_cmpeq_epi8(v, carriageReturn));
+            if(trigraphs) {
+                special = _mm_or_si128(special, _mm_cmpeq_epi8(v, question));
+            }
+
+            int mask = _mm_movemask_epi8(special);
+            if(mask != 0) {
+                return i + __builtin_ctz(mask);
+            }
+        }
+    }
+#endif
+
+    for(; i < end; i++) {
+        unsigned char c = buf[i];
+        if(isSpecialByte(c) || (trigraphs && c == '?')) {
+            return i;
+        }
+    }
+
+    return end;
+}
+
+// control characters other than "\t\n\v\f\r"
+static bool isControl(unsigned char c) {
+    return (c < 0x20 && (c < '\t' || c > '\r')) || c == 0x7F;
+}
+
+// the length of the valid character starting at i, or 0 if it is invalid
+// utf8 or a control character
+static size_t validCharLength(const unsigned char* buf, size_t i, size_t end) {
+    unsigned char c = buf[i];
+    if(c < 0x80) {
+        return isControl(c) ? 0 : 1;
+    }
+
+    // the range of the second byte depends on the first, to exclude overlong
+    // encodings, surrogates and values above 0x10FFFF
+    size_t length;
+    unsigned char min = 0x80;
+    unsigned char max = 0xBF;
+    if(c >= 0xC2 && c <= 0xDF) {
+        length = 2;
+    } else if(c >= 0xE0 && c <= 0xEF) {
+        length = 3;
+        if(c == 0xE0) min = 0xA0;
+        if(c == 0xED) max = 0x9F;
+    } else if(c >= 0xF0 && c <= 0xF4) {
+        length = 4;
+        if(c == 0xF0) min = 0x90;
+        if(c == 0xF4) max = 0x8F;
+    } else {
+        return 0;
+    }
+
+    if(end - i < length || buf[i + 1] < min || buf[i + 1] > max) {
+        return 0;
+    }
+    for(size_t j = 2; j < length; j++) {
+        if((buf[i + j] & 0xC0) != 0x80) {
+            return 0;
+        }
+    }
+    return length;
+}
+
+// check characters starting before limit, returning the first invalid one,
+// or the start of the first character at or after limit
+static size_t scanInvalidBytesScalar(const unsigned char* buf, size_t i, size_t limit, size_t end) {
+    while(i < limit) {
+        size_t length = validCharLength(buf, i, end);
+        if(length == 0) {
+            return i;
+        }
+        i += length;
+    }
+    return i;
+}
+
+// the start of the character containing the byte before i, which could
+// continue past i, not going back past start
+static size_t charStartBefore(const unsigned char* buf, size_t start, size_t i) {
+    if(i == start) {
+        return i;
+    }
+
+    // a valid character has at most 3 continuation bytes
+    size_t j = i - 1;
+    while(j > start && i - j < 4 && (buf[j] & 0xC0) == 0x80) {
+        j--;
+    }
+    return j;
+}
+
+#ifdef BYTE_SCAN_AVX2
+// Multi-byte characters are checked using the lookup tables from "Validating
+// UTF-8 In Less Than One Instruction Per Byte" (Keiser and Lemire, 2021),
+// where each error is flagged by a bit set in all three of the values looked
+// up from the first byte's high and low nibbles and the second byte's high
+// nibble, apart from the third and fourth bytes of a character, which are
+// found by looking two and three bytes back.
+#define UTF8_TOO_SHORT      (1 << 0)
+#define UTF8_TOO_LONG       (1 << 1)
+#define UTF8_OVERLONG_3     (1 << 2)
+#define UTF8_TOO_LARGE      (1 << 3)
+#define UTF8_SURROGATE      (1 << 4)
+#define UTF8_OVERLONG_2     (1 << 5)
+#define UTF8_TOO_LARGE_1000 (1 << 6)
+#define UTF8_OVERLONG_4     (1 << 6)
+#define UTF8_TWO_CONTS      (1 << 7)
+#define UTF8_CARRY (UTF8_TOO_SHORT | UTF8_TOO_LONG | UTF8_TWO_CONTS)
+
+// the same table in both lanes, as shuffles do not cross lanes
+#define AVX2_TABLE(table) _mm256_broadcastsi128_si256(_mm_loadu_si128((const __m128i*)(table)))
+
+AVX2_FN static __m256i utf8ErrorsAvx2(__m256i v, __m256i previous) {
+    const __m256i lowNibble = _mm256_set1_epi8(0x0F);
+
+    // the bytes one, two and three before each byte of v
+    __m256i shifted = _mm256_permute2x128_si256(previous, v, 0x21);
+    __m256i prev1 = _mm256_alignr_epi8(v, shifted, 15);
+    __m256i prev2 = _mm256_alignr_epi8(v, shifted, 14);
+    __m256i prev3 = _mm256_alignr_epi8(v, shifted, 13);
+
+    static const unsigned char byte1HighTable[16] = {
+        // ascii
+        UTF8_TOO_LONG, UTF8_TOO_LONG, UTF8_TOO_LONG, UTF8_TOO_LONG,
+        UTF8_TOO_LONG, UTF8_TOO_LONG, UTF8_TOO_LONG, UTF8_TOO_LONG,
+        // continuation
+        UTF8_TWO_CONTS, UTF8_TWO_CONTS, UTF8_TWO_CONTS, UTF8_TWO_CONTS,
+        // two byte lead, 1100 then 1101
+        UTF8_TOO_SHORT | UTF8_OVERLONG_2,
+        UTF8_TOO_SHORT,
+        // three byte lead
+        UTF8_TOO_SHORT | UTF8_OVERLONG_3 | UTF8_SURROGATE,
+        // four byte lead
+        UTF8_TOO_SHORT | UTF8_TOO_LARGE | UTF8_TOO_LARGE_1000 | UTF8_OVERLONG_4,
+    };
+
+    static const unsigned char byte1LowTable[16] = {
+        UTF8_CARRY | UTF8_OVERLONG_3 | UTF8_OVERLONG_2 | UTF8_OVERLONG_4,
+        UTF8_CARRY | UTF8_OVERLONG_2,
+        UTF8_CARRY,
+        UTF8_CARRY,
+        UTF8_CARRY | UTF8_TOO_LARGE,
+        UTF8_CARRY | UTF8_TOO_LARGE | UTF8_TOO_LARGE_1000,
+        UTF8_CARRY | UTF8_TOO_LARGE | UTF8_TOO_LARGE_1000,
+        UTF8_CARRY | UTF8_TOO_LARGE | UTF8_TOO_LARGE_1000,
+        UTF8_CARRY | UTF8_TOO_LARGE | UTF8_TOO_LARGE_1000,
+        UTF8_CARRY | UTF8_TOO_LARGE | UTF8_TOO_LARGE_1000,
+        UTF8_CARRY | UTF8_TOO_LARGE | UTF8_TOO_LARGE_1000,
+        UTF8_CARRY | UTF8_TOO_LARGE | UTF8_TOO_LARGE_1000,
+        UTF8_CARRY | UTF8_TOO_LARGE | UTF8_TOO_LARGE_1000,
+        UTF8_CARRY | UTF8_TOO_LARGE | UTF8_TOO_LARGE_1000 | UTF8_SURROGATE,
+        UTF8_CARRY | UTF8_TOO_LARGE | UTF8_TOO_LARGE_1000,
+        UTF8_CARRY | UTF8_TOO_LARGE | UTF8_TOO_LARGE_1000,
+    };
+
+    static const unsigned char byte2HighTable[16] = {
+        // ascii
+        UTF8_TOO_SHORT, UTF8_TOO_SHORT, UTF8_TOO_SHORT, UTF8_TOO_SHORT,
+        UTF8_TOO_SHORT, UTF8_TOO_SHORT, UTF8_TOO_SHORT, UTF8_TOO_SHORT,
+        // continuation, 1000, 1001, then 101x
+        UTF8_TOO_LONG | UTF8_OVERLONG_2 | UTF8_TWO_CONTS | UTF8_OVERLONG_3 | UTF8_TOO_LARGE_1000 | UTF8_OVERLONG_4,
+        UTF8_TOO_LONG | UTF8_OVERLONG_2 | UTF8_TWO_CONTS | UTF8_OVERLONG_3 | UTF8_TOO_LARGE,
+        UTF8_TOO_LONG | UTF8_OVERLONG_2 | UTF8_TWO_CONTS | UTF8_SURROGATE | UTF8_TOO_LARGE,
+        UTF8_TOO_LONG | UTF8_OVERLONG_2 | UTF8_TWO_CONTS | UTF8_SURROGATE | UTF8_TOO_LARGE,
+        // lead bytes
+        UTF8_TOO_SHORT, UTF8_TOO_SHORT, UTF8_TOO_SHORT, UTF8_TOO_SHORT,
+    };
+
+    __m256i byte1High = _mm256_shuffle_epi8(AVX2_TABLE(byte1HighTable),
+        _mm256_and_si256(_mm256_srli_epi16(prev1, 4), lowNibble));
+    __m256i byte1Low = _mm256_shuffle_epi8(AVX2_TABLE(byte1LowTable),
+        _mm256_and_si256(prev1, lowNibble));
+    __m256i byte2High = _mm256_shuffle_epi8(AVX2_TABLE(byte2HighTable),
+        _mm256_and_si256(_mm256_srli_epi16(v, 4), lowNibble));
+    __m256i special = _mm256_and_si256(_mm256_and_si256(byte1High, byte1Low), byte2High);
+
+    // the third and fourth bytes of a character must be continuations, and
+    // are the only continuations flagged as two continuations in a row
+    __m256i isThird = _mm256_subs_epu8(prev2, _mm256_set1_epi8((char)(0xE0 - 0x80)));
+    __m256i isFourth = _mm256_subs_epu8(prev3, _mm256_set1_epi8((char)(0xF0 - 0x80)));
+    __m256i mustBeContinuation = _mm256_and_si256(_mm256_or_si256(isThird, isFourth),
+        _mm256_set1_epi8((char)0x80));
+
+    return _mm256_xor_si256(mustBeContinuation, special);
+}
+
+AVX2_FN static size_t scanInvalidBytesAvx2(const unsigned char* buf, size_t start, size_t end) {
+    const __m256i maxControl = _mm256_set1_epi8(0x1F);
+    const __m256i tab = _mm256_set1_epi8('\t');
+    const __m256i tabToReturn = _mm256_set1_epi8('\r' - '\t');
+    const __m256i delete = _mm256_set1_epi8(0x7F);
+
+    // start is the first byte of a character, so is treated as following ascii
+    __m256i previous = _mm256_setzero_si256();
+    bool previousAscii = true;
+
+    size_t i = start;
+    for(; i + 32 <= end; i += 32) {
+        __m256i v = _mm256_loadu_si256((const __m256i*)&buf[i]);
+
+        __m256i control = _mm256_cmpeq_epi8(_mm256_min_epu8(v, maxControl), v);
+        __m256i offset = _mm256_sub_epi8(v, tab);
+        __m256i whitespace = _mm256_cmpeq_epi8(_mm256_min_epu8(offset, tabToReturn), offset);
+        __m256i errors = _mm256_or_si256(_mm256_andnot_si256(whitespace, control),
+            _mm256_cmpeq_epi8(v, delete));
+
+        // characters in an ascii block can only be invalid if one from the
+        // previous block continues into it
+        bool ascii = _mm256_movemask_epi8(v) == 0;
+        if(!ascii || !previousAscii) {
+            errors = _mm256_or_si256(errors, utf8ErrorsAvx2(v, previous));
+        }
+
+        if(!_mm256_testz_si256(errors, errors)) {
+            break;
+        }
+
+        previous = v;
+        previousAscii = ascii;
+    }
+
+    // the exact position is left to the scalar code, starting from the
+    // character that could continue into the block not checked
+    return charStartBefore(buf, start, i);
+}
+#endif
+
+size_t scanInvalidBytes(const unsigned char* buf, size_t start, size_t end) {
+    size_t i = start;
+
+#ifdef BYTE_SCAN_AVX2
+    if(hasAvx2()) {
+        i = scanInvalidBytesAvx2(buf, i, end);
+    }
+#endif
+
+#ifdef __SSE2__
+    if(scanLevel >= SCAN_LEVEL_SSE2) {
+        // without shuffles, only blocks of ascii text are checked in bulk, with
+        // the characters starting in any other block checked one at a time
+        const __m128i maxControl = _mm_set1_epi8(0x1F);
+        const __m128i tab = _mm_set1_epi8('\t');
+        const __m128i tabToReturn = _mm_set1_epi8('\r' - '\t');
+        const __m128i delete = _mm_set1_epi8(0x7F);
+
+        while(i + 16 <= end) {
+            __m128i v = _mm_loadu_si128((const __m128i*)&buf[i]);
+
+            __m128i control = _mm_cmpeq_epi8(_mm_min_epu8(v, maxControl), v);
+            __m128i offset = _mm_sub_epi8(v, tab);
+            __m128i whitespace = _mm_cmpeq_epi8(_mm_min_epu8(offset, tabToReturn), offset);
+            __m128i errors = _mm_or_si128(_mm_andnot_si128(whitespace, control),
+                _mm_cmpeq_epi8(v, delete));
+
+            if(_mm_movemask_epi8(_mm_or_si128(errors, v)) == 0) {
+                i += 16;
+                continue;
+            }
+
+            size_t next = scanInvalidBytesScalar(buf, i, i + 16, end);
+            if(next < i + 16) {
+                return next;
+            }
+            i = next;
+        }
+    }
+#endif
+
+    return scanInvalidBytesScalar(buf, i, end, end);
+}
+
+// whitespace skipped by the lexer, '\r' is not included as it is never in a
+// clean region
+static bool isBlank(unsigned char c) {
+    return c == ' ' || (c >= '\t' && c <= '\f');
+}
+
+#ifdef BYTE_SCAN_AVX2
+AVX2_FN static size_t scanWhitespaceAvx2(const unsigned char* buf, size_t i, size_t end) {
+    const __m256i space = _mm256_set1_epi8(' ');
+    const __m256i tab = _mm256_set1_epi8('\t');
+    const __m256i tabToFormFeed = _mm256_set1_epi8('\f' - '\t');
+
+    for(; i + 32 <= end; i += 32) {
+        __m256i v = _mm256_loadu_si256((const __m256i*)&buf[i]);
+        __m256i offset = _mm256_sub_epi8(v, tab);
+        __m256i blank = _mm256_or_si256(_mm256_cmpeq_epi8(v, space),
+            _mm256_cmpeq_epi8(_mm256_min_epu8(offset, tabToFormFeed), offset));
+        uint32_t mask = ~(uint32_t)_mm256_movemask_epi8(blank);
+        if(mask != 0) {
+            return i + __builtin_ctz(mask);
+        }
+    }
+    return i;
+}
+#endif
+
+size_t scanWhitespace(const unsigned char* buf, size_t start, size_t end) {
+    size_t i = start;
+
+#ifdef BYTE_SCAN_AVX2
+    if(hasAvx2()) {
+        i = scanWhitespaceAvx2(buf, i, end);
+    }
+#endif
+
+#ifdef __SSE2__
+    if(scanLevel >= SCAN_LEVEL_SSE2) {
+        const __m128i space = _mm_set1_epi8(' ');
+        const __m128i tab = _mm_set1_epi8('\t');
+        const __m128i tabToFormFeed = _mm_set1_epi8('\f' - '\t');
+
+        for(; i + 16 <= end; i += 16) {
+            __m128i v = _mm_loadu_si128((const __m128i*)&buf[i]);
+            __m128i offset = _mm_sub_epi8(v, tab);
+            __m128i blank = _mm_or_si128(_mm_cmpeq_epi8(v, space),
+                _mm_cmpeq_epi8(_mm_min_epu8(offset, tabToFormFeed), offset));
+            int mask = _mm_movemask_epi8(blank) ^ 0xFFFF;
+            if(mask != 0) {
+                return i + __builtin_ctz(mask);
+            }
+        }
+    }
+#endif
+
+    while(i < end && isBlank(buf[i])) {
+        i++;
+    }
+    return i;
+}
+
+#ifdef BYTE_SCAN_AVX2
+AVX2_FN static size_t scanNewLineAvx2(const unsigned char* buf, size_t i, size_t end) {
+    const __m256i newLine = _mm256_set1_epi8('\n');
+
+    for(; i + 32 <= end; i += 32) {
+        __m256i v = _mm256_loadu_si256((const __m256i*)&buf[i]);
+        uint32_t mask = _mm256_movemask_epi8(_mm256_cmpeq_epi8(v, newLine));
+        if(mask != 0) {
+            return i + __builtin_ctz(mask);
+        }
+    }
+    return i;
+}
+#endif
+
+size_t scanNewLine(const unsigned char* buf, size_t start, size_t end) {
+    size_t i = start;
+
+#ifdef BYTE_SCAN_AVX2
+    if(hasAvx2()) {
+        i = scanNewLineAvx2(buf, i, end);
+    }
+#endif
+
+#ifdef __SSE2__
+    if(scanLevel >= SCAN_LEVEL_SSE2) {
+        const __m128i newLine = _mm_set1_epi8('\n');
+
+        for(; i + 16 <= end; i += 16) {
+            __m128i v = _mm_loadu_si128((const __m128i*)&buf[i]);
+            int mask = _mm_movemask_epi8(_mm_cmpeq_epi8(v, newLine));
+            if(mask != 0) {
+                return i + __builtin_ctz(mask);
+            }
+        }
+    }
+#endif
+
+    while(i < end && buf[i] != '\n') {
+        i++;
+    }
+    return i;
+}
+
+#ifdef BYTE_SCAN_AVX2
+AVX2_FN static size_t scanLineEndAvx2(const unsigned char* buf, size_t i, size_t end) {
+    const __m256i newLine = _mm256_set1_epi8('\n');
+    const __m256i carriageReturn = _mm256_set1_epi8('\r');
+
+    for(; i + 32 <= end; i += 32) {
+        __m256i v = _mm256_loadu_si256((const __m256i*)&buf[i]);
+        __m256i lineEnd = _mm256_or_si256(_mm256_cmpeq_epi8(v, newLine),
+            _mm256_cmpeq_epi8(v, carriageReturn));
+        uint32_t mask = _mm256_movemask_epi8(lineEnd);
+        if(mask != 0) {
+            return i + __builtin_ctz(mask);
+        }
+    }
+    return i;
+}
+#endif
+
+size_t scanLineEnd(const unsigned char* buf, size_t start, size_t end) {
+    size_t i = start;
+
+#ifdef BYTE_SCAN_AVX2
+    if(hasAvx2()) {
+        i = scanLineEndAvx2(buf, i, end);
+    }
+#endif
+
+#ifdef __SSE2__
+    if(scanLevel >= SCAN_LEVEL_SSE2) {
+        const __m128i newLine = _mm_set1_epi8('\n');
+        const __m128i carriageReturn = _mm_set1_epi8('\r');
+
+        for(; i + 16 <= end; i += 16) {
+            __m128i v = _mm_loadu_si128((const __m128i*)&buf[i]);
+            __m128i lineEnd = _mm_or_si128(_mm_cmpeq_epi8(v, newLine),
+                _mm_cmpeq_epi8(v, carriageReturn));
+            int mask = _mm_movemask_epi8(lineEnd);
+            if(mask != 0) {
+                return i + __builtin_ctz(mask);
+            }
+        }
+    }
+#endif
+
+    while(i < end && buf[i] != '\n' && buf[i] != '\r') {
+        i++;
+    }
+    return i;
+}
+
+// The '*' and '/' are found by comparing two loads offset by one byte, so a
+// "*/" straddling two blocks is still found as one pair
+#ifdef BYTE_SCAN_AVX2
+AVX2_FN static size_t scanCommentEndAvx2(const unsigned char* buf, size_t i, size_t end) {
+    const __m256i star = _mm256_set1_epi8('*');
+    const __m256i slash = _mm256_set1_epi8('/');
+
+    for(; i + 33 <= end; i += 32) {
+        __m256i first = _mm256_loadu_si256((const __m256i*)&buf[i]);
+        __m256i second = _mm256_loadu_si256((const __m256i*)&buf[i + 1]);
+        __m256i pair = _mm256_and_si256(_mm256_cmpeq_epi8(first, star),
+            _mm256_cmpeq_epi8(second, slash));
+        uint32_t mask = _mm256_movemask_epi8(pair);
+        if(mask != 0) {
+            return i + __builtin_ctz(mask);
+        }
+    }
+    return i;
+}
+#endif
+
+size_t scanCommentEnd(const unsigned char* buf, size_t start, size_t end) {
+    size_t i = start;
+
+#ifdef BYTE_SCAN_AVX2
+    if(hasAvx2()) {
+        i = scanCommentEndAvx2(buf, i, end);
+        if(i + 1 < end && buf[i] == '*' && buf[i + 1] == '/') {
+            return i;
+        }
+    }
+#endif
+
+#ifdef __SSE2__
+    if(scanLevel >= SCAN_LEVEL_SSE2) {
+        const __m128i star = _mm_set1_epi8('*');
+        const __m128i slash = _mm_set1_epi8('/');
+
+        for(; i + 17 <= end; i += 16) {
+            __m128i first = _mm_loadu_si128((const __m128i*)&buf[i]);
+            __m128i second = _mm_loadu_si128((const __m128i*)&buf[i + 1]);
+            __m128i pair = _mm_and_si128(_mm_cmpeq_epi8(first, star),
+                _mm_cmpeq_epi8(second, slash));
+            int mask = _mm_movemask_epi8(pair);
+            if(mask != 0) {
+                return i + __builtin_ctz(mask);
+            }
+        }
+    }
+#endif
+
+    for(; i + 1 < end; i++) {
+        if(buf[i] == '*' && buf[i + 1] == '/') {
+            return i;
+        }
+    }
+    return i < end ? i : end;
+}
+
+#ifdef BYTE_SCAN_AVX2
+AVX2_FN static size_t countNewLinesAvx2(const unsigned char* buf, size_t* i, size_t end, size_t* last) {
+    const __m256i newLine = _mm256_set1_epi8('\n');
+    size_t count = 0;
+
+    for(; *i + 32 <= end; *i += 32) {
+        __m256i v = _mm256_loadu_si256((const __m256i*)&buf[*i]);
+        uint32_t mask = _mm256_movemask_epi8(_mm256_cmpeq_epi8(v, newLine));
+        if(mask != 0) {
+            count += __builtin_popcount(mask);
+            *last = *i + 31 - __builtin_clz(mask);
+        }
+    }
+    return count;
+}
+#endif
+
+size_t countNewLines(const unsigned char* buf, size_t start, size_t end, size_t* last) {
+    size_t i = start;
+    size_t count = 0;
+
+#ifdef BYTE_SCAN_AVX2
+    if(hasAvx2()) {
+        count += countNewLinesAvx2(buf, &i, end, last);
+    }
+#endif
+
+#ifdef __SSE2__
+    if(scanLevel >= SCAN_LEVEL_SSE2) {
+        const __m128i newLine = _mm_set1_epi8('\n');
+
+        for(; i + 16 <= end; i += 16) {
+            __m128i v = _mm_loadu_si128((const __m128i*)&buf[i]);
+            unsigned int mask = _mm_movemask_epi8(_mm_cmpeq_epi8(v, newLine));
+            if(mask != 0) {
+                count += __builtin_popcount(mask);
+                *last = i + 31 - __builtin_clz(mask);
+            }
+        }
+    }
+#endif
+
+    for(; i < end; i++) {
+        if(buf[i] == '\n') {
+            count++;
+            *last = i;
+        }
+    }
+    return count;
+}
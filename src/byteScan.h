@@ -0,0 +1,52 @@
+#ifndef BYTE_SCAN_H
+#define BYTE_SCAN_H
+
+#include <stddef.h>
+#include <stdbool.h>
+
+// Bulk searches over the lexer's source buffer, using sse2 when the compiler
+// targets it and a plain loop otherwise.  Where it helps, avx2 versions are
+// also used if the cpu supports them, checked at runtime.  All only read the
+// bytes in [start, end), so they are safe to use on memory mapped files.
+
+// The instruction sets the searches are allowed to use, each level also
+// allowing the ones before it.  Only lowered to compare the paths' speeds,
+// see runScanBenchmark, and never while other threads are searching.
+typedef enum ByteScanLevel {
+    SCAN_LEVEL_SCALAR,
+    SCAN_LEVEL_SSE2,
+    SCAN_LEVEL_AVX2,
+} ByteScanLevel;
+
+void byteScanSetLevel(ByteScanLevel level);
+
+// the fastest level the compiler's target and the cpu running it support
+ByteScanLevel byteScanMaxLevel(void);
+
+// find the first byte that phases 1 or 2 of the lexer cannot pass through
+// unchanged: '\\', '\r' and '?' if trigraphs are enabled.  Returns end if
+// there are none.  Bytes found by scanInvalidBytes are not included.
+size_t scanSpecialBytes(const unsigned char* buf, size_t start, size_t end, bool trigraphs);
+
+// find the first byte that is not part of a valid utf8 character, or is a
+// control character other than "\t\n\v\f\r", checking characters from
+// start, which must be the first byte of one.  Returns end if there are none.
+size_t scanInvalidBytes(const unsigned char* buf, size_t start, size_t end);
+
+// find the first byte that is not one of " \t\n\v\f", or end
+size_t scanWhitespace(const unsigned char* buf, size_t start, size_t end);
+
+// find the first '\n', or end
+size_t scanNewLine(const unsigned char* buf, size_t start, size_t end);
+
+// find the first '\n' or '\r', or end
+size_t scanLineEnd(const unsigned char* buf, size_t start, size_t end);
+
+// find the '*' of the first "*/", or end - 1 if there is none, as the last
+// byte could be the start of a "*/" that continues past the end
+size_t scanCommentEnd(const unsigned char* buf, size_t start, size_t end);
+
+// count the '\n' bytes, setting last to the index of the final one found
+size_t countNewLines(const unsigned char* buf, size_t start, size_t end, size_t* last);
+
+#endif
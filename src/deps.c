@@ -0,0 +1,135 @@
+#include "deps.h"
+
+#include <stdio.h>
+#include <string.h>
+#include "file.h"
+#include "lex.h"
+
+void DepsInit(DepsList* list) {
+    ARRAY_ALLOC(DepsUnit, *list, unit);
+}
+
+// the file name without its directory, with its extension replaced by ".o"
+static const char* depsDefaultTarget(const char* file) {
+    const char* name = file;
+    for(const char* c = file; *c != '\0'; c++) {
+        if(*c == '/' || *c == '\\') name = c + 1;
+    }
+
+    const char* extension = strrchr(name, '.');
+    size_t length = extension != NULL ? (size_t)(extension - name) : strlen(name);
+
+    char* target = ArenaAlloc(length + 3);
+    memcpy(target, name, length);
+    memcpy(target + length, ".o", 3);
+    return target;
+}
+
+void DepsAdd(DepsList* list, TranslationContext* ctx, const char* target) {
+    const char* file = (const char*)ctx->fileName;
+
+    // each translation unit gets a new array, so this one is not changed
+    DepsUnit unit = {
+        .file = file,
+        .target = target != NULL ? target : depsDefaultTarget(file),
+        .dependencys = ctx->dependencys,
+        .dependencyCount = ctx->dependencyCount,
+    };
+    ARRAY_PUSH(*list, unit, unit);
+}
+
+static FILE* depsOpen(const char* path) {
+    if(strcmp(path, "-") == 0) {
+        return stdout;
+    }
+
+    FILE* f = fopen(path, "w");
+    if(f == NULL) {
+        fprintf(stderr, "Error: could not create dependency file %s\n", path);
+    }
+    return f;
+}
+
+static bool depsClose(FILE* f, const char* path) {
+    bool ok = !ferror(f);
+    if(f == stdout) {
+        ok = fflush(f) == 0 && ok;
+    } else {
+        ok = fclose(f) == 0 && ok;
+    }
+
+    if(!ok) {
+        fprintf(stderr, "Error: could not write dependency file %s\n", path);
+    }
+    return ok;
+}
+
+// write a file name so make reads it as one name
+static void depsWriteMakeName(FILE* f, const char* name) {
+    for(const char* c = name; *c != '\0'; c++) {
+        switch(*c) {
+            case ' ': fputs("\\ ", f); break;
+            case '#': fputs("\\#", f); break;
+            case '$': fputs("$$", f); break;
+            default: fputc(*c, f); break;
+        }
+    }
+}
+
+bool DepsWriteMake(DepsList* list, const char* path) {
+    FILE* f = depsOpen(path);
+    if(f == NULL) return false;
+
+    for(size_t i = 0; i < list->unitCount; i++) {
+        DepsUnit* unit = &list->units[i];
+
+        depsWriteMakeName(f, unit->target);
+        fputc(':', f);
+        for(size_t j = 0; j < unit->dependencyCount; j++) {
+            fputs(" \\\n  ", f);
+            depsWriteMakeName(f, pathRelativeToStartup(unit->dependencys[j]));
+        }
+        fputc('\n', f);
+    }
+
+    return depsClose(f, path);
+}
+
+static void depsWriteJsonString(FILE* f, const char* str) {
+    fputc('"', f);
+    for(const unsigned char* c = (const unsigned char*)str; *c != '\0'; c++) {
+        if(*c == '"' || *c == '\\') {
+            fprintf(f, "\\%c", *c);
+        } else if(*c < 0x20) {
+            fprintf(f, "\\u%04x", *c);
+        } else {
+            fputc(*c, f);
+        }
+    }
+    fputc('"', f);
+}
+
+bool DepsWriteJson(DepsList* list, const char* path) {
+    FILE* f = depsOpen(path);
+    if(f == NULL) return false;
+
+    fputs("[\n", f);
+    for(size_t i = 0; i < list->unitCount; i++) {
+        DepsUnit* unit = &list->units[i];
+
+        fputs("  {\n    \"file\": ", f);
+        depsWriteJsonString(f, unit->file);
+        fputs(",\n    \"target\": ", f);
+        depsWriteJsonString(f, unit->target);
+        fputs(",\n    \"dependencies\": [", f);
+        for(size_t j = 0; j < unit->dependencyCount; j++) {
+            fputs(j == 0 ? "\n      " : ",\n      ", f);
+            depsWriteJsonString(f, pathRelativeToStartup(unit->dependencys[j]));
+        }
+        fputs(unit->dependencyCount > 0 ? "\n    ]\n  }" : "]\n  }", f);
+        fputs(i + 1 < list->unitCount ? ",\n" : "\n", f);
+    }
+    fputs("]\n", f);
+
+    return depsClose(f, path);
+}
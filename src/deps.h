@@ -0,0 +1,40 @@
+#ifndef DEPS_H
+#define DEPS_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include "memory.h"
+
+// Dependency files, listing the files each translation unit includes, as
+// found by runScanDeps.  They can be written as a Makefile rule, which Ninja
+// also reads as a depfile, or as JSON for other build tools.
+
+struct TranslationContext;
+
+typedef struct DepsUnit {
+    // the input file, and the file the rule is for in a Makefile
+    const char* file;
+    const char* target;
+
+    // the input file, then every file it includes
+    const char** dependencys;
+    size_t dependencyCount;
+} DepsUnit;
+
+typedef struct DepsList {
+    ARRAY_DEFINE(DepsUnit, unit);
+} DepsList;
+
+void DepsInit(DepsList* list);
+
+// add the dependencies found by runScanDeps for the translation unit that
+// was just scanned.  If target is NULL, the input file with its extension
+// replaced by ".o" is used, like gcc -M.
+void DepsAdd(DepsList* list, struct TranslationContext* ctx, const char* target);
+
+// write the dependencies to path, or to stdout if it is "-", returns false
+// if the file could not be written
+bool DepsWriteMake(DepsList* list, const char* path);
+bool DepsWriteJson(DepsList* list, const char* path);
+
+#endif
@@ -11,7 +11,12 @@
 #include "parser.h"
 #include "x64Encode.h"
 #include "lex.h"
+#include "pch.h"
+#include "deps.h"
+#include "thread.h"
+#include "prefetch.h"
 #include "test.h"
+#include "scanBench.h"
 #include "colorText.h"
 
 static struct stringList files = {0};
@@ -22,6 +27,13 @@ static int translationPhaseCount = 8;
 static const char* testPath = ".";
 static const char* tempPath = "./testTemp/";
 static bool disableColor = false;
+static const char* depFile = NULL;
+static const char* depJson = NULL;
+static const char* depTarget = NULL;
+static int jobCount = 1;
+static bool prefetchIncludes = false;
+static int benchSize = 64;
+static int benchRuns = 5;
 
 static void preprocessFlag(struct argParser* parser, void* _) {
     (void)_;
@@ -48,19 +60,151 @@ static void preprocessFlag(struct argParser* parser, void* _) {
 }
 
 typedef enum topModes {
-    MODE_TEST
+    MODE_TEST,
+    MODE_BENCH_SCAN,
 } topModes;
 
 void (*counts[])(TranslationContext*) = {
     runPhase1, runPhase2, runPhase3, runPhase4, runPhase5,
 };
 
+// start reading included files on another thread, if it is enabled
+static void startPrefetch(TranslationContext* ctx) {
+    if(prefetchIncludes) {
+        ctx->prefetch = PrefetcherStart(includeFiles.datas, includeFiles.dataCount);
+    }
+}
+
+// stop the thread, counting the files it read for -print-stats
+static void stopPrefetch(TranslationContext* ctx) {
+    if(ctx->prefetch != NULL) {
+        PrefetcherStop(ctx->prefetch);
+        PrefetcherAddStats(ctx->prefetch, &ctx->prefetchReady,
+            &ctx->prefetchWaited, &ctx->prefetchMissed);
+        ctx->prefetchers++;
+    }
+}
+
+// the input files shared by the threads running preprocessJobs
+typedef struct PreprocessJobs {
+    TranslationContext* settings;
+
+    // the next file to be preprocessed
+    ThreadCounter nextFile;
+
+    // the output of each file, written to stdout in order once all of them
+    // are done, so it does not depend on which thread ran first
+    FILE** outputs;
+} PreprocessJobs;
+
+typedef struct PreprocessWorker {
+    PreprocessJobs* jobs;
+    Thread thread;
+
+    // only used by the worker's thread, as none of it can be shared
+    TranslationContext ctx;
+    MemoryPool pool;
+    bool hadError;
+} PreprocessWorker;
+
+// preprocess files until there are none left, each thread keeps the same
+// context for all of its files, so files it has already read are cached
+static void preprocessJobs(void* voidWorker) {
+    PreprocessWorker* worker = voidWorker;
+    PreprocessJobs* jobs = worker->jobs;
+
+    memoryPoolAlloc(&worker->pool, 64ULL*GiB);
+    worker->ctx = *jobs->settings;
+
+    // the other threads are busy with the other files, so each file is
+    // only lexed by one thread
+    worker->ctx.lexJobs = 1;
+
+    IncludeSearchPathInit(&worker->ctx.search, SYSTEM_MINGW_W64, includeFiles.datas, includeFiles.dataCount);
+    TranslationContextInit(&worker->ctx, &worker->pool);
+    startPrefetch(&worker->ctx);
+
+    while(true) {
+        long i = ThreadCounterIncrement(&jobs->nextFile);
+        if(i >= (long)files.dataCount) break;
+
+        FILE* output = createTempFile();
+        if(output == NULL) {
+            fprintf(stderr, "Error: could not create temporary file for %s\n", files.datas[i]);
+            worker->hadError = true;
+            continue;
+        }
+
+        worker->ctx.fileName = (unsigned char*)files.datas[i];
+        worker->ctx.output = output;
+        counts[translationPhaseCount-1](&worker->ctx);
+        jobs->outputs[i] = output;
+    }
+
+    stopPrefetch(&worker->ctx);
+}
+
+// preprocess every input file with up to jobCount threads, one per file at most
+static bool preprocessParallel(TranslationContext* settings) {
+    PreprocessJobs jobs = {
+        .settings = settings,
+        .nextFile = 0,
+        .outputs = ArenaAlloc(sizeof(FILE*) * files.dataCount),
+    };
+    for(unsigned int i = 0; i < files.dataCount; i++) {
+        jobs.outputs[i] = NULL;
+    }
+
+    // a thread with no file to take would still reserve its memory and
+    // start a prefetcher
+    int threadCount = jobCount;
+    if((unsigned int)threadCount > files.dataCount) {
+        threadCount = files.dataCount;
+    }
+
+    PreprocessWorker* workers = ArenaAlloc(sizeof(PreprocessWorker) * threadCount);
+    for(int i = 0; i < threadCount; i++) {
+        workers[i].jobs = &jobs;
+        workers[i].hadError = false;
+        workers[i].thread = ThreadStart(preprocessJobs, &workers[i]);
+    }
+    // each worker has its own error flag, as the threads cannot write to
+    // the same one
+    bool hadError = false;
+    for(int i = 0; i < threadCount; i++) {
+        if(workers[i].thread == NULL) continue;
+        ThreadJoin(workers[i].thread);
+        TranslationContextAddStats(settings, &workers[i].ctx);
+        hadError |= workers[i].hadError;
+    }
+
+    char buffer[4096];
+    for(unsigned int i = 0; i < files.dataCount; i++) {
+        FILE* output = jobs.outputs[i];
+        if(output == NULL) {
+            // not preprocessed, if no threads could be started
+            hadError = true;
+            continue;
+        }
+
+        rewind(output);
+        size_t length;
+        while((length = fread(buffer, 1, sizeof(buffer), output)) > 0) {
+            fwrite(buffer, 1, length, stdout);
+        }
+        fclose(output);
+    }
+
+    return !hadError;
+}
+
 int driver(int argc, char** argv) {
     initialiseColor();
 
     TranslationContext ctx = {
         .trigraphs = false,
         .tabSize = 4,
+        .lexChunkSize = 1*MiB,
     };
 
     struct argArgument color = {"-color", 'c', "disable color errors", argSet, &disableColor};
@@ -72,17 +216,31 @@ int driver(int argc, char** argv) {
             color,
             {0},
         }},
+        [MODE_BENCH_SCAN] = {"$bench-scan", '\0', "time the lexer's byte searches", argMode, (struct argArgument[]) {
+            {"-size", 's', "MiB of text searched", argInt, &benchSize},
+            {"-runs", 'r', "number of times each search is run", argInt, &benchRuns},
+            {0},
+        }},
         {"!input", '\0', "file to process", argPush, &files},
         {"-print-ast", 'a', "prints the ast to stdout", argSet, &printAst},
         {"-print-ir", 'i', "prints the ir to stdout", argSet, &printIr},
         {"-phase-count", 'E', "emit preprocessed output", preprocessFlag},
         {"-include", 'I', "add file to the include path", argPush, &includeFiles},
+        {"-jobs", 'j', "number of threads to preprocess with", argInt, &jobCount},
+        {"-print-stats", '\0', "prints preprocessor statistics to stderr", argSet, &ctx.printStats},
+        {"-pch-create", '\0', "save the macros defined to a precompiled header", argOneString, &ctx.pchCreate},
+        {"-pch-use", '\0', "start with the macros from a precompiled header", argOneString, &ctx.pchUse},
+        {"-scan-deps", '\0', "only find included files, writing a makefile depfile", argOneString, &depFile},
+        {"-scan-deps-json", '\0', "only find included files, writing them as json", argOneString, &depJson},
+        {"-deps-target", '\0', "target of the rules in the makefile depfile", argOneString, &depTarget},
         {"-feature", 'f', "Enable or disable a feature", argMap, &(struct argMapData) {
             .args = (struct argMapElement[]) {
                 {"trigraphs", argBool, &ctx.trigraphs},
                 {"macro-optional-variadac", argBool, &ctx.optionalVariadacArgs},
                 {"macro-va-comma", argBool, &ctx.gccVariadacComma},
                 {"tab-size", argInt, &ctx.tabSize},
+                {"lex-chunk-size", argInt, &ctx.lexChunkSize},
+                {"prefetch-includes", argBool, &prefetchIncludes},
                 {"extension", argAlias, &(char*[]) {
                     "-fmacro-optional-variadac", "-fmacro-va-comma", 0
                 }},
@@ -108,19 +266,78 @@ int driver(int argc, char** argv) {
         return runTests(testPath, tempPath);
     }
 
+    if(topArguments[MODE_BENCH_SCAN].isDone) {
+        return runScanBenchmark(benchSize, benchRuns);
+    }
+
+    if(ctx.lexChunkSize < 1) {
+        fprintf(stderr, "Error: -flex-chunk-size must be at least 1\n");
+        return EXIT_FAILURE;
+    }
+    ctx.lexJobs = jobCount;
+
+    // the macros saved would only be the last file's
+    if(ctx.pchCreate != NULL && files.dataCount > 1) {
+        fprintf(stderr, "Error: --pch-create can only be used with one input file\n");
+        return EXIT_FAILURE;
+    }
+
+    // checked before any file is preprocessed, so a bad file fails the run
+    // once instead of being reported by each file
+    if(ctx.pchUse != NULL && !PchOpen(&ctx, ctx.pchUse)) {
+        return EXIT_FAILURE;
+    }
+
     MemoryPool pool;
     memoryPoolAlloc(&pool, 1ULL*TiB);
 
     IncludeSearchPath search;
     IncludeSearchPathInit(&search, SYSTEM_MINGW_W64, includeFiles.datas, includeFiles.dataCount);
 
+    if(depFile != NULL || depJson != NULL) {
+        ctx.search = search;
+        TranslationContextInit(&ctx, &pool);
+        startPrefetch(&ctx);
+
+        DepsList deps;
+        DepsInit(&deps);
+        for(unsigned int i = 0; i < files.dataCount; i++) {
+            ctx.fileName = (unsigned char*)files.datas[i];
+            runScanDeps(&ctx);
+            DepsAdd(&deps, &ctx, depTarget);
+        }
+        stopPrefetch(&ctx);
+
+        if(depFile != NULL && !DepsWriteMake(&deps, depFile)) {
+            return EXIT_FAILURE;
+        }
+        if(depJson != NULL && !DepsWriteJson(&deps, depJson)) {
+            return EXIT_FAILURE;
+        }
+        if(ctx.printStats) TranslationContextPrintStats(&ctx);
+        return EXIT_SUCCESS;
+    }
+
+    if(translationPhaseCount != 8 && jobCount > 1 && files.dataCount > 1) {
+        TranslationContextInit(&ctx, &pool);
+        bool success = preprocessParallel(&ctx);
+        if(ctx.printStats) TranslationContextPrintStats(&ctx);
+        return success ? EXIT_SUCCESS : EXIT_FAILURE;
+    }
+
     if(translationPhaseCount != 8) {
         ctx.search = search;
         TranslationContextInit(&ctx, &pool);
+        startPrefetch(&ctx);
         for(unsigned int i = 0; i < files.dataCount; i++) {
             ctx.fileName = (unsigned char*)files.datas[i];
             counts[translationPhaseCount-1](&ctx);
         }
+        stopPrefetch(&ctx);
+        if(ctx.pchCreate != NULL && !PchWrite(&ctx, ctx.pchCreate)) {
+            return EXIT_FAILURE;
+        }
+        if(ctx.printStats) TranslationContextPrintStats(&ctx);
         return EXIT_SUCCESS;
     }
 
@@ -3,6 +3,7 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <stdint.h>
+#include <string.h>
 
 #define __USE_MINGW_ANSI_STDIO 1
 
@@ -10,6 +11,8 @@
 #define UNICODE
 #define NTDDI_VERSION 0x06000000
 #include <windows.h>
+#include <io.h>
+#include <fcntl.h>
 #include <pathcch.h>
 #include <knownfolders.h>
 #include <shlobj.h>
@@ -43,6 +46,20 @@ Path getStartupDirectory() {
     return currentDirectory;
 }
 
+const char* pathRelativeToStartup(const char* path) {
+    static char* startup = NULL;
+    static size_t startupLength;
+    if(startup == NULL) {
+        startup = wcharToChar(currentDirectory.buf, &startupLength);
+    }
+
+    // paths are case insensitive, and the startup directory ends in '\'
+    if(strnicmp(path, startup, startupLength) == 0) {
+        return path + startupLength;
+    }
+    return path;
+}
+
 // Attempt to findd MinGW based on where it installed itself on my computer
 // only detects the 64 bit version, no plans for 32 bit support
 static void FindMinGWW64WinBuilds(IncludeSearchPath* search) {
@@ -255,6 +272,7 @@ void IncludeSearchPathInit(IncludeSearchPath* search, SystemType type, const cha
     // alloc, add system include paths, %path%
     ARRAY_ALLOC(Path, *search, system);
     ARRAY_ALLOC(Path, *search, user);
+    TABLE_INIT(search->cache, IncludeCacheEntry*);
 
     if(type & SYSTEM_MINGW_W64) {
         FindMinGWW64WinBuilds(search);
@@ -293,46 +311,139 @@ static const char* includeValidCheck(Path* currentPath, const char* fileName) {
     return cbuf;
 }
 
-const char* IncludeSearchPathFindSys(IncludeSearchState* state, IncludeSearchPath* path, const char* fileName) {
-    size_t checkedCount = 0;
-    if(state->hasStarted) {
-        checkedCount = state->checkedCount;
-        if(state->inUser) return IncludeSearchPathFindUser(state, path, fileName);
-    } else {
-        state->checkedCount = 0;
-        state->inUser = false;
-        state->hasStarted = true;
+// Load the names in a directory, converted to lower case as file names are
+// not case sensitive, so includes can be ruled out without asking the file
+// system about each name in each directory.
+static void loadDirectoryEntries(Path* dir) {
+    dir->entries = ArenaAlloc(sizeof(Table));
+    TABLE_INIT(*dir->entries, char*);
+
+    wchar_t* search;
+    PathAllocCombine(dir->buf, TEXT("*"), PATHCCH_ENSURE_IS_EXTENDED_LENGTH_PATH, &search);
+
+    WIN32_FIND_DATAW ffd;
+    HANDLE hFind = FindFirstFileW(search, &ffd);
+    LocalFree(search);
+
+    if(hFind == INVALID_HANDLE_VALUE) {
+        return;
     }
 
-    for(unsigned int i = checkedCount; i < path->systemCount; i++) {
-        state->checkedCount++;
-        const char* res = includeValidCheck(&path->systems[i], fileName);
-        if(res != NULL) return res;
+    do {
+        size_t len;
+        char* name = wcharToChar(ffd.cFileName, &len);
+        for(size_t i = 0; i < len; i++) {
+            if(name[i] >= 'A' && name[i] <= 'Z') name[i] += 'a' - 'A';
+        }
+        TABLE_SET(*dir->entries, name, len, name);
+    } while(FindNextFileW(hFind, &ffd));
+
+    FindClose(hFind);
+}
+
+// could the file exist in the directory?  Only the first part of the file
+// name is checked, e.g. "sys" for "sys/types.h", so this can return true
+// for files that do not exist, but never false for ones that do.
+static bool directoryMightContain(Path* dir, const char* fileName) {
+    size_t len = strcspn(fileName, "/\\");
+    if(len == 0 || fileName[len - 1] == ':' ||
+        (len <= 2 && strspn(fileName, ".") == len)) {
+        // absolute paths, drive letters, "." and ".."
+        return true;
     }
 
-    return NULL;
+    if(dir->entries == NULL) {
+        loadDirectoryEntries(dir);
+    }
+
+    // only ASCII letters are folded to lower case, the file system also
+    // folds other letters, so names with them could still match
+    char buf[MAX_PATH];
+    if(len >= sizeof(buf)) return true;
+    for(size_t i = 0; i < len; i++) {
+        char c = fileName[i];
+        if((unsigned char)c >= 0x80) return true;
+        buf[i] = c >= 'A' && c <= 'Z' ? c + 'a' - 'A' : c;
+    }
+
+    return tableHas(dir->entries, buf, len);
 }
 
-const char* IncludeSearchPathFindUser(IncludeSearchState* state, IncludeSearchPath* path, const char* fileName) {
-    size_t checkedCount = 0;
-    if(state->hasStarted) {
-        checkedCount = state->checkedCount;
-        if(!state->inUser) return IncludeSearchPathFindSys(state, path, fileName);
-    } else {
-        state->checkedCount = 0;
-        state->inUser = true;
-        state->hasStarted = true;
+static const char* includeDirectoryCheck(Path* currentPath, const char* fileName) {
+    if(!currentPath->valid) return NULL;
+    if(!directoryMightContain(currentPath, fileName)) return NULL;
+    return includeValidCheck(currentPath, fileName);
+}
+
+static const char* searchSys(IncludeSearchState* state, IncludeSearchPath* path, const char* fileName) {
+    for(size_t i = state->checkedCount; i < path->systemCount; i++) {
+        state->checkedCount = i + 1;
+        const char* res = includeDirectoryCheck(&path->systems[i], fileName);
+        if(res != NULL) return res;
     }
 
-    for(unsigned int i = checkedCount; i < path->userCount; i++) {
-        state->checkedCount = i;
-        const char* res = includeValidCheck(&path->users[i], fileName);
+    return NULL;
+}
+
+static const char* searchUser(IncludeSearchState* state, IncludeSearchPath* path, const char* fileName) {
+    for(size_t i = state->checkedCount; i < path->userCount; i++) {
+        state->checkedCount = i + 1;
+        const char* res = includeDirectoryCheck(&path->users[i], fileName);
         if(res != NULL) return res;
     }
 
+    // user includes also search the system paths
     state->checkedCount = 0;
     state->inUser = false;
-    return IncludeSearchPathFindSys(state, path, fileName);
+    return searchSys(state, path, fileName);
+}
+
+// Find a file, continuing from where the state finished searching last, or
+// from the start of the user or system paths if it has not been used yet.
+// Search results for the same name and start position are always the same,
+// so are cached, which also keeps #include_next working.
+static const char* includeSearch(IncludeSearchState* state, IncludeSearchPath* path, const char* fileName, bool isUser) {
+    if(!state->hasStarted) {
+        state->hasStarted = true;
+        state->inUser = isUser;
+        state->checkedCount = 0;
+    }
+
+    size_t nameLength = strlen(fileName);
+    IncludeCacheEntry* first = tableGet(&path->cache, fileName, nameLength);
+    for(IncludeCacheEntry* entry = first; entry != NULL; entry = entry->next) {
+        if(entry->inUser == state->inUser && entry->checkedCount == state->checkedCount) {
+            *state = entry->end;
+            return entry->result;
+        }
+    }
+
+    IncludeCacheEntry* entry = ArenaAlloc(sizeof(*entry));
+    entry->inUser = state->inUser;
+    entry->checkedCount = state->checkedCount;
+
+    if(state->inUser) {
+        entry->result = searchUser(state, path, fileName);
+    } else {
+        entry->result = searchSys(state, path, fileName);
+    }
+    entry->end = *state;
+
+    // the table keeps the key, so it needs its own copy
+    char* name = ArenaAlloc(nameLength + 1);
+    memcpy(name, fileName, nameLength + 1);
+    entry->next = first;
+    TABLE_SET(path->cache, name, nameLength, entry);
+
+    return entry->result;
+}
+
+const char* IncludeSearchPathFindSys(IncludeSearchState* state, IncludeSearchPath* path, const char* fileName) {
+    return includeSearch(state, path, fileName, false);
+}
+
+const char* IncludeSearchPathFindUser(IncludeSearchState* state, IncludeSearchPath* path, const char* fileName) {
+    return includeSearch(state, path, fileName, true);
 }
 
 wchar_t* charToWchar(const char* str, int* lenPtr) {
@@ -400,6 +511,51 @@ char* readFileLen(const char* name, size_t* len) {
     return buf;
 }
 
+// Map a file into memory, read only, avoiding the copy done by readFileLen.
+// The byte after the end of the file is always '\0', as the remainder of the
+// last page of a mapping is zero filled by the os, so the lexer can use it as
+// an end of buffer sentinel.  If there would be no remainder (empty files or
+// files an exact multiple of the page size) this falls back to readFileLen,
+// which adds the '\0' itself.  Like the arena, the mapping is never released.
+const char* mapFileLen(const char* name, size_t* len) {
+    // per thread, so it can be set without a lock
+    static _Thread_local DWORD pageSize = 0;
+    if(pageSize == 0) {
+        SYSTEM_INFO info;
+        GetSystemInfo(&info);
+        pageSize = info.dwPageSize;
+    }
+
+    HANDLE file = CreateFileA(name, GENERIC_READ, FILE_SHARE_READ, NULL,
+        OPEN_EXISTING, FLAG_ATTRIBUTE_NORMAL, NULL);
+    if(file == INVALID_HANDLE_VALUE) {
+        // let readFileLen report the error
+        return readFileLen(name, len);
+    }
+
+    LARGE_INTEGER size;
+    if(!GetFileSizeEx(file, &size) || size.QuadPart == 0 || size.QuadPart % pageSize == 0) {
+        CloseHandle(file);
+        return readFileLen(name, len);
+    }
+
+    HANDLE mapping = CreateFileMappingA(file, NULL, PAGE_READONLY, 0, 0, NULL);
+    CloseHandle(file);
+    if(mapping == NULL) {
+        return readFileLen(name, len);
+    }
+
+    // the view keeps the mapping alive after its handle is closed
+    const char* buf = MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0);
+    CloseHandle(mapping);
+    if(buf == NULL) {
+        return readFileLen(name, len);
+    }
+
+    *len = size.QuadPart;
+    return buf;
+}
+
 static bool createDirRecurse(wchar_t* path, size_t pathLen) {
     DWORD attrs = GetFileAttributesW(path);
 
@@ -447,6 +603,32 @@ HANDLE deepCreateFile(wchar_t* path) {
     return CreateFileW(path, GENERIC_WRITE, 0, NULL, CREATE_ALWAYS, FLAG_ATTRIBUTE_NORMAL, NULL);
 }
 
+// Create a file in the user's temporary directory, opened for reading and
+// writing, that is deleted once it is closed.  Returns NULL if it could not be
+// created.
+FILE* createTempFile() {
+    wchar_t directory[MAX_PATH + 1];
+    wchar_t path[MAX_PATH + 1];
+    if(GetTempPathW(MAX_PATH + 1, directory) == 0 ||
+        GetTempFileNameW(directory, TEXT("mcc"), 0, path) == 0) {
+        return NULL;
+    }
+
+    HANDLE file = CreateFileW(path, GENERIC_READ | GENERIC_WRITE, 0, NULL, CREATE_ALWAYS,
+        FILE_ATTRIBUTE_TEMPORARY | FILE_FLAG_DELETE_ON_CLOSE, NULL);
+    if(file == INVALID_HANDLE_VALUE) {
+        return NULL;
+    }
+
+    // the handle is owned by the FILE* from here, so is closed with it
+    int fd = _open_osfhandle((intptr_t)file, _O_RDWR | _O_BINARY);
+    if(fd == -1) {
+        CloseHandle(file);
+        return NULL;
+    }
+    return _fdopen(fd, "w+b");
+}
+
 // recursively delete all files and folders in a directory
 // errors if read-only files are found.
 // no error if the provided directory does not exist
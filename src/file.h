@@ -3,18 +3,26 @@
 
 #include <stddef.h>
 #include "memory.h"
+#include "symbolTable.h"
 
 typedef struct Path {
     wchar_t* buf;
     bool valid;
+
+    // lower case names of everything in the directory, loaded the first
+    // time the directory is searched for an include, or NULL
+    Table* entries;
 } Path;
 
 typedef struct IncludeSearchPath {
     ARRAY_DEFINE(Path, system);
     ARRAY_DEFINE(Path, user);
+
+    // IncludeCacheEntry* list of previous searches, by the name searched for
+    Table cache;
 } IncludeSearchPath;
 
-// will need to implement #include_next at some point
+// where a search for an include got to, so #include_next can continue it
 // - used in mingw include files
 typedef struct IncludeSearchState {
     bool hasStarted;
@@ -22,6 +30,20 @@ typedef struct IncludeSearchState {
     size_t checkedCount;
 } IncludeSearchState;
 
+// a previous search for a name, see IncludeSearchPathFindUser
+typedef struct IncludeCacheEntry {
+    // where the search started
+    bool inUser;
+    size_t checkedCount;
+
+    // the file found, or NULL, and the state after finding it
+    const char* result;
+    IncludeSearchState end;
+
+    // searches for the same name starting somewhere else
+    struct IncludeCacheEntry* next;
+} IncludeCacheEntry;
+
 typedef enum SystemType {
     SYSTEM_MINGW_W64 = 0x1,
     SYSTEM_MSVC = 0x2,
@@ -30,6 +52,10 @@ typedef enum SystemType {
 
 void FilesInit();
 Path getStartupDirectory();
+
+// a resolved file name relative to the directory the compiler started in,
+// if it is inside that directory, otherwise the file name
+const char* pathRelativeToStartup(const char* path);
 void IncludeSearchPathInit(IncludeSearchPath* search, SystemType type, const char** includePaths, size_t includeCount);
 const char* IncludeSearchPathFindSys(IncludeSearchState* state, IncludeSearchPath* path, const char* fileName);
 const char* IncludeSearchPathFindUser(IncludeSearchState* state, IncludeSearchPath* path, const char* fileName);
@@ -40,6 +66,8 @@ char* wcharToChar(const wchar_t* str, size_t* lenPtr);
 
 char* readFile(const char* name);
 char* readFileLen(const char* name, size_t* len);
+const char* mapFileLen(const char* name, size_t* len);
+FILE* createTempFile();
 
 bool deepCreateDirectory(wchar_t* path);
 void* deepCreateFile(wchar_t* path);
@@ -0,0 +1,181 @@
+#include "identTable.h"
+
+#include <string.h>
+#include "lex.h"
+
+static const char* predeclaredNames[IDENT_PREDECLARED_COUNT] = {
+    [IDENT_DEFINE] = "define",
+    [IDENT_ELIF] = "elif",
+    [IDENT_ELSE] = "else",
+    [IDENT_ENDIF] = "endif",
+    [IDENT_ERROR] = "error",
+    [IDENT_IF] = "if",
+    [IDENT_IFDEF] = "ifdef",
+    [IDENT_IFNDEF] = "ifndef",
+    [IDENT_INCLUDE] = "include",
+    [IDENT_INCLUDE_NEXT] = "include_next",
+    [IDENT_LINE] = "line",
+    [IDENT_PRAGMA] = "pragma",
+    [IDENT_UNDEF] = "undef",
+    [IDENT_DEFINED] = "defined",
+    [IDENT_VA_ARGS] = "__VA_ARGS__",
+    [IDENT_PRAGMA_OPERATOR] = "_Pragma",
+    [IDENT_ONCE] = "once",
+    [IDENT_KW_AUTO] = "auto",
+    [IDENT_KW_BREAK] = "break",
+    [IDENT_KW_CASE] = "case",
+    [IDENT_KW_CHAR] = "char",
+    [IDENT_KW_CONST] = "const",
+    [IDENT_KW_CONTINUE] = "continue",
+    [IDENT_KW_DEFAULT] = "default",
+    [IDENT_KW_DO] = "do",
+    [IDENT_KW_DOUBLE] = "double",
+    [IDENT_KW_ENUM] = "enum",
+    [IDENT_KW_EXTERN] = "extern",
+    [IDENT_KW_FLOAT] = "float",
+    [IDENT_KW_FOR] = "for",
+    [IDENT_KW_GOTO] = "goto",
+    [IDENT_KW_INLINE] = "inline",
+    [IDENT_KW_INT] = "int",
+    [IDENT_KW_LONG] = "long",
+    [IDENT_KW_REGISTER] = "register",
+    [IDENT_KW_RESTRICT] = "restrict",
+    [IDENT_KW_RETURN] = "return",
+    [IDENT_KW_SHORT] = "short",
+    [IDENT_KW_SIGNED] = "signed",
+    [IDENT_KW_SIZEOF] = "sizeof",
+    [IDENT_KW_STATIC] = "static",
+    [IDENT_KW_STRUCT] = "struct",
+    [IDENT_KW_SWITCH] = "switch",
+    [IDENT_KW_TYPEDEF] = "typedef",
+    [IDENT_KW_UNION] = "union",
+    [IDENT_KW_UNSIGNED] = "unsigned",
+    [IDENT_KW_VOID] = "void",
+    [IDENT_KW_VOLATILE] = "volatile",
+    [IDENT_KW_WHILE] = "while",
+    [IDENT_KW_ALIGNAS] = "_Alignas",
+    [IDENT_KW_ALIGNOF] = "_Alignof",
+    [IDENT_KW_ATOMIC] = "_Atomic",
+    [IDENT_KW_BOOL] = "_Bool",
+    [IDENT_KW_COMPLEX] = "_Complex",
+    [IDENT_KW_GENERIC] = "_Generic",
+    [IDENT_KW_IMAGINARY] = "_Imaginary",
+    [IDENT_KW_NORETURN] = "_Noreturn",
+    [IDENT_KW_STATICASSERT] = "_Static_assert",
+    [IDENT_KW_THREADLOCAL] = "_Thread_local",
+};
+
+uint32_t IdentHash(const char* name, size_t length) {
+    uint32_t hash = IDENT_HASH_INIT;
+    for(size_t i = 0; i < length; i++) {
+        hash = IdentHashStep(hash, name[i]);
+    }
+    return hash;
+}
+
+// find the entry for a name, or the empty entry where it should be added
+static IdentEntry* identFindEntry(IdentEntry* entries, size_t capacity, const char* name, size_t length, uint32_t hash) {
+    size_t mask = capacity - 1;
+    size_t index = hash & mask;
+
+    while(true) {
+        IdentEntry* entry = &entries[index];
+        if(entry->node == NULL || (entry->hash == hash && entry->length == length &&
+            memcmp(entry->name, name, length) == 0)) {
+            return entry;
+        }
+        index = (index + 1) & mask;
+    }
+}
+
+static void identAdjustCapacity(IdentTable* table, size_t capacity) {
+    IdentEntry* entries = ArenaAlloc(sizeof(IdentEntry) * capacity);
+    for(size_t i = 0; i < capacity; i++) {
+        entries[i].node = NULL;
+    }
+
+    for(size_t i = 0; i < table->entryCapacity; i++) {
+        IdentEntry* entry = &table->entrys[i];
+        if(entry->node == NULL) continue;
+
+        *identFindEntry(entries, capacity, entry->name, entry->length, entry->hash) = *entry;
+    }
+
+    table->entrys = entries;
+    table->entryCapacity = capacity;
+}
+
+static HashNode* identAddNode(IdentTable* table, IdentEntry* entry, const char* name, size_t length, uint32_t hash) {
+    HashNode* node = ArenaAlloc(sizeof(*node));
+    node->name = (LexerString) {
+        .buffer = (char*)name,
+        .capacity = 0,
+        .count = length,
+        .type = STRING_NONE,
+    };
+    node->type = NODE_VOID;
+    node->hash = hash;
+    node->id = table->nodeCount;
+    ARRAY_PUSH(*table, node, node);
+    node->macroExpansionEnabled = true;
+    node->expansion = NULL;
+    node->usedByExpansion = false;
+
+    entry->hash = hash;
+    entry->length = length;
+    entry->name = name;
+    entry->node = node;
+    table->entryCount++;
+
+    return node;
+}
+
+void IdentTableInit(IdentTable* table) {
+    table->entrys = NULL;
+    table->entryCount = 0;
+    table->entryCapacity = 0;
+    table->entryElementSize = sizeof(IdentEntry);
+    identAdjustCapacity(table, 1024);
+
+    // no node has the id IDENT_NONE
+    ARRAY_ALLOC(HashNode*, *table, node);
+    ARRAY_PUSH(*table, node, (HashNode*)NULL);
+
+    for(size_t i = IDENT_NONE + 1; i < IDENT_PREDECLARED_COUNT; i++) {
+        const char* name = predeclaredNames[i];
+        size_t length = strlen(name);
+        uint32_t hash = IdentHash(name, length);
+        identAddNode(table, identFindEntry(table->entrys, table->entryCapacity, name, length, hash),
+            name, length, hash);
+    }
+}
+
+HashNode* IdentTableGet(IdentTable* table, TranslationContext* ctx, const char* name, size_t length, uint32_t hash) {
+    IdentEntry* entry = identFindEntry(table->entrys, table->entryCapacity, name, length, hash);
+    if(entry->node != NULL) {
+        return entry->node;
+    }
+
+    // keep the table at most half full, so probe sequences stay short
+    if((table->entryCount + 1) * 2 > table->entryCapacity) {
+        identAdjustCapacity(table, table->entryCapacity * 2);
+        entry = identFindEntry(table->entrys, table->entryCapacity, name, length, hash);
+    }
+
+    // node names are used as c strings, so need their own copy
+    char* copy = memoryArrayPushN(&ctx->stringArr, length + 1);
+    memcpy(copy, name, length);
+    copy[length] = '\0';
+
+    return identAddNode(table, entry, copy, length, hash);
+}
+
+void IdentTableUndefineAll(IdentTable* table) {
+    for(size_t i = 0; i < table->entryCapacity; i++) {
+        HashNode* node = table->entrys[i].node;
+        if(node == NULL) continue;
+
+        node->type = NODE_VOID;
+        node->macroExpansionEnabled = true;
+    }
+}
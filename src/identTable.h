@@ -0,0 +1,128 @@
+#ifndef IDENT_TABLE_H
+#define IDENT_TABLE_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include "memory.h"
+
+// Interner for preprocessor identifiers.  Each distinct identifier spelling
+// has one HashNode, found with a single probe of an open addressed table
+// using a hash that the lexer computes while reading the identifier, so the
+// name is never hashed a second time.  Every node is given an id, with the
+// names below always given the same ids, so they can be checked for without
+// comparing strings.
+
+// Identifiers given a fixed id.  All other identifiers are given ids
+// starting at IDENT_PREDECLARED_COUNT, in the order they are first seen.
+typedef enum IdentId {
+    IDENT_NONE,
+
+    // directive names
+    IDENT_DEFINE,
+    IDENT_ELIF,
+    IDENT_ELSE,
+    IDENT_ENDIF,
+    IDENT_ERROR,
+    IDENT_IF,
+    IDENT_IFDEF,
+    IDENT_IFNDEF,
+    IDENT_INCLUDE,
+    IDENT_INCLUDE_NEXT,
+    IDENT_LINE,
+    IDENT_PRAGMA,
+    IDENT_UNDEF,
+
+    // other names with a meaning to the preprocessor
+    IDENT_DEFINED,
+    IDENT_VA_ARGS,
+    IDENT_PRAGMA_OPERATOR,
+    IDENT_ONCE,
+
+    // keywords, "if" and "else" use the directive ids
+    IDENT_KW_AUTO,
+    IDENT_KW_BREAK,
+    IDENT_KW_CASE,
+    IDENT_KW_CHAR,
+    IDENT_KW_CONST,
+    IDENT_KW_CONTINUE,
+    IDENT_KW_DEFAULT,
+    IDENT_KW_DO,
+    IDENT_KW_DOUBLE,
+    IDENT_KW_ENUM,
+    IDENT_KW_EXTERN,
+    IDENT_KW_FLOAT,
+    IDENT_KW_FOR,
+    IDENT_KW_GOTO,
+    IDENT_KW_INLINE,
+    IDENT_KW_INT,
+    IDENT_KW_LONG,
+    IDENT_KW_REGISTER,
+    IDENT_KW_RESTRICT,
+    IDENT_KW_RETURN,
+    IDENT_KW_SHORT,
+    IDENT_KW_SIGNED,
+    IDENT_KW_SIZEOF,
+    IDENT_KW_STATIC,
+    IDENT_KW_STRUCT,
+    IDENT_KW_SWITCH,
+    IDENT_KW_TYPEDEF,
+    IDENT_KW_UNION,
+    IDENT_KW_UNSIGNED,
+    IDENT_KW_VOID,
+    IDENT_KW_VOLATILE,
+    IDENT_KW_WHILE,
+    IDENT_KW_ALIGNAS,
+    IDENT_KW_ALIGNOF,
+    IDENT_KW_ATOMIC,
+    IDENT_KW_BOOL,
+    IDENT_KW_COMPLEX,
+    IDENT_KW_GENERIC,
+    IDENT_KW_IMAGINARY,
+    IDENT_KW_NORETURN,
+    IDENT_KW_STATICASSERT,
+    IDENT_KW_THREADLOCAL,
+
+    IDENT_PREDECLARED_COUNT
+} IdentId;
+
+typedef struct IdentEntry {
+    // stored here so most failed comparisons do not need to read the name
+    uint32_t hash;
+    uint32_t length;
+    const char* name;
+
+    // NULL if the entry is empty
+    struct HashNode* node;
+} IdentEntry;
+
+typedef struct IdentTable {
+    // capacity is always a power of 2
+    ARRAY_DEFINE(IdentEntry, entry);
+
+    // every node, indexed by id, so tokens can store the id instead
+    ARRAY_DEFINE(struct HashNode*, node);
+} IdentTable;
+
+struct TranslationContext;
+
+// The hash used for identifiers, FNV-1a, in a form that can be updated one
+// character at a time while the identifier is lexed.
+#define IDENT_HASH_INIT 2166126261u
+static inline uint32_t IdentHashStep(uint32_t hash, unsigned char c) {
+    return (hash ^ c) * 16777619u;
+}
+uint32_t IdentHash(const char* name, size_t length);
+
+// create the table, with nodes for all of the predeclared names
+void IdentTableInit(IdentTable* table);
+
+// Get the node for an identifier, where hash is IdentHash(name, length),
+// creating a new NODE_VOID node if it has not been seen before.  The name
+// is copied when a new node is created, so does not need to stay valid.
+struct HashNode* IdentTableGet(IdentTable* table, struct TranslationContext* ctx,
+    const char* name, size_t length, uint32_t hash);
+
+// undefine every macro, for the start of a new translation unit
+void IdentTableUndefineAll(IdentTable* table);
+
+#endif
@@ -1,5 +1,6 @@
 #include "lex.h"
 
+#include <limits.h>
 #include <stdint.h>
 #include <stdbool.h>
 #include <stdlib.h>
@@ -8,6 +9,10 @@
 #include <inttypes.h>
 #include <time.h>
 #include "file.h"
+#include "byteScan.h"
+#include "pch.h"
+#include "prefetch.h"
+#include "thread.h"
 
 #include "lextoken.h"
 #include "lextoken.h"
@@ -20,9 +25,313 @@
 // Setup function
 void TranslationContextInit(TranslationContext* ctx, MemoryPool* pool) {
     ctx->pool = pool;
+    ctx->output = stdout;
+    ctx->prefetch = NULL;
 
     memoryArrayAlloc(&ctx->stringArr, pool, 4*MiB, sizeof(unsigned char));
-    memoryArrayAlloc(&ctx->locations, pool, 128*MiB, sizeof(SourceLocation));
+
+    ARRAY_ALLOC(SourceFile*, *ctx, file);
+    ctx->nextFileStart = 1;
+
+    TABLE_INIT(ctx->tokenCache, CachedFile*);
+    ARRAY_ZERO(*ctx, dependency);
+    ctx->idents = NULL;
+    ARRAY_ALLOC(LexerString, *ctx, tokenString);
+    ARRAY_ALLOC(TokenNumber, *ctx, tokenNumber);
+    ctx->pchFile = NULL;
+    ctx->tokenCacheHits = 0;
+    ctx->tokenCacheBytesSaved = 0;
+    ctx->guardSkips = 0;
+    ctx->macrosDefined = 0;
+    ctx->macrosLexed = 0;
+    ctx->macroGeneration = 0;
+    ctx->expansionDepth = 0;
+    ctx->fillingExpansion = false;
+    ctx->expansionUncacheable = false;
+    ctx->expansionCacheHits = 0;
+    ctx->expansionCacheMisses = 0;
+    ctx->lexSpeculative = false;
+    ctx->lexErrorFound = false;
+    ctx->parallelFiles = 0;
+    ctx->parallelChunks = 0;
+    ctx->parallelChunksRelexed = 0;
+    ctx->prefetchers = 0;
+    ctx->prefetchReady = 0;
+    ctx->prefetchWaited = 0;
+    ctx->prefetchMissed = 0;
+}
+
+// print the statistics enabled with -print-stats
+void TranslationContextPrintStats(TranslationContext* ctx) {
+    fprintf(stderr, "Token cache: %zu hits, %zu bytes not read again\n",
+        ctx->tokenCacheHits, ctx->tokenCacheBytesSaved);
+    fprintf(stderr, "Include guards: %zu includes skipped\n", ctx->guardSkips);
+    fprintf(stderr, "Macros: %zu defined, %zu replacement lists lexed on first use\n",
+        ctx->macrosDefined, ctx->macrosLexed);
+    fprintf(stderr, "Expansion cache: %zu hits, %zu misses\n",
+        ctx->expansionCacheHits, ctx->expansionCacheMisses);
+    if(ctx->lexJobs > 1) {
+        fprintf(stderr, "Parallel lexing: %zu files in %zu chunks, %zu chunks lexed again\n",
+            ctx->parallelFiles, ctx->parallelChunks, ctx->parallelChunksRelexed);
+    }
+    if(ctx->prefetchers > 0) {
+        fprintf(stderr, "Prefetch: %zu files ready, %zu waited for, %zu not read yet\n",
+            ctx->prefetchReady, ctx->prefetchWaited, ctx->prefetchMissed);
+    }
+}
+
+// add the statistics of a context that ran on another thread to total
+void TranslationContextAddStats(TranslationContext* total, TranslationContext* ctx) {
+    total->tokenCacheHits += ctx->tokenCacheHits;
+    total->tokenCacheBytesSaved += ctx->tokenCacheBytesSaved;
+    total->guardSkips += ctx->guardSkips;
+    total->macrosDefined += ctx->macrosDefined;
+    total->macrosLexed += ctx->macrosLexed;
+    total->expansionCacheHits += ctx->expansionCacheHits;
+    total->expansionCacheMisses += ctx->expansionCacheMisses;
+    total->parallelFiles += ctx->parallelFiles;
+    total->parallelChunks += ctx->parallelChunks;
+    total->parallelChunksRelexed += ctx->parallelChunksRelexed;
+    total->prefetchers += ctx->prefetchers;
+    total->prefetchReady += ctx->prefetchReady;
+    total->prefetchWaited += ctx->prefetchWaited;
+    total->prefetchMissed += ctx->prefetchMissed;
+}
+
+// ---------- //
+// Token Data //
+// ---------- //
+// Data is never changed once added, as tokens are copied freely, so any
+// copies share it, setting new data adds a new entry instead.
+
+void TokenSetString(TranslationContext* ctx, LexerToken* tok, LexerString str) {
+    tok->data = ctx->tokenStringCount;
+    ARRAY_PUSH(*ctx, tokenString, str);
+}
+
+// set the string of a string token that was not lexed by ParseString
+static void TokenSetStringEscapes(TranslationContext* ctx, LexerToken* tok, LexerString str) {
+    tok->hasEscapes = memchr(str.buffer, '\\', str.count) != NULL;
+    TokenSetString(ctx, tok, str);
+}
+
+void TokenSetInteger(TranslationContext* ctx, LexerToken* tok, intmax_t value) {
+    tok->data = ctx->tokenNumberCount;
+    ARRAY_PUSH(*ctx, tokenNumber, ((TokenNumber){.integer = value}));
+}
+
+// ---------------- //
+// Source Locations //
+// ---------------- //
+// Each file is given a range of offsets, one for each byte and one for its
+// end, so a location can be stored in 32 bits and converted back to a file,
+// line and column only when needed.
+
+// record a file's contents, to give it a range of offsets for locations
+SourceFile* TranslationContextAddFile(TranslationContext* ctx, const unsigned char* fileName, const unsigned char* source, size_t length) {
+    if(length >= UINT32_MAX - ctx->nextFileStart) {
+        fprintf(stderr, "Error: too much source code read, the limit is 4GiB\n");
+        exit(1);
+    }
+
+    SourceFile* file = ArenaAlloc(sizeof(*file));
+    file->fileName = fileName;
+    file->source = source;
+    file->sourceLength = length;
+    file->start = ctx->nextFileStart;
+    ARRAY_ZERO(*file, lineStart);
+
+    // checked once for the whole file, so phase 1 only has to compare its
+    // position with the next byte found, instead of checking every byte
+    ARRAY_ZERO(*file, invalidByte);
+    for(size_t i = scanInvalidBytes(source, 0, length); i < length;
+        i = scanInvalidBytes(source, i + 1, length)) {
+        if(file->invalidBytes == NULL) {
+            ARRAY_ALLOC(uint32_t, *file, invalidByte);
+        }
+        ARRAY_PUSH(*file, invalidByte, (uint32_t)i);
+    }
+
+    ctx->nextFileStart += length + 1;
+    ARRAY_PUSH(*ctx, file, file);
+    return file;
+}
+
+// Give a new translation unit the offsets and token data of the last one, so
+// they do not run out however many are preprocessed with one context.  Only
+// the token cache is shared between translation units, so the files it has
+// complete tokens for are kept, moved to the start of the offsets with their
+// tokens, and everything else is dropped.
+static void TranslationContextStartUnit(TranslationContext* ctx) {
+    // a file that was still being recorded is recorded again when it is
+    // next opened
+    for(size_t i = 0; i < ctx->tokenCache.entryCapacity; i++) {
+        Entry* entry = &ctx->tokenCache.entrys[i];
+        if(entry->key.key == NULL) continue;
+
+        CachedFile* cache = entry->value;
+        if(!cache->complete && cache->file != NULL) {
+            cache->file = NULL;
+            cache->openCount = 1;
+            ARRAY_ZERO(cache->tokens, item);
+        }
+    }
+
+    // kept strings are added after the current ones, then moved to the start
+    size_t stringBase = ctx->tokenStringCount;
+    size_t keptFiles = 0;
+    uint32_t nextStart = 1;
+    for(size_t i = 0; i < ctx->fileCount; i++) {
+        SourceFile* file = ctx->files[i];
+        const char* fileName = (const char*)file->fileName;
+        CachedFile* cache = tableGet(&ctx->tokenCache, fileName, strlen(fileName));
+        if(cache == NULL || !cache->complete || cache->file != file) continue;
+
+        uint32_t oldStart = file->start;
+        for(size_t j = 0; j < cache->tokens.itemCount; j++) {
+            LexerToken* tok = &cache->tokens.items[j];
+            if(tok->loc.offset >= oldStart && tok->loc.offset - oldStart <= file->sourceLength) {
+                tok->loc.offset = tok->loc.offset - oldStart + nextStart;
+            }
+            if(TokenHasString(tok->type)) {
+                LexerString str = ctx->tokenStrings[tok->data];
+                tok->data = ctx->tokenStringCount - stringBase;
+                ARRAY_PUSH(*ctx, tokenString, str);
+            }
+        }
+
+        file->start = nextStart;
+        nextStart += file->sourceLength + 1;
+        ctx->files[keptFiles++] = file;
+    }
+
+    size_t keptStrings = ctx->tokenStringCount - stringBase;
+    memmove(ctx->tokenStrings, ctx->tokenStrings + stringBase, keptStrings * sizeof(LexerString));
+    ctx->tokenStringCount = keptStrings;
+    ctx->tokenNumberCount = 0;
+    ctx->fileCount = keptFiles;
+    ctx->nextFileStart = nextStart;
+
+    // added again by PchLoad, in the new offsets
+    ctx->pchFile = NULL;
+}
+
+// get the index in a file's invalidBytes of the first at or after index
+static size_t SourceFileFindInvalid(SourceFile* file, size_t index) {
+    size_t low = 0;
+    size_t high = file->invalidByteCount;
+    while(low < high) {
+        size_t mid = low + (high - low) / 2;
+        if(file->invalidBytes[mid] < index) {
+            low = mid + 1;
+        } else {
+            high = mid;
+        }
+    }
+    return low;
+}
+
+// get the file containing a location, or NULL for the 0 location
+SourceFile* SourceLocationFile(TranslationContext* ctx, SourceLocation loc) {
+    if(loc.offset == 0 || ctx->fileCount == 0) {
+        return NULL;
+    }
+
+    // most lookups are for the last file opened, so check that first
+    SourceFile* last = ctx->files[ctx->fileCount - 1];
+    if(loc.offset >= last->start) {
+        return last;
+    }
+
+    // binary search for the last file starting at or before the offset
+    size_t low = 0;
+    size_t high = ctx->fileCount - 1;
+    while(low + 1 < high) {
+        size_t mid = low + (high - low) / 2;
+        if(ctx->files[mid]->start <= loc.offset) {
+            low = mid;
+        } else {
+            high = mid;
+        }
+    }
+    return ctx->files[low];
+}
+
+// get the bytes a location refers to
+const unsigned char* SourceLocationText(TranslationContext* ctx, SourceLocation loc) {
+    SourceFile* file = SourceLocationFile(ctx, loc);
+    if(file == NULL) {
+        return (const unsigned char*)"";
+    }
+    return &file->source[loc.offset - file->start];
+}
+
+// Find the start of every line in the file.  A line ends with any of
+// "\n", "\r", "\n\r" or "\r\n", matching how phase 1 used to count lines.
+static void SourceFileFindLines(SourceFile* file) {
+    ARRAY_ALLOC(uint32_t, *file, lineStart);
+    ARRAY_PUSH(*file, lineStart, (uint32_t)0);
+
+    const unsigned char* buf = file->source;
+    size_t length = file->sourceLength;
+    size_t i = 0;
+    while((i = scanLineEnd(buf, i, length)) < length) {
+        unsigned char c = buf[i];
+        i++;
+        if(i < length && (buf[i] == '\n' || buf[i] == '\r') && buf[i] != c) {
+            i++;
+        }
+        ARRAY_PUSH(*file, lineStart, (uint32_t)i);
+    }
+}
+
+// get the file name, line and column of the start of a location.  Lines
+// and columns start at 1, with columns counted in bytes.
+SourcePosition SourceLocationPosition(TranslationContext* ctx, SourceLocation loc) {
+    SourceFile* file = SourceLocationFile(ctx, loc);
+    if(file == NULL) {
+        return (SourcePosition) {
+            .fileName = ctx->fileName,
+            .line = 1,
+            .column = 0,
+        };
+    }
+
+    if(file->lineStarts == NULL) {
+        SourceFileFindLines(file);
+    }
+
+    // binary search for the last line starting at or before the offset
+    uint32_t index = loc.offset - file->start;
+    size_t low = 0;
+    size_t high = file->lineStartCount;
+    while(low + 1 < high) {
+        size_t mid = low + (high - low) / 2;
+        if(file->lineStarts[mid] <= index) {
+            low = mid;
+        } else {
+            high = mid;
+        }
+    }
+
+    return (SourcePosition) {
+        .fileName = file->fileName,
+        .line = low + 1,
+        .column = index - file->lineStarts[low] + 1,
+    };
+}
+
+// Should an error found by phases 1 to 3 be printed?  Not while lexing a
+// chunk of a file that might not have been started in the right place, see
+// lexChunk, or ahead of phase 4, see Phase4Fill, which instead record that
+// the error happened, so that tokens which reported an error are lexed again
+// normally.
+static bool lexShouldReport(TranslationContext* settings) {
+    if(settings->lexSpeculative) {
+        settings->lexErrorFound = true;
+        return false;
+    }
+    return true;
 }
 
 // ------- //
@@ -33,19 +342,23 @@ void TranslationContextInit(TranslationContext* ctx, MemoryPool* pool) {
 // internaly uses out parameter instead of END_OF_FILE to avoid reading
 // END_OF_FILE as a control character, so emitting an error for it
 
+// The source buffer is always followed by a '\0' sentinel (see mapFileLen),
+// so the end of the buffer only needs checking when a '\0' is read, rather
+// than comparing against the length for every character.
+static inline bool Phase1AtEnd(Phase1Context* ctx, unsigned char c) {
+    return c == '\0' && ctx->consumed >= ctx->sourceLength;
+}
+
 // return the next character without consuming it
 static unsigned char Phase1Peek(Phase1Context* ctx, bool* succeeded) {
-    if(ctx->consumed >= ctx->sourceLength) {
-        *succeeded = false;
-        return '\0';
-    }
-    *succeeded = true;
-    return ctx->source[ctx->consumed];
+    unsigned char c = ctx->source[ctx->consumed];
+    *succeeded = !Phase1AtEnd(ctx, c);
+    return c;
 }
 
 // return the character after next without consuming its
 static unsigned char Phase1PeekNext(Phase1Context* ctx, bool* succeeded) {
-    if(ctx->consumed - 1 >= ctx->sourceLength) {
+    if(ctx->consumed + 1 >= ctx->sourceLength) {
         *succeeded = false;
         return '\0';
     }
@@ -53,42 +366,16 @@ static unsigned char Phase1PeekNext(Phase1Context* ctx, bool* succeeded) {
     return ctx->source[ctx->consumed + 1];
 }
 
-// process a newline character ('\n' or '\r') to check how to advance the
-// line counter.  If '\n' encountered, a following '\r' will not change the
-// counter, if '\r', the '\n' will not update.  This allows multiple possible
-// line endings: "\n", "\r", "\n\r", "\r\n" that are all considered one line end
-static void Phase1NewLine(Phase1Context* ctx, unsigned char c) {
-    if(ctx->ignoreNewLine != '\0') {
-        if(c == ctx->ignoreNewLine) {
-            ctx->location.line++;
-            ctx->location.column = 1;
-        }
-        ctx->ignoreNewLine = '\0';
-    }
-    if(c == '\n') {
-        ctx->ignoreNewLine = '\r';
-        ctx->location.line++;
-        ctx->location.column = 0;
-    }
-    if(c == '\r') {
-        ctx->ignoreNewLine = '\n';
-        ctx->location.line++;
-        ctx->location.column = 0;
-    }
-}
-
 // get the next character from the previous phase
 // increases the SourcLocation's length with the new character
 static unsigned char Phase1Advance(Phase1Context* ctx, bool* succeeded) {
-    if(ctx->consumed >= ctx->sourceLength) {
+    unsigned char c = ctx->source[ctx->consumed];
+    if(Phase1AtEnd(ctx, c)) {
         *succeeded = false;
         return '\0';
     }
     ctx->consumed++;
     ctx->location.length++;
-    ctx->location.column++;
-    unsigned char c = ctx->source[ctx->consumed - 1];
-    Phase1NewLine(ctx, c);
     *succeeded = true;
     return c;
 }
@@ -96,16 +383,14 @@ static unsigned char Phase1Advance(Phase1Context* ctx, bool* succeeded) {
 // get the next character from the previous phase
 // sets the SourceLocation to begin from the new character's start
 static unsigned char Phase1AdvanceOverwrite(Phase1Context* ctx, bool* succeeded) {
-    if(ctx->consumed >= ctx->sourceLength) {
+    unsigned char c = ctx->source[ctx->consumed];
+    if(Phase1AtEnd(ctx, c)) {
         *succeeded = false;
         return '\0';
     }
-    ctx->consumed++;
+    ctx->location.offset = ctx->file->start + ctx->consumed;
     ctx->location.length = 1;
-    ctx->location.column++;
-    ctx->location.sourceText = &ctx->source[ctx->consumed - 1];
-    unsigned char c = ctx->source[ctx->consumed - 1];
-    Phase1NewLine(ctx, c);
+    ctx->consumed++;
     *succeeded = true;
     return c;
 }
@@ -123,6 +408,33 @@ static unsigned char trigraphTranslation[] = {
     ['-'] = '~',
 };
 
+// make the byte at index in the file's invalidBytes the next one checked for
+static void Phase1SetInvalid(Phase1Context* ctx, size_t index) {
+    ctx->invalidIndex = index;
+    ctx->nextInvalid = index < ctx->file->invalidByteCount ?
+        ctx->file->invalidBytes[index] : ctx->sourceLength;
+}
+
+// set the next invalid byte to the first at or after the current position
+static void Phase1FindInvalid(Phase1Context* ctx) {
+    Phase1SetInvalid(ctx, SourceFileFindInvalid(ctx->file, ctx->consumed));
+}
+
+// report the invalid byte c, which was just consumed, and move on to the
+// next one
+static void Phase1ReportInvalid(Phase1Context* ctx, unsigned char c) {
+    if(lexShouldReport(ctx->settings)) {
+        if(c >= 0x80) {
+            fprintf(stderr, "Error: found invalid byte for utf8 text\n");
+        } else {
+            SourcePosition pos = SourceLocationPosition(ctx->settings, ctx->location);
+            fprintf(stderr, "Error: found control character in source file - %lld:%lld\n", pos.line, pos.column);
+        }
+    }
+
+    Phase1SetInvalid(ctx, ctx->invalidIndex + 1);
+}
+
 // implement phase 1
 // technically, this should convert the file to utf8, and probably normalise it,
 // but I am not implementing that
@@ -146,15 +458,17 @@ static unsigned char Phase1Get(Phase1Context* ctx) {
         }
     }
 
-    // invalid bytes
-    if(c == 0xC0 || c == 0xC1 || c >= 0xF5) {
-        fprintf(stderr, "Error: found invalid byte for utf8 text\n");
+    // invalid utf8 and control characters, found when the file was added
+    if(ctx->consumed - 1 == ctx->nextInvalid) {
+        Phase1ReportInvalid(ctx, c);
         return '\0';
     }
 
-    if((c <= 0x1F || c == 0x7F) && c != '\n' && c != '\r' && c != '\t' && c != '\v' && c != '\f') {
-        fprintf(stderr, "Error: found control character in source file - %lld:%lld\n", ctx->location.line, ctx->location.column);
-        return '\0';
+    // files are mapped in binary mode, so fold "\r\n" into one new line
+    // character, as reading in text mode would have done
+    if(c == '\r' && Phase1Peek(ctx, &succeeded) == '\n' && succeeded) {
+        Phase1Advance(ctx, &succeeded);
+        return '\n';
     }
 
     if(ctx->settings->trigraphs && c == '?') {
@@ -188,17 +502,42 @@ static unsigned char Phase1Get(Phase1Context* ctx) {
     return c;
 }
 
+// Is the next character inside a run of bytes that Phase1Get and Phase2Get
+// would return unchanged?  The end of the run is found with scanSpecialBytes,
+// up to the next invalid byte, and is only re-run once the byte ending the
+// previous run has been consumed by the per-character path.
+static inline bool Phase1InCleanRegion(Phase1Context* ctx) {
+    if(ctx->consumed > ctx->cleanEnd) {
+        ctx->cleanStart = ctx->consumed;
+        ctx->cleanEnd = scanSpecialBytes(ctx->source, ctx->consumed,
+            ctx->nextInvalid, ctx->settings->trigraphs);
+    }
+    return ctx->consumed < ctx->cleanEnd;
+}
+
+// Phase1Get for a character inside a clean region, which needs no checks
+static inline unsigned char Phase1GetClean(Phase1Context* ctx) {
+    ctx->location.offset = ctx->file->start + ctx->consumed;
+    ctx->location.length = 1;
+    return ctx->source[ctx->consumed++];
+}
+
 static void Phase1Initialise(Phase1Context* ctx, TranslationContext* settings) {
-    ctx->source = (unsigned char*)readFileLen((char*)settings->fileName, &ctx->sourceLength);
+    if(settings->prefetch != NULL) {
+        ctx->source = (const unsigned char*)PrefetcherReadFile(settings->prefetch,
+            (char*)settings->fileName, &ctx->sourceLength);
+    } else {
+        ctx->source = (const unsigned char*)mapFileLen((char*)settings->fileName, &ctx->sourceLength);
+    }
+    ctx->file = TranslationContextAddFile(settings, settings->fileName, ctx->source, ctx->sourceLength);
     ctx->settings = settings;
     ctx->consumed = 0;
-    ctx->ignoreNewLine = '\0';
+    ctx->cleanStart = 0;
+    ctx->cleanEnd = 0;
+    Phase1FindInvalid(ctx);
     ctx->location = (SourceLocation) {
-        .fileName = settings->fileName,
-        .column = 0,
+        .offset = ctx->file->start,
         .length = 0,
-        .line = 1,
-        .sourceText = ctx->source,
     };
 }
 
@@ -206,10 +545,11 @@ static void Phase1Initialise(Phase1Context* ctx, TranslationContext* settings) {
 void runPhase1(TranslationContext* settings) {
     char c;
     Phase1Context ctx = {0};
+    TranslationContextStartUnit(settings);
     Phase1Initialise(&ctx, settings);
 
     while((c = Phase1Get(&ctx)) != EOF) {
-        putchar(c);
+        fputc(c, settings->output);
     }
 }
 
@@ -254,7 +594,9 @@ static unsigned char Phase2Get(Phase2Context* ctx) {
         if(c == '\\') {
             unsigned char c1 = Phase2Peek(ctx);
             if(c1 == END_OF_FILE) {
-                fprintf(stderr, "Error: unexpected '\\' at end of file\n");
+                if(lexShouldReport(ctx->phase1.settings)) {
+                    fprintf(stderr, "Error: unexpected '\\' at end of file\n");
+                }
                 return END_OF_FILE;
             } else if(c1 != '\n') {
                 ctx->previous = c;
@@ -266,7 +608,9 @@ static unsigned char Phase2Get(Phase2Context* ctx) {
         } else if(c == END_OF_FILE && ctx->previous != '\n' && ctx->previous != END_OF_FILE) {
             // error iso c
             ctx->previous = END_OF_FILE;
-            fprintf(stderr, "Error: ISO C11 requires newline at end of file\n");
+            if(lexShouldReport(ctx->phase1.settings)) {
+                fprintf(stderr, "Error: ISO C11 requires newline at end of file\n");
+            }
             return END_OF_FILE;
         } else {
             ctx->previous = c;
@@ -289,10 +633,11 @@ static void Phase2Initialise(Phase2Context* ctx, TranslationContext* settings) {
 // helper to run upto and including phase 2
 void runPhase2(TranslationContext* settings) {
     Phase2Context ctx = {0};
+    TranslationContextStartUnit(settings);
     Phase2Initialise(&ctx, settings);
     unsigned char c;
     while((c = Phase2Get(&ctx)) != END_OF_FILE) {
-        putchar(c);
+        fputc(c, settings->output);
     }
 }
 
@@ -305,11 +650,37 @@ void runPhase2(TranslationContext* settings) {
 
 static unsigned char Phase3GetFromPhase2(void* voidCtx, SourceLocation* loc) {
     Phase3Context* ctx = voidCtx;
-    unsigned char c = Phase2Get(&ctx->phase2);
-    *loc = ctx->phase2.currentLoc;
+    Phase2Context* phase2 = &ctx->phase2;
+
+    // If phase 2's lookahead character cannot start a line splice and the
+    // character after it is clean, then Phase2Get would just return the
+    // lookahead, so read the next character straight from the buffer,
+    // skipping all of phase 1 and 2's checks.
+    if(phase2->peek != '\\' && phase2->peek != END_OF_FILE
+    && Phase1InCleanRegion(&phase2->phase1)) {
+        unsigned char c = phase2->peek;
+        phase2->currentLoc = phase2->peekLoc;
+        phase2->previous = c;
+        phase2->peek = Phase1GetClean(&phase2->phase1);
+        phase2->peekLoc = phase2->phase1.location;
+        *loc = phase2->currentLoc;
+        return c;
+    }
+
+    unsigned char c = Phase2Get(phase2);
+    *loc = phase2->currentLoc;
     return c;
 }
 
+// get the next character from the getter, calling phase 2 directly if that
+// is the getter being used so the common case does not need an indirect call
+static inline unsigned char Phase3GetChar(Phase3Context* ctx, SourceLocation* loc) {
+    if(ctx->getter == Phase3GetFromPhase2) {
+        return Phase3GetFromPhase2(ctx->getterCtx, loc);
+    }
+    return ctx->getter(ctx->getterCtx, loc);
+}
+
 // get the next character from the previous phase
 // increases the SourcLocation's length with the new character
 static unsigned char Phase3Advance(Phase3Context* ctx) {
@@ -318,7 +689,7 @@ static unsigned char Phase3Advance(Phase3Context* ctx) {
 
     ctx->peek = ctx->peekNext;
     ctx->peekLoc = ctx->peekNextLoc;
-    ctx->peekNext = ctx->getter(ctx->getterCtx, &ctx->peekNextLoc);
+    ctx->peekNext = Phase3GetChar(ctx, &ctx->peekNextLoc);
 
     return ret;
 }
@@ -331,7 +702,7 @@ static unsigned char Phase3AdvanceOverwrite(Phase3Context* ctx) {
 
     ctx->peek = ctx->peekNext;
     ctx->peekLoc = ctx->peekNextLoc;
-    ctx->peekNext = ctx->getter(ctx->getterCtx, &ctx->peekNextLoc);
+    ctx->peekNext = Phase3GetChar(ctx, &ctx->peekNextLoc);
     return ret;
 }
 
@@ -350,6 +721,61 @@ static bool Phase3AtEnd(Phase3Context* ctx) {
     return ctx->peek == END_OF_FILE;
 }
 
+// If phase 3's lookahead characters were read straight from the source
+// buffer by the clean region fast path, get the index of peek in the buffer
+// and the end of the clean region it is in, so that whitespace and comments
+// can be skipped by searching the buffer instead of character by character.
+// This holds if peek, peekNext and phase 2's peek are the three bytes before
+// phase 1's position, all inside the clean region, as each of those bytes
+// can only have produced one character.
+static bool Phase3CleanRun(Phase3Context* ctx, size_t* start, size_t* end) {
+    if(ctx->getter != Phase3GetFromPhase2) {
+        return false;
+    }
+
+    Phase1Context* phase1 = &ctx->phase2.phase1;
+    size_t index = (size_t)ctx->peekLoc.offset - phase1->file->start;
+    if(index < phase1->cleanStart || phase1->consumed != index + 3
+    || phase1->consumed > phase1->cleanEnd) {
+        return false;
+    }
+
+    *start = index;
+    *end = phase1->cleanEnd;
+    return true;
+}
+
+// Skip from peek at index start to the byte at index target, which must be
+// after start and inside the same clean region, then refill the lookahead
+// characters of phases 2 and 3 from there.  Returns the count of '\n' bytes
+// skipped and sets lastNewLine to the index of the final one.
+static size_t Phase3SkipTo(Phase3Context* ctx, size_t start, size_t target, size_t* lastNewLine) {
+    Phase1Context* phase1 = &ctx->phase2.phase1;
+    const unsigned char* buf = phase1->source;
+
+    size_t newLines = countNewLines(buf, start, target, lastNewLine);
+
+    phase1->location.offset = phase1->file->start + target - 1;
+    phase1->location.length = 1;
+    phase1->consumed = target;
+    ctx->phase2.previous = buf[target - 1];
+
+    ctx->currentLocation->length += target - start;
+    Phase2AdvanceOverwrite(&ctx->phase2);
+    ctx->peek = Phase3GetChar(ctx, &ctx->peekLoc);
+    ctx->peekNext = Phase3GetChar(ctx, &ctx->peekNextLoc);
+
+    return newLines;
+}
+
+// set that the token is at the begining of a line
+static void Phase3StartOfLine(LexerToken* tok) {
+    tok->isStartOfLine = true;
+    tok->renderStartOfLine = true;
+    tok->whitespaceBefore = true;
+    tok->indent = 0;
+}
+
 // skip a new line ("\n", "\r", "\n\r", "\r\n") and set that the token is
 // at the begining of a line
 static void Phase3NewLine(LexerToken* tok, Phase3Context* ctx, unsigned char c) {
@@ -357,10 +783,7 @@ static void Phase3NewLine(LexerToken* tok, Phase3Context* ctx, unsigned char c)
     if(Phase3Peek(ctx) == c) {
         Phase3Advance(ctx);
     }
-    tok->isStartOfLine = true;
-    tok->renderStartOfLine = true;
-    tok->whitespaceBefore = true;
-    tok->indent = 0;
+    Phase3StartOfLine(tok);
 }
 
 static void skipMultiLineComment(LexerToken* tok, Phase3Context* ctx) {
@@ -370,6 +793,20 @@ static void skipMultiLineComment(LexerToken* tok, Phase3Context* ctx) {
         if(Phase3Peek(ctx) == '*' && Phase3PeekNext(ctx) == '/') {
             break;
         }
+
+        size_t start, end;
+        if(Phase3CleanRun(ctx, &start, &end)) {
+            const unsigned char* buf = ctx->phase2.phase1.source;
+            size_t target = scanCommentEnd(buf, start, end);
+            if(target > start) {
+                size_t lastNewLine;
+                if(Phase3SkipTo(ctx, start, target, &lastNewLine) > 0) {
+                    Phase3StartOfLine(tok);
+                }
+                continue;
+            }
+        }
+
         bool advanced = false;
         if(Phase3Peek(ctx) == '\n') {
             Phase3NewLine(tok, ctx, '\r');
@@ -384,19 +821,29 @@ static void skipMultiLineComment(LexerToken* tok, Phase3Context* ctx) {
         }
     }
     if(Phase3AtEnd(ctx)) {
-        fprintf(stderr, "Error: Unterminated multi-line comment at %lld:%lld\n", ctx->currentLocation->line, ctx->currentLocation->column);
+        if(lexShouldReport(ctx->settings)) {
+            SourcePosition pos = SourceLocationPosition(ctx->settings, *ctx->currentLocation);
+            fprintf(stderr, "Error: Unterminated multi-line comment at %lld:%lld\n", pos.line, pos.column);
+        }
         return;
     }
     Phase3Advance(ctx);
     Phase3Advance(ctx);
     tok->whitespaceBefore = true;
-    tok->indent++;
+    TokenSetIndent(tok, tok->indent + 1);
 }
 
 static void skipSingleLineComment(LexerToken* tok, Phase3Context* ctx) {
     Phase3AdvanceOverwrite(ctx);
     unsigned char c = '\0';
     while((c = Phase3Peek(ctx)), (c != '\n' && c != '\r' && !Phase3AtEnd(ctx))) {
+        size_t start, end;
+        if(Phase3CleanRun(ctx, &start, &end)) {
+            const unsigned char* buf = ctx->phase2.phase1.source;
+            size_t lastNewLine;
+            Phase3SkipTo(ctx, start, scanNewLine(buf, start, end), &lastNewLine);
+            continue;
+        }
         Phase3Advance(ctx);
     }
     if(c == '\n') {
@@ -407,6 +854,39 @@ static void skipSingleLineComment(LexerToken* tok, Phase3Context* ctx) {
     tok->whitespaceBefore = true;
 }
 
+// skip a run of whitespace characters in one step if they are in a clean
+// region, only used for runs of more than one character, as for single
+// spaces refilling the lookahead would cost more than it saves
+static bool skipWhitespaceRun(LexerToken* tok, Phase3Context* ctx) {
+    unsigned char next = Phase3PeekNext(ctx);
+    if(next != ' ' && next != '\t' && next != '\n' && next != '\v' && next != '\f') {
+        return false;
+    }
+
+    size_t start, end;
+    if(!Phase3CleanRun(ctx, &start, &end)) {
+        return false;
+    }
+
+    const unsigned char* buf = ctx->phase2.phase1.source;
+    size_t target = scanWhitespace(buf, start, end);
+    size_t lastNewLine;
+    size_t indentStart = start;
+    if(Phase3SkipTo(ctx, start, target, &lastNewLine) > 0) {
+        Phase3StartOfLine(tok);
+        indentStart = lastNewLine + 1;
+    }
+
+    tok->whitespaceBefore = true;
+    size_t indent = tok->indent;
+    for(size_t i = indentStart; i < target; i++) {
+        if(buf[i] == ' ') indent++;
+        if(buf[i] == '\t') indent += ctx->settings->tabSize;
+    }
+    TokenSetIndent(tok, indent);
+    return true;
+}
+
 // skip characters until non-whitespace character encountered
 // also skips all comments, replacing them with whitespace
 // errors on unterminated multi-line comment
@@ -433,12 +913,18 @@ static void skipWhitespace(LexerToken* tok, Phase3Context* ctx) {
             case '\t':
             case '\v':
             case '\f':
+                if(skipWhitespaceRun(tok, ctx)) {
+                    break;
+                }
                 tok->whitespaceBefore = true;
                 Phase3Advance(ctx);
-                if(c == ' ') tok->indent++;
-                if(c == '\t') tok->indent += ctx->settings->tabSize;
+                if(c == ' ') TokenSetIndent(tok, tok->indent + 1);
+                if(c == '\t') TokenSetIndent(tok, tok->indent + ctx->settings->tabSize);
                 break;
             case '\n':
+                if(skipWhitespaceRun(tok, ctx)) {
+                    break;
+                }
                 Phase3NewLine(tok, ctx, '\r');
                 break;
             case '\r':
@@ -491,12 +977,16 @@ static bool isHexDigit(unsigned char c) {
 
 static bool AddUCSCodePoint(LexerString* str, intmax_t num, TranslationContext* settings) {
     if(num >= 0xD800 && num <= 0xDFFF) {
-        fprintf(stderr, "Error: surrogate pair specified by universal character name\n");
+        if(lexShouldReport(settings)) {
+            fprintf(stderr, "Error: surrogate pair specified by universal character name\n");
+        }
         return false;
     }
 
     if(num < 0x00A0 && num != '$' && num != '@' && num != '`') {
-        fprintf(stderr, "Error: universal character specified out of allowable range\n");
+        if(lexShouldReport(settings)) {
+            fprintf(stderr, "Error: universal character specified out of allowable range\n");
+        }
         return false;
     }
 
@@ -525,15 +1015,17 @@ static bool AddUCSCodePoint(LexerString* str, intmax_t num, TranslationContext*
         LexerStringAddChar(str, settings, o3);
         LexerStringAddChar(str, settings, o4);
     } else {
-        fprintf(stderr, "Error: UCS code point out of range: Maximum = 0x10FFFF\n");
+        if(lexShouldReport(settings)) {
+            fprintf(stderr, "Error: UCS code point out of range: Maximum = 0x10FFFF\n");
+        }
         return false;
     }
 
     return true;
 }
 
-// parse a universal character name
-static void ParseUniversalCharacterName(Phase3Context* ctx, LexerToken* tok) {
+// parse a universal character name, adding it to str
+static void ParseUniversalCharacterName(Phase3Context* ctx, LexerToken* tok, LexerString* str) {
     // '\\' already consumed
 
     // 'u' vs 'U' check already done
@@ -545,7 +1037,9 @@ static void ParseUniversalCharacterName(Phase3Context* ctx, LexerToken* tok) {
     for(int i = 0; i < length; i++) {
         unsigned char c = Phase3Advance(ctx);
         if(!isHexDigit(c)) {
-            fprintf(stderr, "Error: non-hex digit found in universal character name\n");
+            if(lexShouldReport(ctx->settings)) {
+                fprintf(stderr, "Error: non-hex digit found in universal character name\n");
+            }
             tok->type = TOKEN_ERROR_L;
             return;
         }
@@ -558,7 +1052,7 @@ static void ParseUniversalCharacterName(Phase3Context* ctx, LexerToken* tok) {
     char* end;
     intmax_t num = strtoimax(buffer, &end, 16);
 
-    if(!AddUCSCodePoint(&tok->data.string, num, ctx->settings)) {
+    if(!AddUCSCodePoint(str, num, ctx->settings)) {
         tok->type = TOKEN_ERROR_L;
     }
 }
@@ -578,14 +1072,16 @@ static void ParseString(Phase3Context* ctx, LexerToken* tok, unsigned char c, un
     unsigned char next = Phase3Peek(ctx);
 
     tok->type = start == '"' ? TOKEN_STRING_L : TOKEN_CHARACTER_L;
-    LexerStringInit(&tok->data.string, ctx->settings, 10);
+    tok->hasEscapes = false;
+    LexerString str;
+    LexerStringInit(&str, ctx->settings, 10);
     LexerStringType t =
         c == start ? STRING_NONE :
         c == 'u' && next == '8' ? STRING_U8 :
         c == 'u' ? STRING_16 :
         c == 'U' ? STRING_32 :
         STRING_WCHAR;
-    tok->data.string.type = t;
+    str.type = t;
 
     // skip prefix characters
     if(t == STRING_U8) {
@@ -598,13 +1094,16 @@ static void ParseString(Phase3Context* ctx, LexerToken* tok, unsigned char c, un
     c = Phase3Peek(ctx);
     while(!Phase3AtEnd(ctx) && c != start) {
         Phase3Advance(ctx);
-        LexerStringAddChar(&tok->data.string, ctx->settings, c);
+        LexerStringAddChar(&str, ctx->settings, c);
 
         // skip escape sequences so that \" does not end a string
         if(c == '\\') {
-            LexerStringAddChar(&tok->data.string, ctx->settings, Phase3Advance(ctx));
+            tok->hasEscapes = true;
+            LexerStringAddChar(&str, ctx->settings, Phase3Advance(ctx));
         } else if(c == '\n') {
-            fprintf(stderr, "Error: %s literal unterminated at end of line\n", start == '\'' ? "character" : "string");
+            if(lexShouldReport(ctx->settings)) {
+                fprintf(stderr, "Error: %s literal unterminated at end of line\n", start == '\'' ? "character" : "string");
+            }
             tok->type = TOKEN_ERROR_L;
             return;
         }
@@ -612,16 +1111,22 @@ static void ParseString(Phase3Context* ctx, LexerToken* tok, unsigned char c, un
         c = Phase3Peek(ctx);
     }
 
-    if(start == '\'' && tok->data.string.count == 0) {
-        fprintf(stderr, "Error: character literal requires at least one character\n");
+    if(start == '\'' && str.count == 0) {
+        if(lexShouldReport(ctx->settings)) {
+            fprintf(stderr, "Error: character literal requires at least one character\n");
+        }
         tok->type = TOKEN_ERROR_L;
     }
 
     if(Phase3Advance(ctx) != start) {
-        fprintf(stderr, "Error: %s literal unterminated at end of file\n", start == '\'' ? "character" : "string");
+        if(lexShouldReport(ctx->settings)) {
+            fprintf(stderr, "Error: %s literal unterminated at end of file\n", start == '\'' ? "character" : "string");
+        }
         tok->type = TOKEN_ERROR_L;
         return;
     }
+
+    TokenSetString(ctx->settings, tok, str);
 }
 
 // parses
@@ -631,51 +1136,91 @@ static void ParseString(Phase3Context* ctx, LexerToken* tok, unsigned char c, un
 static void ParseHeaderName(Phase3Context* ctx, LexerToken* tok, unsigned char end) {
     tok->type = end == '>' ? TOKEN_SYS_HEADER_NAME : TOKEN_HEADER_NAME;
 
-    LexerStringInit(&tok->data.string, ctx->settings, 20);
+    LexerString str;
+    LexerStringInit(&str, ctx->settings, 20);
 
     unsigned char c = Phase3Peek(ctx);
     while(!Phase3AtEnd(ctx) && c != end && c != '\n') {
         Phase3Advance(ctx);
         if(c == '\'' || c == '\\' || (end == '>' && c == '"')) {
-            fprintf(stderr, "Error: encountered `%c` while parsing header name "
-                " - this is undefined behaviour\n", c);
+            if(lexShouldReport(ctx->settings)) {
+                fprintf(stderr, "Error: encountered `%c` while parsing header name "
+                    " - this is undefined behaviour\n", c);
+            }
             tok->type = TOKEN_ERROR_L;
             return;
         }
 
-        LexerStringAddChar(&tok->data.string, ctx->settings, c);
+        LexerStringAddChar(&str, ctx->settings, c);
         c = Phase3Peek(ctx);
     }
 
     unsigned char last = Phase3Advance(ctx);
 
     if(last == END_OF_FILE) {
-        fprintf(stderr, "Error: encountered error while parsing header name\n");
+        if(lexShouldReport(ctx->settings)) {
+            fprintf(stderr, "Error: encountered error while parsing header name\n");
+        }
         tok->type = TOKEN_ERROR_L;
         return;
     } else if(last == '\n') {
-        fprintf(stderr, "Error: encounterd new-line while parsing header name\n");
+        if(lexShouldReport(ctx->settings)) {
+            fprintf(stderr, "Error: encounterd new-line while parsing header name\n");
+        }
         tok->type = TOKEN_ERROR_L;
         return;
     }
 
-    if(tok->data.string.count == 0) {
-        fprintf(stderr, "Error: empty file name in header file name\n");
+    if(str.count == 0) {
+        if(lexShouldReport(ctx->settings)) {
+            fprintf(stderr, "Error: empty file name in header file name\n");
+        }
         tok->type = TOKEN_ERROR_L;
         return;
     }
+
+    TokenSetString(ctx->settings, tok, str);
+}
+
+// Identifiers and pp-numbers start as a slice of the source buffer, starting
+// at the first character's location, which is extended while the characters
+// are the next bytes in the buffer.  Anything else, e.g. universal character
+// names or line splices, copies the string first (see expandString).
+static void Phase3InitSlice(Phase3Context* ctx, LexerString* str) {
+    str->buffer = (char*)SourceLocationText(ctx->settings, *ctx->currentLocation);
+    str->count = 0;
+    str->capacity = 0;
+    str->type = STRING_NONE;
+}
+
+// add a character, at the provided location, to a string started with
+// Phase3InitSlice
+static void Phase3AddChar(Phase3Context* ctx, LexerString* str, SourceLocation* loc, unsigned char c) {
+    if(str->capacity == 0 && loc->length == 1
+    && loc->offset == ctx->currentLocation->offset + str->count) {
+        str->count++;
+        return;
+    }
+    LexerStringAddChar(str, ctx->settings, c);
 }
 
 // character -> preprocessor token conversion
-static void Phase3Get(LexerToken* tok, Phase3Context* ctx) {
-    SourceLocation* loc = memoryArrayPush(&ctx->settings->locations);
-    *loc = *ctx->currentLocation;
-    loc->length = 0;
-    ctx->currentLocation = loc;
+static void Phase3Lex(LexerToken* tok, Phase3Context* ctx) {
+    // the location is set when the token's first character is read, so for
+    // the end of file token it is where the next character would have been
+    tok->loc = ctx->peekLoc;
+    tok->loc.length = 0;
+    ctx->currentLocation = &tok->loc;
 
     skipWhitespace(tok, ctx);
 
-    tok->loc = loc;
+    // header names are only lexed directly after "#include" on the same line
+    if(ctx->includeTokens == 2 && !tok->isStartOfLine) {
+        ctx->mode = LEX_MODE_MAYBE_HEADER;
+    } else {
+        ctx->mode = LEX_MODE_NO_HEADER;
+    }
+
     tok->isMacroExpanded = false;
     if(Phase3AtEnd(ctx)) {
         tok->type = TOKEN_EOF_L;
@@ -720,7 +1265,7 @@ static void Phase3Get(LexerToken* tok, Phase3Context* ctx) {
             TOKEN_PUNC_PLUS); return;
         case '|': Phase3Make(tok,
             Phase3Match(ctx, '|') ? TOKEN_PUNC_OR_OR :
-            Phase3Match(ctx, '=') ? TOKEN_PUNC_EQUAL :
+            Phase3Match(ctx, '=') ? TOKEN_PUNC_PIPE_EQUAL :
             TOKEN_PUNC_OR); return;
         case '&': Phase3Make(tok,
             Phase3Match(ctx, '&') ? TOKEN_PUNC_AND_AND :
@@ -766,14 +1311,21 @@ static void Phase3Get(LexerToken* tok, Phase3Context* ctx) {
                 Phase3Make(tok, TOKEN_PUNC_DOT);
             }
             return;
-        case '%': Phase3Make(tok,
-            Phase3Match(ctx, '=') ? TOKEN_PUNC_PERCENT_EQUAL :
-            Phase3Match(ctx, '>') ? TOKEN_PUNC_PERCENT_GREATER :
-            Phase3Match(ctx, ':') ? (
-                ctx->peek == '%' && ctx->peekNext == ':' ?
-                TOKEN_PUNC_PERCENT_COLON_PERCENT_COLON :
-                TOKEN_PUNC_PERCENT_COLON
-            ) : TOKEN_PUNC_PERCENT); return;
+        case '%':
+            if(Phase3Match(ctx, ':')) {
+                if(ctx->peek == '%' && ctx->peekNext == ':') {
+                    Phase3Advance(ctx);
+                    Phase3Advance(ctx);
+                    Phase3Make(tok, TOKEN_PUNC_PERCENT_COLON_PERCENT_COLON);
+                } else {
+                    Phase3Make(tok, TOKEN_PUNC_PERCENT_COLON);
+                }
+                return;
+            }
+            Phase3Make(tok,
+                Phase3Match(ctx, '=') ? TOKEN_PUNC_PERCENT_EQUAL :
+                Phase3Match(ctx, '>') ? TOKEN_PUNC_PERCENT_GREATER :
+                TOKEN_PUNC_PERCENT); return;
     }
 
     unsigned char next = Phase3Peek(ctx);
@@ -804,9 +1356,15 @@ static void Phase3Get(LexerToken* tok, Phase3Context* ctx) {
         // false otherwise
         bool consumedCharacter = true;
 
-        // initialisation
+        // the name is hashed while it is read, unless it contains universal
+        // character names, which are added as several bytes
+        uint32_t hash = IDENT_HASH_INIT;
+        bool needsHash = false;
+
+        // initialisation, starting as a slice of the source file
         tok->type = TOKEN_IDENTIFIER_L;
-        LexerStringInit(&tok->data.string, ctx->settings, 10);
+        LexerString name;
+        Phase3InitSlice(ctx, &name);
 
         // while is identifier character or slash
         while(!Phase3AtEnd(ctx) && (isNonDigit(c) || isDigit(c) || c == '\\')) {
@@ -817,7 +1375,8 @@ static void Phase3Get(LexerToken* tok, Phase3Context* ctx) {
             // found \u or \U => universal character name
             if(c == '\\' && (next == 'u' || next == 'U')) {
                 if(!consumedCharacter) Phase3Advance(ctx);
-                ParseUniversalCharacterName(ctx, tok);
+                ParseUniversalCharacterName(ctx, tok, &name);
+                needsHash = true;
             } else if(c == '\\') {
                 // found backslash not in escape sequence, will not be at
                 // start so do not need to un-consume it
@@ -826,8 +1385,10 @@ static void Phase3Get(LexerToken* tok, Phase3Context* ctx) {
             } else {
                 // regular character
                 // if not already done, consume it and join to the identifier
+                SourceLocation* loc = consumedCharacter ? ctx->currentLocation : &ctx->peekLoc;
+                Phase3AddChar(ctx, &name, loc, c);
+                hash = IdentHashStep(hash, c);
                 if(!consumedCharacter) Phase3Advance(ctx);
-                LexerStringAddChar(&tok->data.string, ctx->settings, c);
             }
 
             // advance
@@ -835,17 +1396,11 @@ static void Phase3Get(LexerToken* tok, Phase3Context* ctx) {
             consumedCharacter = false;
         }
 
-        HashNode* node = tableGet(ctx->hashNodes, tok->data.string.buffer, tok->data.string.count);
-        if(node == NULL) {
-            node = ArenaAlloc(sizeof(*node));
-            node->name = *tok;
-            node->type = NODE_VOID;
-            node->hash = stringHash(tok->data.string.buffer, tok->data.string.count);
-            node->macroExpansionEnabled = true;
-            tableSet(ctx->hashNodes, tok->data.string.buffer, tok->data.string.count, node);
+        if(needsHash) {
+            hash = IdentHash(name.buffer, name.count);
         }
-        tok->data.node = node;
-        tok->data.attemptExpansion = true;
+        TokenSetNode(tok, IdentTableGet(ctx->hashNodes, ctx->settings, name.buffer, name.count, hash));
+        tok->attemptExpansion = true;
 
         return;
     }
@@ -853,36 +1408,68 @@ static void Phase3Get(LexerToken* tok, Phase3Context* ctx) {
     // pp-number
     if(isDigit(c) || c == '.') {
         tok->type = TOKEN_PP_NUMBER;
-        LexerStringInit(&tok->data.string, ctx->settings, 10);
-        LexerStringAddChar(&tok->data.string, ctx->settings, c);
+        LexerString str;
+        Phase3InitSlice(ctx, &str);
+        Phase3AddChar(ctx, &str, ctx->currentLocation, c);
 
         unsigned char c = Phase3Peek(ctx);
         while(!Phase3AtEnd(ctx)) {
             char next = Phase3PeekNext(ctx);
             if((c == 'e' || c == 'E' || c == 'p' || c == 'P') &&
                 (next == '+' || next == '-')) {
+                Phase3AddChar(ctx, &str, &ctx->peekLoc, c);
+                Phase3AddChar(ctx, &str, &ctx->peekNextLoc, next);
                 Phase3Advance(ctx);
                 Phase3Advance(ctx);
             } else if(isDigit(c) || isNonDigit(c) || c == '.') {
+                Phase3AddChar(ctx, &str, &ctx->peekLoc, c);
                 Phase3Advance(ctx);
             } else {
                 break;
             }
 
-            LexerStringAddChar(&tok->data.string, ctx->settings, c);
             c = Phase3Peek(ctx);
         }
+        TokenSetString(ctx->settings, tok, str);
         return;
     }
 
     // default
     Phase3Make(tok, TOKEN_UNKNOWN_L);
-    tok->data.character = c;
+    tok->data = c;
+}
+
+// Lex a token, keeping track of whether it is part of "#include", so that
+// the tokens of a file only depend on its contents, not on what phase 4 does
+// with them, which allows them to be cached.
+static void Phase3Get(LexerToken* tok, Phase3Context* ctx) {
+    Phase3Lex(tok, ctx);
+
+    if((tok->type == TOKEN_PUNC_HASH || tok->type == TOKEN_PUNC_PERCENT_COLON) && tok->isStartOfLine) {
+        ctx->includeTokens = 1;
+    } else if(ctx->includeTokens == 1 && !tok->isStartOfLine && tok->type == TOKEN_IDENTIFIER_L &&
+        (tok->data == IDENT_INCLUDE || tok->data == IDENT_INCLUDE_NEXT)) {
+        ctx->includeTokens = 2;
+    } else {
+        ctx->includeTokens = 0;
+    }
+}
+
+// get the node for a name used by the compiler
+static HashNode* PredefinedNode(Phase3Context* ctx, const char* name) {
+    size_t len = strlen(name);
+    return IdentTableGet(ctx->hashNodes, ctx->settings, name, len, IdentHash(name, len));
 }
 
 static void PredefinedMacros(Phase3Context* ctx) {
-    ctx->hashNodes = ArenaAlloc(sizeof(Table));
-    TABLE_INIT(*ctx->hashNodes, HashNode*);
+    if(ctx->settings->idents == NULL) {
+        ctx->settings->idents = ArenaAlloc(sizeof(IdentTable));
+        IdentTableInit(ctx->settings->idents);
+    } else {
+        IdentTableUndefineAll(ctx->settings->idents);
+        ctx->settings->macroGeneration++;
+    }
+    ctx->hashNodes = ctx->settings->idents;
 
     time_t currentTime = time(NULL);
     struct tm timeStruct;
@@ -890,52 +1477,26 @@ static void PredefinedMacros(Phase3Context* ctx) {
 
     char* stringTime = ArenaAlloc(sizeof(char)*9);
     strftime(stringTime, 9, "%H:%M:%S", &timeStruct);
-    HashNode* time = ArenaAlloc(sizeof(HashNode));
+    HashNode* time = PredefinedNode(ctx, "__TIME__");
     time->type = NODE_MACRO_STRING;
     time->as.string = stringTime;
-    time->macroExpansionEnabled = true;
-    time->hash = stringHash("__TIME__", 8);
-    time->name.data.string.buffer = "__TIME__";
-    time->name.data.string.count = 8;
-    TABLE_SET(*ctx->hashNodes, "__TIME__", 8, time);
 
     char* stringDate = ArenaAlloc(sizeof(char) * 128);
     strftime(stringDate, 128, "%b %d %Y", &timeStruct);
-    HashNode* date = ArenaAlloc(sizeof(HashNode));
+    HashNode* date = PredefinedNode(ctx, "__DATE__");
     date->type = NODE_MACRO_STRING;
     date->as.string = stringDate;
-    date->macroExpansionEnabled = true;
-    date->hash = stringHash("__DATE__", 8);
-    date->name.data.string.buffer = "__DATE__";
-    date->name.data.string.count = 8;
-    TABLE_SET(*ctx->hashNodes, "__DATE__", 8, date);
 
-    HashNode* file = ArenaAlloc(sizeof(HashNode));
+    HashNode* file = PredefinedNode(ctx, "__FILE__");
     file->type = NODE_MACRO_FILE;
-    file->macroExpansionEnabled = true;
-    file->hash = stringHash("__FILE__", 8);
-    file->name.data.string.buffer = "__FILE__";
-    file->name.data.string.count = 8;
-    TABLE_SET(*ctx->hashNodes, "__FILE__", 8, file);
 
-    HashNode* line = ArenaAlloc(sizeof(HashNode));
+    HashNode* line = PredefinedNode(ctx, "__LINE__");
     line->type = NODE_MACRO_LINE;
-    line->macroExpansionEnabled = true;
-    line->hash = stringHash("__LINE__", 8);
-    line->name.data.string.buffer = "__LINE__";
-    line->name.data.string.count = 8;
-    TABLE_SET(*ctx->hashNodes, "__LINE__", 8, line);
 
 #define INT_MACRO(stringname, value) do {\
-        size_t len = strlen(stringname); \
-        HashNode* m = ArenaAlloc(sizeof(HashNode)); \
+        HashNode* m = PredefinedNode(ctx, stringname); \
         m->type = NODE_MACRO_INTEGER; \
         m->as.integer = (value); \
-        m->macroExpansionEnabled = true; \
-        m->hash = stringHash(stringname, len); \
-        m->name.data.string.buffer = stringname; \
-        m->name.data.string.count = len; \
-        TABLE_SET(*ctx->hashNodes, stringname, len, m); \
     } while(0)
 
     INT_MACRO("__STDC__", 1);
@@ -962,17 +1523,27 @@ static void PredefinedMacros(Phase3Context* ctx) {
 #undef INT_MACRO
 }
 
+// read the first two characters into the lookahead
+static void Phase3FillLookahead(Phase3Context* ctx) {
+    // the characters read to fill the lookahead are not part of a token
+    SourceLocation discard;
+    ctx->currentLocation = &discard;
+    Phase3AdvanceOverwrite(ctx);
+    Phase3AdvanceOverwrite(ctx);
+    ctx->currentLocation = NULL;
+}
+
 // initialise the context for running phase 3
 static void Phase3Initialise(Phase3Context* ctx, TranslationContext* settings, Phase3Context* parent, bool needPhase2) {
     if(needPhase2) Phase2Initialise(&ctx->phase2, settings);
 
     ctx->settings = settings;
     ctx->mode = LEX_MODE_NO_HEADER,
+    ctx->includeTokens = 0;
     ctx->peek = '\0',
     ctx->peekNext = '\0',
-    ctx->currentLocation = memoryArrayPush(&settings->locations);
-    ctx->peekLoc = *ctx->currentLocation,
-    ctx->peekNextLoc = *ctx->currentLocation,
+    ctx->peekLoc = (SourceLocation){0},
+    ctx->peekNextLoc = (SourceLocation){0},
     ctx->AtStart = true;
     if(!ctx->getter) {
         ctx->getter = Phase3GetFromPhase2;
@@ -987,100 +1558,953 @@ static void Phase3Initialise(Phase3Context* ctx, TranslationContext* settings, P
         }
     }
 
-    Phase3AdvanceOverwrite(ctx);
-    Phase3AdvanceOverwrite(ctx);
+    Phase3FillLookahead(ctx);
+}
+
+// Continue lexing from the byte at index, which must not be inside a token,
+// treating the next token as the first on its line if atStart is set.  Used
+// after phase 4 has skipped part of the file without lexing it.
+static void Phase3Restart(Phase3Context* ctx, size_t index, bool atStart) {
+    Phase2Context* phase2 = &ctx->phase2;
+    Phase1Context* phase1 = &phase2->phase1;
+
+    // the clean region is still valid if it was before index or contains
+    // it, and is searched for again when needed in the first case, which
+    // avoids searching to the end of the file on every restart
+    phase1->consumed = index;
+    if(index < phase1->cleanStart) {
+        phase1->cleanStart = 0;
+        phase1->cleanEnd = 0;
+    }
+    Phase1FindInvalid(phase1);
+
+    // used for the missing new line check at the end of the file, which
+    // has already been done if phase 2 reached the end while filling its
+    // lookahead
+    if(phase2->previous != END_OF_FILE && index > 0) {
+        phase2->previous = phase1->source[index - 1];
+    }
+    Phase2AdvanceOverwrite(phase2);
+
+    ctx->includeTokens = 0;
+    ctx->AtStart = atStart;
+    Phase3FillLookahead(ctx);
+}
+
+// initialise the context for lexing text that is already in memory, which
+// must be followed by a '\0' sentinel, starting at the byte at index, with
+// atStart as for Phase3Restart.  The file does not need to be one that was
+// added to the translation context, as long as its locations are inside of
+// one that was.
+static void Phase3InitialiseAt(Phase3Context* ctx, TranslationContext* settings, SourceFile* file, size_t index, bool atStart) {
+    Phase1Context* phase1 = &ctx->phase2.phase1;
+    phase1->source = file->source;
+    phase1->sourceLength = file->sourceLength;
+    phase1->file = file;
+    phase1->settings = settings;
+    phase1->cleanStart = 0;
+    phase1->cleanEnd = 0;
+
+    // the missing new line at the end of the file has already been reported
+    ctx->phase2.previous = END_OF_FILE;
+
+    ctx->settings = settings;
+    ctx->mode = LEX_MODE_NO_HEADER;
+    ctx->getter = Phase3GetFromPhase2;
+    ctx->getterCtx = ctx;
+    ctx->hashNodes = settings->idents;
+    Phase3Restart(ctx, index, atStart);
 }
 
 // helper to run upto and including phase 3
 void runPhase3(TranslationContext* settings) {
     Phase3Context ctx = {0};
+    TranslationContextStartUnit(settings);
     Phase3Initialise(&ctx, settings, NULL, true);
 
     LexerToken tok;
     TokenPrintCtxFile printCtx;
-    TokenPrintCtxInitFile(&printCtx, stdout, settings);
+    TokenPrintCtxInitFile(&printCtx, settings->output, settings);
 
     while(Phase3Get(&tok, &ctx), tok.type != TOKEN_EOF_L) {
         TokenPrintFile(&printCtx, &tok);
     }
-    fprintf(stdout, "\n");
+    fprintf(settings->output, "\n");
 }
 
-// ------- //
-// Phase 4 //
-// ------- //
-// macro expansion
-// directive execution
-// _Pragma expansion
-// include resolution
+// ------------ //
+// Raw Scanning //
+// ------------ //
+// Skipping source bytes that phase 4 does not need tokens for, without
+// running phases 1 to 3, so identifiers in the skipped bytes are never
+// interned.  Only comments, literals and line splices are looked at, so that
+// the end of a line, or a "#" inside one of those, is found correctly.  Each
+// function takes the index of a byte in the source and returns the index
+// after what it skipped.  Trigraphs are not handled, so phases 1 to 3 have
+// to be used if they are enabled.
+
+// skip any line splices at index i
+static size_t rawSkipSplices(const unsigned char* buf, size_t i) {
+    while(buf[i] == '\\') {
+        if(buf[i + 1] == '\n') {
+            i += 2;
+        } else if(buf[i + 1] == '\r' && buf[i + 2] == '\n') {
+            i += 3;
+        } else {
+            break;
+        }
+    }
+    return i;
+}
 
-static void Phase4Initialise(Phase4Context* ctx, TranslationContext* settings, Phase4Context* parent) {
-    Phase3Initialise(&ctx->phase3, settings, NULL, true);
+static bool rawIsLineEnd(unsigned char c) {
+    return c == '\n' || c == '\r';
+}
 
-    ctx->settings = settings;
+// is there a comment starting at index i?
+static bool rawIsComment(const unsigned char* buf, size_t i) {
+    if(buf[i] != '/') return false;
+    unsigned char next = buf[rawSkipSplices(buf, i + 1)];
+    return next == '/' || next == '*';
+}
 
-    if(parent != NULL) {
-        ctx->phase3.hashNodes = parent->phase3.hashNodes;
-    } else {
-        ctx->phase3.hashNodes = NULL;
+// skip the comment at index i, stopping before the new line that ends a
+// single line comment.  Sets newLine if a multi-line comment contains a new
+// line, as the token after it is then at the start of a line, returns false
+// if a multi-line comment is unterminated.
+static bool rawSkipComment(const unsigned char* buf, size_t len, size_t* i, bool* newLine) {
+    size_t j = rawSkipSplices(buf, *i + 1);
+
+    if(buf[j] == '/') {
+        j = rawSkipSplices(buf, j + 1);
+        while(j < len && !rawIsLineEnd(buf[j])) {
+            j = rawSkipSplices(buf, j + 1);
+        }
+        *i = j;
+        return true;
     }
 
-    ctx->mode = LEX_MODE_NO_HEADER;
-    ctx->searchState = (IncludeSearchState){0};
-    ctx->parent = parent;
-    ctx->macroCtx = (MacroContext){0};
+    j = rawSkipSplices(buf, j + 1);
+    while(j < len) {
+        if(buf[j] == '*') {
+            size_t k = rawSkipSplices(buf, j + 1);
+            if(buf[k] == '/') {
+                *i = k + 1;
+                return true;
+            }
+            j = k;
+            continue;
+        }
+        if(rawIsLineEnd(buf[j])) {
+            *newLine = true;
+        }
+        j = rawSkipSplices(buf, j + 1);
+    }
+    return false;
+}
+
+// skip the character or string literal starting with the quote at index i,
+// which ends at the matching quote or, if unterminated, before the new line,
+// in which case unterminated is set
+static size_t rawSkipLiteral(const unsigned char* buf, size_t len, size_t i, bool* unterminated) {
+    unsigned char quote = buf[i];
+    i = rawSkipSplices(buf, i + 1);
+
+    while(i < len && !rawIsLineEnd(buf[i])) {
+        if(buf[i] == quote) {
+            return i + 1;
+        }
+
+        // skip escape sequences so that \" does not end a string
+        if(buf[i] == '\\') {
+            i = rawSkipSplices(buf, i + 1);
+            if(i >= len || rawIsLineEnd(buf[i])) break;
+        }
+        i = rawSkipSplices(buf, i + 1);
+    }
+
+    *unterminated = true;
+    return i;
+}
+
+// does the directive name read into buf match name?
+static bool rawIsName(const char* buf, size_t length, const char* name) {
+    return length == strlen(name) && memcmp(buf, name, length) == 0;
+}
+
+// are the bytes of name anywhere in [start, end)?
+static bool rawContains(const unsigned char* buf, size_t start, size_t end, const char* name) {
+    size_t length = strlen(name);
+    for(size_t i = start; i + length <= end; i++) {
+        if(buf[i] == (unsigned char)name[0] && memcmp(buf + i, name, length) == 0) {
+            return true;
+        }
+    }
+    return false;
+}
+
+// is there a '\\' followed by 'u' or 'U' anywhere in [start, end), which
+// could be the start of a universal character name?
+static bool rawContainsUcn(const unsigned char* buf, size_t start, size_t end) {
+    for(size_t i = start; i < end; i++) {
+        if(buf[i] != '\\') continue;
+        unsigned char next = buf[rawSkipSplices(buf, i + 1)];
+        if(next == 'u' || next == 'U') {
+            return true;
+        }
+    }
+    return false;
+}
+
+// are there any bytes in [start, end) that phase 1 reports an error for?
+static bool rawHasInvalidBytes(SourceFile* file, size_t start, size_t end) {
+    size_t i = SourceFileFindInvalid(file, start);
+    return i < file->invalidByteCount && file->invalidBytes[i] < end;
+}
+
+// Skip the rest of the line from index i, which is part way through it.
+// Sets i to the start of the next line and lineEnd to the new line, or the
+// multi-line comment containing a new line, that ended the line, so lexing
+// from lineEnd gives the same tokens as lexing the whole line would have.
+// Returns false, with both at its start, if a multi-line comment is
+// unterminated.  Sets unterminated if a literal on the line is.
+static bool rawSkipLine(const unsigned char* buf, size_t len, size_t* i, size_t* lineEnd, bool* unterminated) {
+    size_t j = *i;
+    while(j < len) {
+        unsigned char c = buf[j];
+        if(rawIsLineEnd(c)) {
+            *lineEnd = j;
+            *i = j + 1;
+            return true;
+        }
+
+        if(c == '"' || c == '\'') {
+            j = rawSkipLiteral(buf, len, j, unterminated);
+        } else if(rawIsComment(buf, j)) {
+            size_t start = j;
+            bool newLine = false;
+            if(!rawSkipComment(buf, len, &j, &newLine)) {
+                *lineEnd = start;
+                *i = start;
+                return false;
+            }
+            if(newLine) {
+                *lineEnd = start;
+                *i = j;
+                return true;
+            }
+        } else {
+            j = rawSkipSplices(buf, j + 1);
+        }
+    }
+
+    *lineEnd = len;
+    *i = len;
+    return true;
+}
+
+// Skip lines from index i, which is the start of a line's first token if
+// atStart is set, otherwise part way through a line, until a line starting
+// with "#" or "%:".  Returns the index of that token, or where lexing should
+// continue from if the end of the file is reached first.
+static size_t rawSkipToDirective(const unsigned char* buf, size_t len, size_t i, bool atStart) {
+    while(i < len) {
+        if(!atStart) {
+            size_t lineEnd;
+            bool unterminated;
+            if(!rawSkipLine(buf, len, &i, &lineEnd, &unterminated)) return i;
+            atStart = true;
+            continue;
+        }
+
+        // skip whitespace and comments before the first token of the line
+        unsigned char c = buf[i];
+        if(c == ' ' || c == '\t' || c == '\v' || c == '\f' || rawIsLineEnd(c)) {
+            i++;
+            continue;
+        }
+        if(c == '\\' && rawSkipSplices(buf, i) != i) {
+            i = rawSkipSplices(buf, i);
+            continue;
+        }
+        if(rawIsComment(buf, i)) {
+            size_t start = i;
+            if(!rawSkipComment(buf, len, &i, &atStart)) return start;
+            continue;
+        }
+
+        if(c == '#' || (c == '%' && buf[rawSkipSplices(buf, i + 1)] == ':')) {
+            return i;
+        }
+        atStart = false;
+    }
+
+    return len;
+}
+
+// --------------- //
+// Parallel Lexing //
+// --------------- //
+// A large file is split into chunks at new lines, which are lexed by phase 3
+// at the same time, each assuming that it starts outside of any token or
+// comment.  Where that is wrong, e.g. a chunk starting inside a multi-line
+// comment or after a line splice, the lexer of the chunk before it is
+// continued into the chunk, until it lexes a token at the start of a line
+// that the chunk lexed in the same way, as from there on the chunk's tokens
+// are the same as if the file had been lexed in one go.  Each chunk has its
+// own identifiers and token data, as they cannot be shared between threads,
+// which are added to the translation context's while joining the chunks.
+
+typedef struct LexChunk {
+    // the bytes [start, end) of the file, start is the start of a line
+    SourceFile* file;
+    size_t start;
+    size_t end;
+
+    // the pool holds the chunk's tokens and strings, and is released once
+    // the chunks are joined, see lexChunksRelease
+    Thread thread;
+    TranslationContext settings;
+    MemoryPool pool;
+    Phase3Context phase3;
+
+    // the tokens starting inside of the chunk, then the first token after
+    // it, which is the end of file token for the last chunk.  tokens points
+    // into tokenArr, which has one page that fits every token the chunk
+    // could have, so is never split
+    MemoryArray tokenArr;
+    TokenList tokens;
+    LexerToken next;
+
+    // the index of the last token in tokens that reported an error when it
+    // was lexed, or SIZE_MAX, and whether next did
+    size_t lastError;
+    bool nextError;
+
+    // the translation context's id for each of the chunk's identifiers,
+    // IDENT_NONE until it has been looked up, see lexChunkToken
+    ARRAY_DEFINE(uint32_t, identId);
+
+    // the chunk's token strings are copied to the translation context's at
+    // stringStart when its tokens are first used, any added by lexing after
+    // that are copied one at a time
+    size_t stringStart;
+    size_t stringCount;
+} LexChunk;
+
+// lex the next token of a chunk, returning whether it reported an error
+static bool lexChunkGet(LexChunk* chunk, LexerToken* tok) {
+    Phase3Get(tok, &chunk->phase3);
+
+    bool error = chunk->settings.lexErrorFound;
+    chunk->settings.lexErrorFound = false;
+    return error;
+}
+
+// lex the tokens starting inside of a chunk, run on the chunk's own thread
+static void lexChunk(void* voidChunk) {
+    LexChunk* chunk = voidChunk;
+    TranslationContext* settings = &chunk->settings;
+
+    // each token is at least one byte, apart from the end of file token,
+    // and the index at the start of the array's page
+    size_t tokenSpace = (chunk->end - chunk->start + 2) * sizeof(LexerToken) + 128*KiB;
+    memoryPoolAlloc(&chunk->pool, 4ULL*GiB + tokenSpace);
+    memoryArrayAlloc(&chunk->tokenArr, &chunk->pool, tokenSpace, sizeof(LexerToken));
+    TranslationContextInit(settings, &chunk->pool);
+    ARRAY_PUSH(*settings, file, chunk->file);
+    settings->idents = ArenaAlloc(sizeof(IdentTable));
+    IdentTableInit(settings->idents);
+    settings->lexSpeculative = true;
+
+    // chunks after the first start from the new line before them, so their
+    // first token gets the same whitespace as it would have from the lexer
+    // reading the whole file
+    if(chunk->start == 0) {
+        Phase3InitialiseAt(&chunk->phase3, settings, chunk->file, 0, true);
+    } else {
+        Phase3InitialiseAt(&chunk->phase3, settings, chunk->file, chunk->start - 1, false);
+    }
+
+    ARRAY_ZERO(chunk->tokens, item);
+    ARRAY_ALLOC(uint32_t, *chunk, identId);
+    chunk->lastError = SIZE_MAX;
+    chunk->stringStart = 0;
+    chunk->stringCount = 0;
+
+    uint32_t end = chunk->file->start + chunk->end;
+    while(true) {
+        LexerToken tok;
+        bool error = lexChunkGet(chunk, &tok);
+        if(tok.type == TOKEN_EOF_L || tok.loc.offset >= end) {
+            chunk->next = tok;
+            chunk->nextError = error;
+            break;
+        }
+
+        if(error) {
+            chunk->lastError = chunk->tokenArr.itemCount;
+        }
+        *(LexerToken*)memoryArrayPush(&chunk->tokenArr) = tok;
+    }
+
+    chunk->tokens.itemCount = chunk->tokenArr.itemCount;
+    if(chunk->tokens.itemCount > 0) {
+        chunk->tokens.items = memoryArrayGet(&chunk->tokenArr, 0);
+    }
+}
+
+// A string lexed by a chunk is either part of the file, or is in the chunk's
+// memory pool, which is released once the chunks are joined, so is copied.
+static LexerString lexChunkKeepString(LexChunk* chunk, LexerString str) {
+    const char* source = (const char*)chunk->file->source;
+    if(str.buffer >= source && str.buffer <= source + chunk->file->sourceLength) {
+        return str;
+    }
+
+    char* buffer = ArenaAlloc(str.count + 1);
+    memcpy(buffer, str.buffer, str.count);
+    buffer[str.count] = '\0';
+    str.buffer = buffer;
+    str.capacity = str.count;
+    return str;
+}
+
+// copy all of a chunk's token strings to the translation context at once
+static void lexChunkAddStrings(TranslationContext* settings, LexChunk* chunk) {
+    size_t count = chunk->settings.tokenStringCount;
+    size_t needed = settings->tokenStringCount + count;
+    if(settings->tokenStringCapacity < needed) {
+        settings->tokenStrings = ArenaReAlloc(settings->tokenStrings,
+            settings->tokenStringCapacity * sizeof(LexerString), needed * sizeof(LexerString));
+        settings->tokenStringCapacity = needed;
+    }
+
+    for(size_t i = 0; i < count; i++) {
+        settings->tokenStrings[settings->tokenStringCount + i] =
+            lexChunkKeepString(chunk, chunk->settings.tokenStrings[i]);
+    }
+    chunk->stringStart = settings->tokenStringCount;
+    chunk->stringCount = count;
+    settings->tokenStringCount = needed;
+}
+
+// convert a token lexed by a chunk to use the translation context's data
+static LexerToken lexChunkToken(TranslationContext* settings, LexChunk* chunk, LexerToken tok) {
+    if(tok.type == TOKEN_IDENTIFIER_L && tok.data >= IDENT_PREDECLARED_COUNT) {
+        while(chunk->identIdCount <= tok.data) {
+            ARRAY_PUSH(*chunk, identId, (uint32_t)IDENT_NONE);
+        }
+
+        uint32_t* id = &chunk->identIds[tok.data];
+        if(*id == IDENT_NONE) {
+            HashNode* node = chunk->settings.idents->nodes[tok.data];
+            *id = IdentTableGet(settings->idents, settings, node->name.buffer,
+                node->name.count, node->hash)->id;
+        }
+        tok.data = *id;
+    } else if(TokenHasString(tok.type)) {
+        if(tok.data < chunk->stringCount) {
+            tok.data += chunk->stringStart;
+        } else {
+            TokenSetString(settings, &tok, lexChunkKeepString(chunk, chunk->settings.tokenStrings[tok.data]));
+        }
+    }
+
+    return tok;
+}
+
+// Would the lexer be in the same state after lexing either token?  Only true
+// for the same token at the start of a line, as how it is lexed then does not
+// depend on the tokens before it, see Phase3Get.
+static bool lexChunkTokensMatch(LexerToken* a, LexerToken* b) {
+    return a->isStartOfLine && b->isStartOfLine && a->type == b->type &&
+        a->loc.offset == b->loc.offset && a->loc.length == b->loc.length &&
+        a->renderStartOfLine == b->renderStartOfLine &&
+        a->whitespaceBefore == b->whitespaceBefore && a->indent == b->indent;
+}
+
+// Join the tokens of the chunks, lexing again where a chunk did not start in
+// the right place, returning false if any token used reported an error.
+static bool lexChunksJoin(TranslationContext* settings, LexChunk* chunks, size_t chunkCount, TokenList* tokens) {
+    // the chunk whose lexer is at the right place in the file, with the
+    // next token it lexed, which has not been added yet
+    LexChunk* lexer = &chunks[0];
+    if(lexer->lastError != SIZE_MAX) return false;
+    lexChunkAddStrings(settings, lexer);
+    for(size_t i = 0; i < lexer->tokens.itemCount; i++) {
+        ARRAY_PUSH(*tokens, item, lexChunkToken(settings, lexer, lexer->tokens.items[i]));
+    }
+    LexerToken next = lexer->next;
+    bool nextError = lexer->nextError;
+
+    for(size_t i = 1; i < chunkCount; i++) {
+        LexChunk* chunk = &chunks[i];
+        uint32_t end = chunk->file->start + chunk->end;
+        size_t matched = 0;
+        bool relexed = false;
+
+        while(next.type != TOKEN_EOF_L && next.loc.offset < end) {
+            while(matched < chunk->tokens.itemCount &&
+                chunk->tokens.items[matched].loc.offset < next.loc.offset) {
+                matched++;
+            }
+            if(nextError) return false;
+            ARRAY_PUSH(*tokens, item, lexChunkToken(settings, lexer, next));
+
+            if(matched < chunk->tokens.itemCount &&
+                lexChunkTokensMatch(&chunk->tokens.items[matched], &next)) {
+                // the rest of the chunk's tokens are right, an error in
+                // the tokens before them does not matter as they are not used
+                if(chunk->lastError != SIZE_MAX && chunk->lastError > matched) {
+                    return false;
+                }
+                lexChunkAddStrings(settings, chunk);
+                for(size_t j = matched + 1; j < chunk->tokens.itemCount; j++) {
+                    ARRAY_PUSH(*tokens, item, lexChunkToken(settings, chunk, chunk->tokens.items[j]));
+                }
+                lexer = chunk;
+                next = chunk->next;
+                nextError = chunk->nextError;
+                break;
+            }
+
+            relexed = true;
+            nextError = lexChunkGet(lexer, &next);
+        }
+
+        if(relexed) settings->parallelChunksRelexed++;
+    }
+
+    if(nextError) return false;
+    ARRAY_PUSH(*tokens, item, lexChunkToken(settings, lexer, next));
+    return true;
+}
+
+// the tokens used from the chunks have been copied, along with any strings
+// that were in the chunks' memory, so none of it is needed any more
+static void lexChunksRelease(LexChunk* chunks, size_t chunkCount) {
+    for(size_t i = 0; i < chunkCount; i++) {
+        memoryPoolFree(&chunks[i].pool);
+    }
+}
+
+// Lex a file on up to settings->lexJobs threads, adding its phase 3 tokens,
+// ending with the end of file token, to tokens.  Returns false if the file
+// is too small to split, or if lexing it reported an error, as errors have
+// to be printed in order with the ones from the other phases.
+static bool lexParallel(TranslationContext* settings, SourceFile* file, TokenList* tokens) {
+    size_t length = file->sourceLength;
+    size_t chunkCount = length / settings->lexChunkSize;
+    if(chunkCount > (size_t)settings->lexJobs) chunkCount = settings->lexJobs;
+    if(chunkCount < 2) return false;
+
+    // each chunk ends after the first new line past its share of the file
+    LexChunk* chunks = ArenaAlloc(sizeof(LexChunk) * chunkCount);
+    size_t count = 0;
+    size_t start = 0;
+    while(start < length && count < chunkCount) {
+        size_t end = length;
+        if(count + 1 < chunkCount) {
+            size_t target = length / chunkCount * (count + 1);
+            if(target < start) target = start;
+            const unsigned char* newLine = memchr(file->source + target, '\n', length - target);
+            if(newLine != NULL) end = newLine - file->source + 1;
+        }
+
+        LexChunk* chunk = &chunks[count++];
+        chunk->file = file;
+        chunk->start = start;
+        chunk->end = end;
+        chunk->settings = *settings;
+        start = end;
+    }
+    if(count < 2) return false;
+
+    for(size_t i = 1; i < count; i++) {
+        chunks[i].thread = ThreadStart(lexChunk, &chunks[i]);
+    }
+    lexChunk(&chunks[0]);
+    for(size_t i = 1; i < count; i++) {
+        if(chunks[i].thread == NULL) {
+            lexChunk(&chunks[i]);
+        } else {
+            ThreadJoin(chunks[i].thread);
+        }
+    }
+
+    // there are about as many tokens as the chunks lexed, so allocate the
+    // space for them at once rather than growing the array
+    size_t tokenCount = tokens->itemCount;
+    size_t needed = tokenCount + 1;
+    for(size_t i = 0; i < count; i++) {
+        needed += chunks[i].tokens.itemCount;
+    }
+    if(tokens->itemCapacity < needed) {
+        tokens->items = ArenaReAlloc(tokens->items,
+            tokens->itemCapacity * sizeof(LexerToken), needed * sizeof(LexerToken));
+        tokens->itemCapacity = needed;
+    }
+
+    bool joined = lexChunksJoin(settings, chunks, count, tokens);
+    lexChunksRelease(chunks, count);
+    if(!joined) {
+        tokens->itemCount = tokenCount;
+        return false;
+    }
+
+    settings->parallelFiles++;
+    settings->parallelChunks += count;
+    return true;
+}
+
+// ------- //
+// Phase 4 //
+// ------- //
+// macro expansion
+// directive execution
+// _Pragma expansion
+// include resolution
+
+// Lex the next token of the file into the block, returning whether the block
+// can be filled past it.  Phase 4 decides whether to skip the rest of a
+// directive's line, or the group after it, without lexing it, when only the
+// two tokens after the last one it used have been lexed.  So the tokens of a
+// directive's line, and the two after it, are lexed one at a time as phase 4
+// needs them, and only other lines a block at a time.
+static bool Phase4FillToken(Phase4Context* ctx) {
+    LexerToken* tok = &ctx->block[ctx->tokenCount++];
+    Phase3Get(tok, &ctx->phase3);
+    if(tok->type == TOKEN_EOF_L) {
+        return false;
+    }
+
+    if(tok->isStartOfLine) {
+        if(tok->type == TOKEN_PUNC_HASH || tok->type == TOKEN_PUNC_PERCENT_COLON) {
+            ctx->fillInDirective = true;
+        } else if(ctx->fillInDirective) {
+            ctx->fillInDirective = false;
+            ctx->fillSingleTokens = 1;
+            return false;
+        }
+    }
+
+    if(ctx->fillInDirective) {
+        return false;
+    }
+    if(ctx->fillSingleTokens > 0) {
+        ctx->fillSingleTokens--;
+        return false;
+    }
+    return true;
+}
+
+// Has enough of the block been filled?  It always has the next two tokens,
+// unless the end of the file comes first, and otherwise stops where
+// Phase4FillToken said it should.
+static bool Phase4FillDone(Phase4Context* ctx, bool more) {
+    size_t count = ctx->tokenCount;
+    if(count == PHASE4_BLOCK_SIZE || (count > 0 && ctx->block[count - 1].type == TOKEN_EOF_L)) {
+        return true;
+    }
+    return !more && count >= 2;
+}
+
+// how many tokens are lexed between copies of phase 3's state, see Phase4Fill
+#define PHASE4_FILL_CHECKPOINT 16
+
+// Lex the next tokens of the file into the block, after the ones not yet
+// used, recording them in the file's token cache if it has one.  A replayed
+// cache is used in place, so is never filled.
+// Phase 3 runs ahead of phase 4 here, so its errors are only recorded, see
+// lexShouldReport, and the block ends before a token that gave one, by going
+// back to the last copy of phase 3's state and lexing up to it again.  That
+// token is lexed again once it is one of the next two, so errors are printed
+// when they would be if each token was lexed as it was needed, and never for
+// tokens that phase 4 then skips, see Phase4Restart.
+static void Phase4Fill(Phase4Context* ctx) {
+    TranslationContext* settings = ctx->settings;
+
+    size_t kept = ctx->tokenCount - ctx->tokenPosition;
+    memmove(ctx->block, &ctx->tokens[ctx->tokenPosition], kept * sizeof(LexerToken));
+    ctx->tokens = ctx->block;
+    ctx->tokenCount = kept;
+    ctx->tokenPosition = 0;
+
+    bool more = true;
+    while(!Phase4FillDone(ctx, more)) {
+        Phase3Context start = ctx->phase3;
+        bool startInDirective = ctx->fillInDirective;
+        unsigned char startSingleTokens = ctx->fillSingleTokens;
+        size_t startStrings = settings->tokenStringCount;
+        size_t first = ctx->tokenCount;
+
+        settings->lexSpeculative = true;
+        do {
+            more = Phase4FillToken(ctx);
+        } while(!Phase4FillDone(ctx, more) && !settings->lexErrorFound &&
+            ctx->tokenCount - first < PHASE4_FILL_CHECKPOINT);
+        settings->lexSpeculative = false;
+
+        if(!settings->lexErrorFound) {
+            continue;
+        }
+        settings->lexErrorFound = false;
+
+        // lex the tokens before the error again, which cannot give any
+        size_t errorIndex = ctx->tokenCount - 1;
+        ctx->phase3 = start;
+        ctx->fillInDirective = startInDirective;
+        ctx->fillSingleTokens = startSingleTokens;
+        settings->tokenStringCount = startStrings;
+        ctx->tokenCount = first;
+        while(ctx->tokenCount < errorIndex) {
+            Phase4FillToken(ctx);
+        }
+
+        if(errorIndex >= 2) {
+            break;
+        }
+        more = Phase4FillToken(ctx);
+    }
+
+    CachedFile* cache = ctx->cache;
+    if(cache != NULL && !cache->complete) {
+        for(size_t i = kept; i < ctx->tokenCount; i++) {
+            ARRAY_PUSH(cache->tokens, item, ctx->block[i]);
+        }
+        cache->complete = ctx->block[ctx->tokenCount - 1].type == TOKEN_EOF_L;
+    }
+}
+
+// start reading the file's tokens, from its token cache if it is replayed
+static void Phase4StartTokens(Phase4Context* ctx) {
+    ctx->tokenPosition = 0;
+    if(ctx->replaying) {
+        ctx->tokens = ctx->cache->tokens.items;
+        ctx->tokenCount = ctx->cache->tokens.itemCount;
+        return;
+    }
+
+    // the start of the file, or the bytes after a skip, are treated like the
+    // line after a directive, see Phase4FillToken
+    ctx->tokens = ctx->block;
+    ctx->tokenCount = 0;
+    ctx->fillInDirective = false;
+    ctx->fillSingleTokens = 2;
+    Phase4Fill(ctx);
+}
+
+// Find the token cache for the file being included, settings->fileName.
+// Files are only recorded the second time they are opened, as most are only
+// included once, or have an include guard, so would never be replayed.
+static void Phase4FindCache(Phase4Context* ctx) {
+    TranslationContext* settings = ctx->settings;
+    const char* fileName = (const char*)settings->fileName;
+    size_t len = strlen(fileName);
+
+    CachedFile* cache = tableGet(&settings->tokenCache, fileName, len);
+    if(cache == NULL) {
+        cache = ArenaAlloc(sizeof(*cache));
+        cache->file = NULL;
+        cache->openCount = 0;
+        ARRAY_ZERO(cache->tokens, item);
+        cache->complete = false;
+        TABLE_SET(settings->tokenCache, fileName, len, cache);
+    }
+
+    cache->openCount++;
+    if(cache->complete) {
+        ctx->cache = cache;
+        ctx->replaying = true;
+        settings->tokenCacheHits++;
+        settings->tokenCacheBytesSaved += cache->file->sourceLength;
+    } else if(cache->openCount == 2) {
+        ctx->cache = cache;
+        ARRAY_ALLOC(LexerToken, cache->tokens, item);
+    }
+}
+
+// add a file to the dependencies of the current translation unit
+static void addDependency(TranslationContext* settings, const char* fileName) {
+    size_t length = strlen(fileName);
+    if(tableHas(&settings->dependencySet, fileName, length)) {
+        return;
+    }
+
+    bool value = true;
+    TABLE_SET(settings->dependencySet, fileName, length, value);
+    ARRAY_PUSH(*settings, dependency, fileName);
+}
+
+// Lex a large file on several threads, see lexParallel, with its tokens then
+// replayed as if they were from its token cache.
+static void Phase4LexParallel(Phase4Context* ctx) {
+    TranslationContext* settings = ctx->settings;
+    if(settings->lexJobs < 2 || ctx->file->sourceLength < (size_t)settings->lexChunkSize * 2) {
+        return;
+    }
+
+    // a file already being recorded into the token cache is filled in,
+    // otherwise the tokens are only kept while the file is read
+    CachedFile* cache = ctx->cache;
+    if(cache == NULL) {
+        cache = ArenaAlloc(sizeof(*cache));
+        cache->file = ctx->file;
+        cache->openCount = 1;
+        ARRAY_ALLOC(LexerToken, cache->tokens, item);
+        cache->complete = false;
+    }
+
+    if(lexParallel(settings, ctx->file, &cache->tokens)) {
+        cache->complete = true;
+        ctx->cache = cache;
+        ctx->replaying = true;
+    }
+}
+
+static void Phase4Initialise(Phase4Context* ctx, TranslationContext* settings, Phase4Context* parent) {
+    ctx->settings = settings;
+
+    ctx->searchState = (IncludeSearchState){0};
+    ctx->parent = parent;
+    ctx->root = parent != NULL ? parent->root : ctx;
+    ctx->current = ctx;
+    ctx->freeContexts = NULL;
+    ctx->macroCtx = (MacroContext){0};
     ctx->ifDirectiveDepth = 0;
     ctx->ifDirectiveAcceptedDepth = 0;
+    ctx->guardState = GUARD_START;
+    ctx->guardMacro = NULL;
+    ctx->cache = NULL;
+    ctx->replaying = false;
     if(parent != NULL) {
         ctx->depth = parent->depth + 1;
+        ctx->phase3.hashNodes = parent->phase3.hashNodes;
+        Phase4FindCache(ctx);
     } else {
         ctx->depth = 0;
-        ctx->previous.loc = &(SourceLocation) {
-            .fileName = settings->fileName,
-            .column = 0,
+        ctx->phase3.hashNodes = NULL;
+        TranslationContextStartUnit(settings);
+    }
+
+    if(ctx->replaying) {
+        // phase 3 is not run, but its macro table is still used for ##
+        ctx->phase3.settings = settings;
+        ctx->file = ctx->cache->file;
+    } else {
+        Phase3Initialise(&ctx->phase3, settings, NULL, true);
+        ctx->file = ctx->phase3.phase2.phase1.file;
+        if(ctx->cache != NULL) {
+            ctx->cache->file = ctx->file;
+        }
+        Phase4LexParallel(ctx);
+    }
+
+    if(parent == NULL) {
+        // guard macros are only valid in the translation unit they were
+        // found in, as each has its own macro definitions
+        TABLE_INIT(settings->includeGuards, IncludeGuard*);
+
+        if(settings->scanDeps) {
+            ARRAY_ALLOC(const char*, *settings, dependency);
+            TABLE_INIT(settings->dependencySet, bool);
+            addDependency(settings, (const char*)ctx->file->fileName);
+        }
+
+        if(settings->pchData != NULL) {
+            PchLoad(settings);
+        }
+
+        ctx->previous.loc = (SourceLocation) {
+            .offset = ctx->file->start,
             .length = 0,
-            .line = 1,
-            .sourceText = (const unsigned char*)"",
         };
     }
+    Phase4StartTokens(ctx);
+}
+
+// continue from the byte at index after skipping part of the file without
+// lexing it, see Phase3Restart.  Any tokens lexed ahead of the skip are
+// dropped, and had none of their errors printed.
+static void Phase4Restart(Phase4Context* ctx, size_t index, bool atStart) {
+    Phase3Restart(&ctx->phase3, index, atStart);
+    Phase4StartTokens(ctx);
+}
 
-    Phase3Initialise(&ctx->phase3, settings, NULL, true);
-    Phase3Get(&ctx->peek, &ctx->phase3);
-    Phase3Get(&ctx->peekNext, &ctx->phase3);
+// get the next token, with ahead 0, or the one after it, with ahead 1, as
+// only those two are always lexed.  The end of file token is repeated.
+static inline LexerToken* Phase4PeekAt(Phase4Context* ctx, size_t ahead) {
+    size_t index = ctx->tokenPosition + ahead;
+    return &ctx->tokens[index < ctx->tokenCount ? index : ctx->tokenCount - 1];
 }
 
 static bool Phase4AtEnd(Phase4Context* ctx) {
-    return ctx->peek.type == TOKEN_EOF_L;
+    return Phase4PeekAt(ctx, 0)->type == TOKEN_EOF_L;
 }
 
 static LexerToken* Phase4Advance(LexerToken* tok, void* ctx) {
     Phase4Context* t = ctx;
-    *tok = t->peek;
-    t->peek = t->peekNext;
-    Phase3Get(&t->peekNext, &t->phase3);
+    *tok = t->tokens[t->tokenPosition];
+    if(tok->type == TOKEN_EOF_L) {
+        return tok;
+    }
 
+    t->tokenPosition++;
+    if(t->tokenPosition + 1 >= t->tokenCount && t->tokens[t->tokenPosition].type != TOKEN_EOF_L) {
+        Phase4Fill(t);
+    }
     return tok;
 }
 
 static LexerToken* Phase4Peek(LexerToken* tok, void* ctx) {
-    Phase4Context* t = ctx;
-    *tok = t->peek;
+    *tok = *Phase4PeekAt(ctx, 0);
     return tok;
 }
 
 static LexerToken* Phase4PeekNext(LexerToken* tok, void* ctx) {
-    Phase4Context* t = ctx;
-    *tok = t->peekNext;
+    *tok = *Phase4PeekAt(ctx, 1);
     return tok;
 }
 
 static void Phase4SkipLine(LexerToken* tok, Phase4Context* ctx) {
-    while(!Phase4AtEnd(ctx) && !ctx->peek.isStartOfLine) {
+    while(!Phase4AtEnd(ctx) && !Phase4PeekAt(ctx, 0)->isStartOfLine) {
         Phase4Advance(tok, ctx);
     }
 }
 
-static void Phase4Get(LexerToken* tok, Phase4Context* ctx);
+// get the include guard record for the file being preprocessed
+static IncludeGuard* Phase4FileGuard(Phase4Context* ctx) {
+    const char* fileName = (const char*)ctx->file->fileName;
+    size_t len = strlen(fileName);
+
+    IncludeGuard* guard = tableGet(&ctx->settings->includeGuards, fileName, len);
+    if(guard == NULL) {
+        guard = ArenaAlloc(sizeof(*guard));
+        guard->macro = NULL;
+        guard->once = false;
+        TABLE_SET(ctx->settings->includeGuards, fileName, len, guard);
+    }
+
+    return guard;
+}
+
+static void Phase4GetFile(LexerToken* tok, Phase4Context* ctx);
+
+// finish reading an included file, returning to the file that included it
+static void Phase4PopInclude(Phase4Context* ctx) {
+    Phase4Context* root = ctx->root;
+    Phase4Context* parent = ctx->parent;
+
+    // the tokens of the included file are the previous tokens of the parent
+    parent->previous = ctx->previous;
+
+    root->current = parent;
+    ctx->parent = root->freeContexts;
+    root->freeContexts = ctx;
+}
+
+// returns false if the file could not be included, or did not need to be
 static bool includeFile(LexerToken* tok, Phase4Context* ctx, bool isUser, bool isNext) {
     Phase4Advance(tok, ctx);
 
@@ -1099,9 +2523,9 @@ static bool includeFile(LexerToken* tok, Phase4Context* ctx, bool isUser, bool i
 
     const char* fileName;
     if(isUser) {
-        fileName = IncludeSearchPathFindUser(state, &ctx->settings->search, tok->data.string.buffer);
+        fileName = IncludeSearchPathFindUser(state, &ctx->settings->search, TokenString(ctx->settings, tok)->buffer);
     } else {
-        fileName = IncludeSearchPathFindSys(state, &ctx->settings->search, tok->data.string.buffer);
+        fileName = IncludeSearchPathFindSys(state, &ctx->settings->search, TokenString(ctx->settings, tok)->buffer);
     }
 
     if(fileName == NULL) {
@@ -1110,6 +2534,21 @@ static bool includeFile(LexerToken* tok, Phase4Context* ctx, bool isUser, bool i
         return false;
     }
 
+    // added even if the file is not opened again, as it could have been
+    // read by the precompiled header
+    if(ctx->settings->scanDeps) {
+        addDependency(ctx->settings, fileName);
+    }
+
+    // files with #pragma once or an include guard that is still defined
+    // would not produce any tokens, so do not need opening
+    IncludeGuard* guard = tableGet(&ctx->settings->includeGuards, fileName, strlen(fileName));
+    if(guard != NULL && (guard->once ||
+        (guard->macro != NULL && guard->macro->type != NODE_VOID))) {
+        ctx->settings->guardSkips++;
+        return false;
+    }
+
     // See n1570.5.2.4.1
     if(ctx->depth > 15) {
         fprintf(stderr, "Error: include depth limit reached\n");
@@ -1117,36 +2556,38 @@ static bool includeFile(LexerToken* tok, Phase4Context* ctx, bool isUser, bool i
         return false;
     }
 
-    Phase4Context* ctx2 = ArenaAlloc(sizeof(*ctx2));
+    Phase4Context* root = ctx->root;
+    Phase4Context* ctx2 = root->freeContexts;
+    if(ctx2 != NULL) {
+        root->freeContexts = ctx2->parent;
+    } else {
+        ctx2 = ArenaAlloc(sizeof(*ctx2));
+    }
     memset(ctx2, 0, sizeof(*ctx2));
 
-    ctx->mode = LEX_MODE_INCLUDE;
-    ctx->includeContext = ctx2;
-
     ctx2->previous = ctx->previous;
 
     const unsigned char* oldFileName = ctx->settings->fileName;
     ctx->settings->fileName = (const unsigned char*)fileName;
     Phase4Initialise(ctx2, ctx->settings, ctx);
     ctx->settings->fileName = oldFileName;
+    root->current = ctx2;
 
-    Phase4Get(tok, ctx2);
+    // a file with no tokens outside of directives ends straight away
+    Phase4GetFile(tok, ctx2);
+    if(tok->type == TOKEN_EOF_L) {
+        Phase4PopInclude(ctx2);
+    }
     return true;
 }
 
 static bool parseInclude(LexerToken* tok, Phase4Context* ctx, bool isNext) {
 
-    // allows header name parsing around this advance
-    // the setting has to be set two tokens in advance due to
-    // the peek/peekNext, so this sets it for the tokenising call
-    // happening to create the new token assigned to ctx->peekNext
-    ctx->phase3.mode = LEX_MODE_MAYBE_HEADER;
+    // the header name has already been lexed as one, see Phase3Get
     Phase4Advance(tok, ctx); // consume "#"
-    ctx->phase3.mode = LEX_MODE_NO_HEADER;
-
     Phase4Advance(tok, ctx); // consume include (or include_next)
 
-    LexerToken* peek = &ctx->peek;
+    LexerToken* peek = Phase4PeekAt(ctx, 0);
     bool retVal = false;
     if(peek->type == TOKEN_HEADER_NAME) {
         retVal = includeFile(tok, ctx, true, isNext);
@@ -1157,7 +2598,7 @@ static bool parseInclude(LexerToken* tok, Phase4Context* ctx, bool isNext) {
         Phase4SkipLine(tok, ctx);
     }
 
-    if(!ctx->peek.isStartOfLine) {
+    if(!Phase4PeekAt(ctx, 0)->isStartOfLine) {
         fprintf(stderr, "Error: Unexpected token after include location\n");
         Phase4SkipLine(tok, ctx);
     }
@@ -1166,9 +2607,97 @@ static bool parseInclude(LexerToken* tok, Phase4Context* ctx, bool isNext) {
 }
 
 static inline bool tokenIsVaArgs(LexerToken* tok) {
-    return tok->type == TOKEN_IDENTIFIER_L &&
-        tok->data.node->name.data.string.count == 11 &&
-        tok->data.node->hash == stringHash("__VA_ARGS__", 11);
+    return tok->type == TOKEN_IDENTIFIER_L && tok->data == IDENT_VA_ARGS;
+}
+
+// Maps the node ids of a function macro's parameter names to their index,
+// so each identifier in the replacement list is found with one probe rather
+// than being compared with every parameter.  Ids are given out in order, so
+// their low bits are used as the hash.
+#define MACRO_PARAM_MAP_INLINE 64
+typedef struct MacroParamMap {
+    // IDENT_NONE for empty slots
+    uint32_t* ids;
+    uint32_t* indices;
+    size_t mask;
+
+    uint32_t inlineIds[MACRO_PARAM_MAP_INLINE];
+    uint32_t inlineIndices[MACRO_PARAM_MAP_INLINE];
+} MacroParamMap;
+
+static void macroParamMapInit(MacroParamMap* map, HashNode* node) {
+    size_t count = node->type == NODE_MACRO_FUNCTION ? node->as.function.argumentCount : 0;
+
+    // keep the map at most half full
+    size_t capacity = 8;
+    while(capacity < count * 2) capacity *= 2;
+
+    if(capacity <= MACRO_PARAM_MAP_INLINE) {
+        map->ids = map->inlineIds;
+        map->indices = map->inlineIndices;
+    } else {
+        map->ids = ArenaAlloc(sizeof(uint32_t) * capacity);
+        map->indices = ArenaAlloc(sizeof(uint32_t) * capacity);
+    }
+    map->mask = capacity - 1;
+    for(size_t i = 0; i < capacity; i++) {
+        map->ids[i] = IDENT_NONE;
+    }
+
+    // the first of any repeated parameter names is used
+    for(size_t i = 0; i < count; i++) {
+        uint32_t id = node->as.function.arguments[i].data;
+        size_t slot = id & map->mask;
+        while(map->ids[slot] != IDENT_NONE && map->ids[slot] != id) {
+            slot = (slot + 1) & map->mask;
+        }
+        if(map->ids[slot] == IDENT_NONE) {
+            map->ids[slot] = id;
+            map->indices[slot] = i;
+        }
+    }
+}
+
+// get the index of the parameter with the node id, or -1 if there is none
+static int macroParamMapGet(MacroParamMap* map, uint32_t id) {
+    size_t slot = id & map->mask;
+    while(map->ids[slot] != IDENT_NONE) {
+        if(map->ids[slot] == id) {
+            return map->indices[slot];
+        }
+        slot = (slot + 1) & map->mask;
+    }
+    return -1;
+}
+
+// add the token at index i of a macro's replacement list
+static void macroAddReplacement(HashNode* node, MacroParamMap* params, LexerToken* tok, size_t i) {
+    if(i == 0) {
+        tok->indent = 0;
+    } else {
+        tok->indent = tok->indent > 0 ? 1 : 0;
+    }
+
+    // replace identifiers that correspond to an argument with a token
+    // representing the index of that argument
+    if(tok->type == TOKEN_IDENTIFIER_L && node->type == NODE_MACRO_FUNCTION) {
+        // names are interned, so the same name has the same node id
+        int index = macroParamMapGet(params, tok->data);
+        if(index >= 0) {
+            tok->type = TOKEN_MACRO_ARG;
+            tok->data = index;
+        }
+    }
+
+    if(tokenIsVaArgs(tok) && (node->type == NODE_MACRO_OBJECT || (node->type == NODE_MACRO_FUNCTION && node->as.function.variadacArgument == -1))) {
+        fprintf(stderr, "Error: __VA_ARGS__ is invalid unless in a variadac function macro\n");
+    }
+
+    if(node->type == NODE_MACRO_FUNCTION) {
+        ARRAY_PUSH(node->as.function, replacement, *tok);
+    } else {
+        ARRAY_PUSH(node->as.object, item, *tok);
+    }
 }
 
 static void parseDefine(Phase4Context* ctx) {
@@ -1183,7 +2712,7 @@ static void parseDefine(Phase4Context* ctx) {
         return;
     }
 
-    HashNode* node = name.data.node;
+    HashNode* node = TokenNode(ctx->settings, &name);
     if(node->type != NODE_VOID) {
         // error produces too many errors - enable when #if etc implemented
         // fprintf(stderr, "Error: redefinition of existing macro\n");
@@ -1191,7 +2720,16 @@ static void parseDefine(Phase4Context* ctx) {
         return;
     }
 
-    LexerToken* tok = &ctx->peek;
+    if(node->usedByExpansion) {
+        ctx->settings->macroGeneration++;
+    }
+
+    LexerToken* tok = Phase4PeekAt(ctx, 0);
+    LexerToken lastToken = name;
+    node->lazyReplacement = (SourceLocation) {
+        .offset = 0,
+        .length = 0,
+    };
 
     if(tok->type == TOKEN_PUNC_LEFT_PAREN && !tok->whitespaceBefore) {
         node->type = NODE_MACRO_FUNCTION;
@@ -1202,7 +2740,7 @@ static void parseDefine(Phase4Context* ctx) {
         LexerToken currentToken;
         Phase4Advance(&currentToken, ctx); // consume '('
 
-        while(!tok->isStartOfLine) {
+        while(!Phase4PeekAt(ctx, 0)->isStartOfLine) {
             Phase4Advance(&currentToken, ctx);
             if(currentToken.type == TOKEN_PUNC_ELIPSIS) {
                 node->as.function.variadacArgument = node->as.function.argumentCount;
@@ -1224,7 +2762,7 @@ static void parseDefine(Phase4Context* ctx) {
             Phase4SkipLine(&currentToken, ctx);
             return;
         }
-
+        lastToken = currentToken;
     } else {
         node->type = NODE_MACRO_OBJECT;
         ARRAY_ALLOC(LexerToken, node->as.object, item);
@@ -1234,45 +2772,97 @@ static void parseDefine(Phase4Context* ctx) {
         }
     }
 
-    size_t i = 0;
-    while(!tok->isStartOfLine) {
-        LexerToken* addr;
-        if(node->type == NODE_MACRO_FUNCTION) {
-            addr = ARRAY_PUSH_PTR(node->as.function, replacement);
-        } else {
-            addr = ARRAY_PUSH_PTR(node->as.object, item);
+    ctx->settings->macrosDefined++;
+
+    // Most macros in system headers are never used, so where possible the
+    // replacement list is only lexed the first time the macro is expanded.
+    // This is not possible if the tokens are being recorded into, or
+    // replayed from, a token cache.
+    // The first two tokens have already been lexed, so a list is only
+    // skipped if it has more than that, then lexing continues from the end
+    // of the line without lexing anything a second time.  Lists that would
+    // give errors when lexed again are lexed now.
+    tok = Phase4PeekAt(ctx, 0);
+    LexerToken* next = Phase4PeekAt(ctx, 1);
+    if(!tok->isStartOfLine && !next->isStartOfLine && next->type != TOKEN_EOF_L &&
+        tok->type != TOKEN_ERROR_L && next->type != TOKEN_ERROR_L &&
+        ctx->cache == NULL && !ctx->settings->trigraphs) {
+        const unsigned char* buf = ctx->phase3.phase2.phase1.source;
+        size_t len = ctx->phase3.phase2.phase1.sourceLength;
+        size_t start = tok->loc.offset - ctx->file->start;
+        size_t nextLine = start;
+        size_t lineEnd;
+        bool isVariadac = node->type == NODE_MACRO_FUNCTION && node->as.function.variadacArgument != -1;
+
+        // invalid uses of __VA_ARGS__, unterminated literals and universal
+        // character names, which could be malformed, are reported by the
+        // definition, and invalid bytes would be reported again if the lexer
+        // had read ahead to them before skipping
+        bool unterminated = false;
+        if(rawSkipLine(buf, len, &nextLine, &lineEnd, &unterminated) && !unterminated &&
+            !rawHasInvalidBytes(ctx->file, start, lineEnd + 3 < len ? lineEnd + 3 : len) &&
+            !rawContainsUcn(buf, start, lineEnd) &&
+            (isVariadac || !rawContains(buf, start, lineEnd, "__VA_ARGS__"))) {
+            // starting before the first token, so its whitespace is lexed
+            size_t previousEnd = lastToken.loc.offset + lastToken.loc.length;
+            node->lazyReplacement = (SourceLocation) {
+                .offset = previousEnd,
+                .length = ctx->file->start + lineEnd - previousEnd,
+            };
+            Phase4Restart(ctx, lineEnd, false);
+            return;
         }
-        addr->type = TOKEN_ERROR_L;
-        Phase4Advance(addr, ctx);
-        if(addr->type == TOKEN_EOF_L) {
+    }
+
+    MacroParamMap params;
+    macroParamMapInit(&params, node);
+
+    size_t i = 0;
+    while(!Phase4PeekAt(ctx, 0)->isStartOfLine) {
+        LexerToken replacement;
+        Phase4Advance(&replacement, ctx);
+        if(replacement.type == TOKEN_EOF_L) {
             break;
         }
+        macroAddReplacement(node, &params, &replacement, i);
+        i++;
+    }
+}
 
-        if(i == 0) {
-            addr->indent = 0;
-        } else {
-            addr->indent = addr->indent ? 1 : 0;
-        }
+void MacroLexReplacement(TranslationContext* ctx, HashNode* node) {
+    if(node->lazyReplacement.length == 0) {
+        return;
+    }
 
+    SourceLocation loc = node->lazyReplacement;
+    node->lazyReplacement.length = 0;
+    ctx->macrosLexed++;
+
+    // lexed from a copy ending in a new line, so that nothing after the
+    // list is read, as that has already been lexed by phase 4
+    SourceFile* file = SourceLocationFile(ctx, loc);
+    unsigned char* text = ArenaAlloc(loc.length + 2);
+    memcpy(text, file->source + (loc.offset - file->start), loc.length);
+    text[loc.length] = '\n';
+    text[loc.length + 1] = '\0';
+
+    SourceFile part = {
+        .fileName = file->fileName,
+        .source = text,
+        .sourceLength = loc.length + 1,
+        .start = loc.offset,
+    };
 
-        // replace identifiers that correspond to an argument with a token
-        // representing the index of that argument
-        if(addr->type == TOKEN_IDENTIFIER_L && node->type == NODE_MACRO_FUNCTION) {
-            for(unsigned int i = 0; i < node->as.function.argumentCount; i++) {
-                HashNode* current = addr->data.node;
-                HashNode* check = node->as.function.arguments[i].data.node;
-                if(current->name.data.string.count == check->name.data.string.count && current->hash == check->hash) {
-                    addr->type = TOKEN_MACRO_ARG;
-                    addr->data.integer = i;
-                    break;
-                }
-            }
-        }
+    Phase3Context phase3;
+    Phase3InitialiseAt(&phase3, ctx, &part, 0, false);
 
-        if(tokenIsVaArgs(addr) && (node->type == NODE_MACRO_OBJECT || (node->type == NODE_MACRO_FUNCTION && node->as.function.variadacArgument == -1))) {
-            fprintf(stderr, "Error: __VA_ARGS__ is invalid unless in a variadac function macro\n");
-        }
+    MacroParamMap params;
+    macroParamMapInit(&params, node);
 
+    LexerToken tok;
+    size_t i = 0;
+    while(Phase3Get(&tok, &phase3), tok.type != TOKEN_EOF_L && !tok.isStartOfLine) {
+        macroAddReplacement(node, &params, &tok, i);
         i++;
     }
 }
@@ -1289,7 +2879,11 @@ static void parseUndef(Phase4Context* ctx) {
         return;
     }
 
-    name.data.node->type = NODE_VOID;
+    HashNode* node = TokenNode(ctx->settings, &name);
+    if(node->usedByExpansion && node->type != NODE_VOID) {
+        ctx->settings->macroGeneration++;
+    }
+    node->type = NODE_VOID;
 }
 
 // parses the #error directive
@@ -1325,11 +2919,35 @@ static void parseError(Phase4Context* ctx) {
     fprintf(stderr, "\n");
 }
 
-static inline bool hashCompare(size_t len, uint32_t hash, const char* str) {
-    size_t strLen = strlen(str);
-    return len == strLen && hash == stringHash(str, strLen);
+// get the IdentId of a token, so a directive can be picked with a switch.
+// Anything that is not a predeclared name gives an id that is not in IdentId.
+static inline IdentId tokenIdentId(LexerToken* tok) {
+    if(tok->type != TOKEN_IDENTIFIER_L) return IDENT_NONE;
+    return tok->data;
 }
 
+// parses #pragma once.  Other pragmas are passed on unchanged, so for them
+// this returns false, having only consumed the "#".
+static bool parsePragma(Phase4Context* ctx) {
+    LexerToken tok;
+    Phase4Advance(&tok, ctx); // consume "#"
+
+    LexerToken* name = Phase4PeekAt(ctx, 1);
+    if(name->isStartOfLine || tokenIdentId(name) != IDENT_ONCE) {
+        return false;
+    }
+
+    Phase4Advance(&tok, ctx); // consume "pragma"
+    Phase4Advance(&tok, ctx); // consume "once"
+
+    if(!Phase4PeekAt(ctx, 0)->isStartOfLine) {
+        fprintf(stderr, "Error: Unexpected token after #pragma once\n");
+        Phase4SkipLine(&tok, ctx);
+    }
+
+    Phase4FileGuard(ctx)->once = true;
+    return true;
+}
 
 static void skipIfContentsLoopEnd(LexerToken* tok, Phase4Context* ctx) {
     Phase4Advance(tok, ctx); // skip first token
@@ -1337,14 +2955,10 @@ static void skipIfContentsLoopEnd(LexerToken* tok, Phase4Context* ctx) {
 
     Phase4Peek(tok, ctx);
 }
-// skips the contents of a false if directive
-// ie skips:
-// #if 0
-// skipped
-// #if 1
-// #endif // also skipped
-// #endif
-static void skipIfContents(Phase4Context* ctx) {
+
+// skips the contents of a false if directive by lexing every token, needed
+// when the tokens are being recorded into, or replayed from, a token cache
+static void skipIfContentsLexed(Phase4Context* ctx) {
     LexerToken tok;
     Phase4Peek(&tok, ctx);
 
@@ -1355,27 +2969,144 @@ static void skipIfContents(Phase4Context* ctx) {
             LexerToken name;
             Phase4PeekNext(&name, ctx);
 
-            if(name.type != TOKEN_IDENTIFIER_L) continue;
+            switch(tokenIdentId(&name)) {
+                case IDENT_IFDEF:
+                case IDENT_IFNDEF:
+                    ifDepth++;
+                    break;
+                case IDENT_ELSE:
+                    if(ifDepth == 0) return;
+                    break;
+                case IDENT_ENDIF:
+                    if(ifDepth == 0) return;
+                    ifDepth--;
+                    break;
+                default: break;
+            }
+        }
+    }
+}
+
+// Skip the lines of a false conditional block, starting at index i, which
+// is the start of a line's first token if atStart is set, otherwise part way
+// through a line.  Returns the index of the "#" of the #else or #endif that
+// ends the block, or where lexing should continue from if the end of the
+// file is reached first, with the same nesting rules as skipIfContentsLexed.
+static size_t rawSkipIfContents(const unsigned char* buf, size_t len, size_t i, bool atStart) {
+    size_t ifDepth = 0;
 
-            size_t len = name.data.node->name.data.string.count;
-            uint32_t hash = name.data.node->hash;
+    while(i < len) {
+        if(!atStart) {
+            size_t lineEnd;
+            bool unterminated;
+            if(!rawSkipLine(buf, len, &i, &lineEnd, &unterminated)) return i;
+            atStart = true;
+            continue;
+        }
 
-            if(hashCompare(len, hash, "ifdef") || hashCompare(len, hash, "ifndef")) {
-                ifDepth++;
-                continue;
-            }
+        // skip whitespace and comments before the first token of the line
+        unsigned char c = buf[i];
+        if(c == ' ' || c == '\t' || c == '\v' || c == '\f' || rawIsLineEnd(c)) {
+            i++;
+            continue;
+        }
+        if(c == '\\' && rawSkipSplices(buf, i) != i) {
+            i = rawSkipSplices(buf, i);
+            continue;
+        }
+        if(rawIsComment(buf, i)) {
+            size_t start = i;
+            if(!rawSkipComment(buf, len, &i, &atStart)) return start;
+            continue;
+        }
 
-            if(hashCompare(len, hash, "else") && ifDepth == 0) {
-                return;
+        atStart = false;
+        size_t hash = i;
+        if(c == '#') {
+            i = rawSkipSplices(buf, i + 1);
+        } else if(c == '%' && buf[rawSkipSplices(buf, i + 1)] == ':') {
+            i = rawSkipSplices(buf, rawSkipSplices(buf, i + 1) + 1);
+        } else {
+            continue;
+        }
+
+        // skip whitespace and comments between the "#" and the name, a new
+        // line in a comment means that the line is not a directive
+        while(i < len) {
+            c = buf[i];
+            if(c == ' ' || c == '\t' || c == '\v' || c == '\f') {
+                i = rawSkipSplices(buf, i + 1);
+            } else if(rawIsComment(buf, i)) {
+                size_t start = i;
+                if(!rawSkipComment(buf, len, &i, &atStart)) return start;
+                if(atStart) break;
+            } else {
+                break;
             }
+        }
+        if(atStart) continue;
+
+        // only the predeclared directive names are needed, so longer names
+        // are not stored, and never match
+        char name[16];
+        size_t length = 0;
+        while(isNonDigit(buf[i]) || isDigit(buf[i])) {
+            if(length < sizeof(name)) name[length] = buf[i];
+            length++;
+            i = rawSkipSplices(buf, i + 1);
+        }
 
-            if(hashCompare(len, hash, "endif")) {
-                if(ifDepth == 0) return;
-                ifDepth--;
-                continue;
+        // the name continues with a universal character name or a non-ascii
+        // character, so is not one of the names being checked for
+        if(buf[i] == '\\' || buf[i] >= 0x80 || length > sizeof(name)) {
+            continue;
+        }
+
+        if(rawIsName(name, length, "ifdef") || rawIsName(name, length, "ifndef")) {
+            ifDepth++;
+        } else if(rawIsName(name, length, "else")) {
+            if(ifDepth == 0) return hash;
+        } else if(rawIsName(name, length, "endif")) {
+            if(ifDepth == 0) return hash;
+            ifDepth--;
+        } else if(rawIsName(name, length, "include") || rawIsName(name, length, "include_next")) {
+            // a header name can contain "//" or "/*" that do not start a
+            // comment, so skip it without looking for them
+            while(buf[i] == ' ' || buf[i] == '\t') i++;
+            if(buf[i] == '<') {
+                while(i < len && buf[i] != '>' && !rawIsLineEnd(buf[i])) i++;
             }
         }
     }
+
+    return len;
+}
+
+// skips the contents of a false if directive
+// ie skips:
+// #if 0
+// skipped
+// #if 1
+// #endif // also skipped
+// #endif
+static void skipIfContents(Phase4Context* ctx) {
+    // skipping without lexing does not handle trigraphs
+    if(ctx->cache != NULL || ctx->settings->trigraphs) {
+        skipIfContentsLexed(ctx);
+        return;
+    }
+
+    if(Phase4AtEnd(ctx)) return;
+
+    // peek is the first token not yet used, so the lexer had not read past
+    // anything that needs processing before it
+    Phase1Context* phase1 = &ctx->phase3.phase2.phase1;
+    LexerToken* peek = Phase4PeekAt(ctx, 0);
+    size_t start = peek->loc.offset - phase1->file->start;
+    size_t end = rawSkipIfContents(phase1->source, phase1->sourceLength,
+        start, peek->isStartOfLine);
+
+    Phase4Restart(ctx, end, true);
 }
 
 // parses #if, #ifdef, #ifndef, #elif, #else
@@ -1384,19 +3115,18 @@ static void parseIf(Phase4Context* ctx) {
     Phase4Advance(&tok, ctx); // consume "#"
     Phase4Advance(&tok, ctx); // consume directive name
 
-    size_t len = tok.data.node->name.data.string.count;
-    uint32_t hash = tok.data.node->hash;
+    IdentId directive = tokenIdentId(&tok);
     if(ctx->ifDirectiveDepth == 0) {
-        if(hashCompare(len, hash, "else") || hashCompare(len, hash, "elif") || hashCompare(len, hash, "endif")) {
+        if(directive == IDENT_ELSE || directive == IDENT_ELIF || directive == IDENT_ENDIF) {
             fprintf(stderr, "Error: Lone #%s directive\n",
-                tok.data.node->name.data.string.buffer);
+                TokenNode(ctx->settings, &tok)->name.buffer);
             Phase4SkipLine(&tok, ctx);
             return;
         }
     }
 
-    bool isIfdef = hashCompare(len, hash, "ifdef");
-    if(isIfdef || hashCompare(len, hash, "ifndef")) {
+    bool isIfdef = directive == IDENT_IFDEF;
+    if(isIfdef || directive == IDENT_IFNDEF) {
         ctx->ifDirectiveDepth++;
 
         LexerToken name;
@@ -1419,54 +3149,60 @@ static void parseIf(Phase4Context* ctx) {
             return;
         }
 
+        if(!isIfdef && ctx->guardState == GUARD_START && ctx->ifDirectiveDepth == 1) {
+            ctx->guardState = GUARD_IN_IFNDEF;
+            ctx->guardMacro = TokenNode(ctx->settings, &name);
+        }
+
         // if isIfdef is false, then parsing #ifndef
-        bool isMacro = name.data.node->type != NODE_VOID;
+        bool isMacro = TokenNode(ctx->settings, &name)->type != NODE_VOID;
         bool conditionTrue = (isIfdef && isMacro) || (!isIfdef && !isMacro);
 
         if(!conditionTrue) {
             skipIfContents(ctx);
 
+            // the missing #endif is reported at the end of the file
+            if(Phase4AtEnd(ctx)) return;
+
             Phase4Advance(&tok, ctx); // consume "#"
             Phase4Advance(&tok, ctx); // consume directive name
 
-            len = tok.data.node->name.data.string.count;
-            hash = tok.data.node->hash;
+            directive = tokenIdentId(&tok);
         } else {
             ctx->ifDirectiveAcceptedDepth++;
             return;
         }
     }
 
-    while(true) {
-        if(hashCompare(len, hash, "endif")) {
-            Phase4Peek(&tok, ctx);
-            if(!tok.isStartOfLine) {
-                fprintf(stderr, "Error: Unexpected token after #endif\n");
-                Phase4SkipLine(&tok, ctx);
-            }
-            if(ctx->ifDirectiveAcceptedDepth == ctx->ifDirectiveDepth) {
-                ctx->ifDirectiveAcceptedDepth--;
-            }
-            ctx->ifDirectiveDepth--;
-            return;
-        } else if(ctx->ifDirectiveDepth == ctx->ifDirectiveAcceptedDepth) {
+    // an include guard's #ifndef cannot have any other branches
+    if((directive == IDENT_ELSE || directive == IDENT_ELIF) &&
+        ctx->ifDirectiveDepth == 1 && ctx->guardState == GUARD_IN_IFNDEF) {
+        ctx->guardState = GUARD_NONE;
+    }
+
+    if(directive == IDENT_ENDIF) {
+        Phase4Peek(&tok, ctx);
+        if(!tok.isStartOfLine) {
+            fprintf(stderr, "Error: Unexpected token after #endif\n");
+            Phase4SkipLine(&tok, ctx);
+        }
+        if(ctx->ifDirectiveAcceptedDepth == ctx->ifDirectiveDepth) {
+            ctx->ifDirectiveAcceptedDepth--;
+        }
+        ctx->ifDirectiveDepth--;
+        if(ctx->ifDirectiveDepth == 0 && ctx->guardState == GUARD_IN_IFNDEF) {
+            ctx->guardState = GUARD_AFTER_ENDIF;
+        }
+        return;
+    } else if(ctx->ifDirectiveDepth == ctx->ifDirectiveAcceptedDepth) {
+        skipIfContents(ctx);
+    } else if(directive == IDENT_ELSE) {
+        if(ctx->ifDirectiveAcceptedDepth == ctx->ifDirectiveDepth) {
             skipIfContents(ctx);
-        } else if(hashCompare(len, hash, "else")) {
-            if(ctx->ifDirectiveAcceptedDepth == ctx->ifDirectiveDepth) {
-                skipIfContents(ctx);
-            } else {
-                ctx->ifDirectiveAcceptedDepth++;
-                return;
-            }
+        } else {
+            ctx->ifDirectiveAcceptedDepth++;
+            return;
         }
-
-        if(!Phase4AtEnd(ctx)) break;
-
-        Phase4Advance(&tok, ctx); // consume "#"
-        Phase4Advance(&tok, ctx); // consume directive name
-
-        len = tok.data.node->name.data.string.count;
-        hash = tok.data.node->hash;
     }
 }
 
@@ -1505,6 +3241,9 @@ typedef struct JointTokenStream {
     Phase4GetterFn secondPeek;
     void* second;
     HashNode* macroContext;
+
+    // set if the second stream was used
+    bool readSecond;
 } JointTokenStream;
 
 static LexerToken* JointTokenAdvance(LexerToken* tok, void* ctx) {
@@ -1512,6 +3251,7 @@ static LexerToken* JointTokenAdvance(LexerToken* tok, void* ctx) {
     TokenListAdvance(tok, stream->list);
     if(tok->type == TOKEN_EOF_L) {
         stream->macroContext->macroExpansionEnabled = true;
+        stream->readSecond = true;
         stream->secondAdvance(tok, stream->second);
     }
     return tok;
@@ -1521,6 +3261,7 @@ static LexerToken* JointTokenPeek(LexerToken* tok, void* ctx) {
     JointTokenStream* stream = ctx;
     TokenListPeek(tok, stream->list);
     if(tok->type == TOKEN_EOF_L) {
+        stream->readSecond = true;
         stream->secondPeek(tok, stream->second);
     }
     return tok;
@@ -1584,7 +3325,7 @@ static void ExpandTokenList(
         if(previous.type != TOKEN_EOF_L) {
             t->renderStartOfLine |= previous.renderStartOfLine;
             t->whitespaceBefore |= previous.whitespaceBefore;
-            t->indent += previous.indent;
+            TokenSetIndent(t, t->indent + previous.indent);
         }
 
         previous = *t;
@@ -1593,7 +3334,7 @@ static void ExpandTokenList(
         MacroContext macro = {0};
         EnterContextResult res = ExpandSingleMacro(t, ctx, &macro, advance, peek, getCtx);
         if(res == CONTEXT_DISABLED_MACRO && disableNonExpandedIdentifiers) {
-            t->data.attemptExpansion = false;
+            t->attemptExpansion = false;
         }
 
         if(res == CONTEXT_MACRO_NULL) {
@@ -1619,39 +3360,171 @@ static void ExpandTokenList(
     }
 }
 
+// spelling of each punctuator, used when joining tokens
+static const char* puncSpellings[] = {
+    [TOKEN_PUNC_LEFT_SQUARE] = "[",
+    [TOKEN_PUNC_RIGHT_SQUARE] = "]",
+    [TOKEN_PUNC_LEFT_PAREN] = "(",
+    [TOKEN_PUNC_RIGHT_PAREN] = ")",
+    [TOKEN_PUNC_LEFT_BRACE] = "{",
+    [TOKEN_PUNC_RIGHT_BRACE] = "}",
+    [TOKEN_PUNC_DOT] = ".",
+    [TOKEN_PUNC_ARROW] = "->",
+    [TOKEN_PUNC_PLUS_PLUS] = "++",
+    [TOKEN_PUNC_MINUS_MINUS] = "--",
+    [TOKEN_PUNC_AND] = "&",
+    [TOKEN_PUNC_STAR] = "*",
+    [TOKEN_PUNC_PLUS] = "+",
+    [TOKEN_PUNC_MINUS] = "-",
+    [TOKEN_PUNC_TILDE] = "~",
+    [TOKEN_PUNC_BANG] = "!",
+    [TOKEN_PUNC_SLASH] = "/",
+    [TOKEN_PUNC_PERCENT] = "%",
+    [TOKEN_PUNC_LESS_LESS] = "<<",
+    [TOKEN_PUNC_GREATER_GREATER] = ">>",
+    [TOKEN_PUNC_LESS] = "<",
+    [TOKEN_PUNC_GREATER] = ">",
+    [TOKEN_PUNC_LESS_EQUAL] = "<=",
+    [TOKEN_PUNC_GREATER_EQUAL] = ">=",
+    [TOKEN_PUNC_EQUAL_EQUAL] = "==",
+    [TOKEN_PUNC_BANG_EQUAL] = "!=",
+    [TOKEN_PUNC_CARET] = "^",
+    [TOKEN_PUNC_OR] = "|",
+    [TOKEN_PUNC_AND_AND] = "&&",
+    [TOKEN_PUNC_OR_OR] = "||",
+    [TOKEN_PUNC_QUESTION] = "?",
+    [TOKEN_PUNC_COLON] = ":",
+    [TOKEN_PUNC_SEMICOLON] = ";",
+    [TOKEN_PUNC_ELIPSIS] = "...",
+    [TOKEN_PUNC_EQUAL] = "=",
+    [TOKEN_PUNC_STAR_EQUAL] = "*=",
+    [TOKEN_PUNC_SLASH_EQUAL] = "/=",
+    [TOKEN_PUNC_PERCENT_EQUAL] = "%=",
+    [TOKEN_PUNC_PLUS_EQUAL] = "+=",
+    [TOKEN_PUNC_MINUS_EQUAL] = "-=",
+    [TOKEN_PUNC_LESS_LESS_EQUAL] = "<<=",
+    [TOKEN_PUNC_GREATER_GREATER_EQUAL] = ">>=",
+    [TOKEN_PUNC_AND_EQUAL] = "&=",
+    [TOKEN_PUNC_CARET_EQUAL] = "^=",
+    [TOKEN_PUNC_PIPE_EQUAL] = "|=",
+    [TOKEN_PUNC_COMMA] = ",",
+    [TOKEN_PUNC_HASH] = "#",
+    [TOKEN_PUNC_HASH_HASH] = "##",
+    [TOKEN_PUNC_LESS_COLON] = "<:",
+    [TOKEN_PUNC_COLON_GREATER] = ":>",
+    [TOKEN_PUNC_LESS_PERCENT] = "<%",
+    [TOKEN_PUNC_PERCENT_GREATER] = "%>",
+    [TOKEN_PUNC_PERCENT_COLON] = "%:",
+    [TOKEN_PUNC_PERCENT_COLON_PERCENT_COLON] = "%:%:",
+};
+
+static bool isPunctuator(LexerTokenType type) {
+    return type >= TOKEN_PUNC_LEFT_SQUARE && type <= TOKEN_PUNC_PERCENT_COLON_PERCENT_COLON;
+}
+
+#define PUNC_JOIN_SIZE (TOKEN_PUNC_PERCENT_COLON_PERCENT_COLON + 1)
+
+// The punctuator made by joining two punctuators, or 0 (TOKEN_KW_AUTO) if
+// they do not make a single punctuator.
+static const uint8_t puncJoins[PUNC_JOIN_SIZE][PUNC_JOIN_SIZE] = {
+    [TOKEN_PUNC_MINUS][TOKEN_PUNC_GREATER] = TOKEN_PUNC_ARROW,
+    [TOKEN_PUNC_PLUS][TOKEN_PUNC_PLUS] = TOKEN_PUNC_PLUS_PLUS,
+    [TOKEN_PUNC_MINUS][TOKEN_PUNC_MINUS] = TOKEN_PUNC_MINUS_MINUS,
+    [TOKEN_PUNC_LESS][TOKEN_PUNC_LESS] = TOKEN_PUNC_LESS_LESS,
+    [TOKEN_PUNC_GREATER][TOKEN_PUNC_GREATER] = TOKEN_PUNC_GREATER_GREATER,
+    [TOKEN_PUNC_LESS][TOKEN_PUNC_EQUAL] = TOKEN_PUNC_LESS_EQUAL,
+    [TOKEN_PUNC_GREATER][TOKEN_PUNC_EQUAL] = TOKEN_PUNC_GREATER_EQUAL,
+    [TOKEN_PUNC_EQUAL][TOKEN_PUNC_EQUAL] = TOKEN_PUNC_EQUAL_EQUAL,
+    [TOKEN_PUNC_BANG][TOKEN_PUNC_EQUAL] = TOKEN_PUNC_BANG_EQUAL,
+    [TOKEN_PUNC_AND][TOKEN_PUNC_AND] = TOKEN_PUNC_AND_AND,
+    [TOKEN_PUNC_OR][TOKEN_PUNC_OR] = TOKEN_PUNC_OR_OR,
+    [TOKEN_PUNC_STAR][TOKEN_PUNC_EQUAL] = TOKEN_PUNC_STAR_EQUAL,
+    [TOKEN_PUNC_SLASH][TOKEN_PUNC_EQUAL] = TOKEN_PUNC_SLASH_EQUAL,
+    [TOKEN_PUNC_PERCENT][TOKEN_PUNC_EQUAL] = TOKEN_PUNC_PERCENT_EQUAL,
+    [TOKEN_PUNC_PLUS][TOKEN_PUNC_EQUAL] = TOKEN_PUNC_PLUS_EQUAL,
+    [TOKEN_PUNC_MINUS][TOKEN_PUNC_EQUAL] = TOKEN_PUNC_MINUS_EQUAL,
+    [TOKEN_PUNC_LESS_LESS][TOKEN_PUNC_EQUAL] = TOKEN_PUNC_LESS_LESS_EQUAL,
+    [TOKEN_PUNC_LESS][TOKEN_PUNC_LESS_EQUAL] = TOKEN_PUNC_LESS_LESS_EQUAL,
+    [TOKEN_PUNC_GREATER_GREATER][TOKEN_PUNC_EQUAL] = TOKEN_PUNC_GREATER_GREATER_EQUAL,
+    [TOKEN_PUNC_GREATER][TOKEN_PUNC_GREATER_EQUAL] = TOKEN_PUNC_GREATER_GREATER_EQUAL,
+    [TOKEN_PUNC_AND][TOKEN_PUNC_EQUAL] = TOKEN_PUNC_AND_EQUAL,
+    [TOKEN_PUNC_CARET][TOKEN_PUNC_EQUAL] = TOKEN_PUNC_CARET_EQUAL,
+    [TOKEN_PUNC_OR][TOKEN_PUNC_EQUAL] = TOKEN_PUNC_PIPE_EQUAL,
+    [TOKEN_PUNC_HASH][TOKEN_PUNC_HASH] = TOKEN_PUNC_HASH_HASH,
+    [TOKEN_PUNC_LESS][TOKEN_PUNC_COLON] = TOKEN_PUNC_LESS_COLON,
+    [TOKEN_PUNC_COLON][TOKEN_PUNC_GREATER] = TOKEN_PUNC_COLON_GREATER,
+    [TOKEN_PUNC_LESS][TOKEN_PUNC_PERCENT] = TOKEN_PUNC_LESS_PERCENT,
+    [TOKEN_PUNC_PERCENT][TOKEN_PUNC_GREATER] = TOKEN_PUNC_PERCENT_GREATER,
+    [TOKEN_PUNC_PERCENT][TOKEN_PUNC_COLON] = TOKEN_PUNC_PERCENT_COLON,
+    [TOKEN_PUNC_PERCENT_COLON][TOKEN_PUNC_PERCENT_COLON] = TOKEN_PUNC_PERCENT_COLON_PERCENT_COLON,
+};
+
+// is every character of the string one that can continue an identifier
+// or pp-number, without a universal character name
+static bool isPlainName(const char* str, size_t length) {
+    for(size_t i = 0; i < length; i++) {
+        unsigned char c = str[i];
+        if(!isNonDigit(c) && !isDigit(c)) {
+            return false;
+        }
+    }
+    return true;
+}
+
+// Get the text of a token to be re-lexed by JoinTokens.  This uses the
+// token's data where it can, as the location of a token made by ## does not
+// cover its text.  Returns NULL if the token has no text to use.
+static const unsigned char* joinSpelling(Phase4Context* ctx, LexerToken* tok, size_t* length) {
+    if(isPunctuator(tok->type)) {
+        *length = strlen(puncSpellings[tok->type]);
+        return (const unsigned char*)puncSpellings[tok->type];
+    }
+    if(tok->type == TOKEN_PP_NUMBER) {
+        LexerString* str = TokenString(ctx->settings, tok);
+        *length = str->count;
+        return (const unsigned char*)str->buffer;
+    }
+    if(tok->type == TOKEN_IDENTIFIER_L) {
+        LexerString* name = &TokenNode(ctx->settings, tok)->name;
+        if(isPlainName(name->buffer, name->count)) {
+            *length = name->count;
+            return (const unsigned char*)name->buffer;
+        }
+    }
+
+    if(!tok->loc.offset) {
+        return NULL;
+    }
+    *length = tok->loc.length;
+    return SourceLocationText(ctx->settings, tok->loc);
+}
+
 typedef struct Phase4JoinCtx {
     LexerToken left;
     LexerToken right;
+    const unsigned char* leftText;
+    const unsigned char* rightText;
+    size_t leftLength;
+    size_t rightLength;
     size_t consumed;
 } Phase4JoinCtx;
 
+// Read the characters of the two tokens being joined.  The characters are
+// not given a length, so phase 3 copies them instead of using the source.
 static unsigned char Phase4JoinGetter(void* voidCtx, SourceLocation* loc) {
     Phase4JoinCtx* ctx = voidCtx;
-    if(!ctx->left.loc || !ctx->right.loc) {
-        fprintf(stderr, "Joining undefined tokens\n");
-        exit(1);
-    }
-
-    loc->length = 1;
-
-    if(ctx->consumed < ctx->left.loc->length) {
-        unsigned char ret = ctx->left.loc->sourceText[ctx->consumed];
+    loc->length = 0;
 
-        loc->column = ctx->left.loc->column + ctx->consumed;
-        loc->line = ctx->left.loc->line;
-        loc->fileName = ctx->left.loc->fileName;
-        loc->sourceText = ctx->left.loc->sourceText + ctx->consumed;
+    if(ctx->consumed < ctx->leftLength) {
+        unsigned char ret = ctx->leftText[ctx->consumed];
+        loc->offset = ctx->left.loc.offset;
 
         ctx->consumed++;
         return ret;
-    } else if(ctx->consumed - ctx->left.loc->length < ctx->right.loc->length) {
-        size_t rightConsumed = ctx->consumed - ctx->left.loc->length;
-        unsigned char ret = ctx->right.loc->sourceText[rightConsumed];
-
-        loc->column = ctx->right.loc->column + rightConsumed;
-        loc->line = ctx->right.loc->line;
-        loc->fileName = ctx->right.loc->fileName;
-        loc->sourceText = ctx->right.loc->sourceText + rightConsumed;
+    } else if(ctx->consumed - ctx->leftLength < ctx->rightLength) {
+        size_t rightConsumed = ctx->consumed - ctx->leftLength;
+        unsigned char ret = ctx->rightText[rightConsumed];
+        loc->offset = ctx->right.loc.offset;
 
         ctx->consumed++;
         return ret;
@@ -1660,11 +3533,80 @@ static unsigned char Phase4JoinGetter(void* voidCtx, SourceLocation* loc) {
     return END_OF_FILE;
 }
 
+// Join two tokens without re-lexing them, for the common cases of making
+// names, numbers and punctuators.  Returns false if the result has to be
+// found by re-lexing the tokens.
+static bool JoinTokensFast(Phase4Context* ctx, LexerToken* result, LexerToken* left, LexerToken* right) {
+    // the token is made as if it was lexed by JoinTokens
+    *result = (LexerToken) {
+        .isStartOfLine = true,
+        .renderStartOfLine = true,
+        .whitespaceBefore = false,
+        .isMacroExpanded = true,
+        .attemptExpansion = true,
+        .indent = 0,
+        .loc = {
+            .offset = left->loc.offset,
+            .length = 0,
+        },
+        .data = 0,
+    };
+
+    if(isPunctuator(left->type) && isPunctuator(right->type)) {
+        uint8_t type = puncJoins[left->type][right->type];
+        if(type == 0) return false;
+        result->type = type;
+        return true;
+    }
+
+    bool leftName = left->type == TOKEN_IDENTIFIER_L;
+    bool rightName = right->type == TOKEN_IDENTIFIER_L;
+    if((!leftName && left->type != TOKEN_PP_NUMBER) ||
+        (!rightName && right->type != TOKEN_PP_NUMBER)) {
+        return false;
+    }
+
+    LexerString* leftStr = leftName ? &TokenNode(ctx->settings, left)->name : TokenString(ctx->settings, left);
+    LexerString* rightStr = rightName ? &TokenNode(ctx->settings, right)->name : TokenString(ctx->settings, right);
+
+    if(leftName) {
+        // a name followed by a number is only a name if the number could be
+        // part of one, e.g. not "1.5" or "1e+5"
+        if(!rightName && !isPlainName(rightStr->buffer, rightStr->count)) {
+            return false;
+        }
+    } else if(!isPlainName(rightStr->buffer, rightStr->count)) {
+        // a number followed by a name with a universal character name
+        return false;
+    }
+
+    size_t length = leftStr->count + rightStr->count;
+    char* text = memoryArrayPushN(&ctx->settings->stringArr, length + 1);
+    memcpy(text, leftStr->buffer, leftStr->count);
+    memcpy(text + leftStr->count, rightStr->buffer, rightStr->count);
+    text[length] = '\0';
+
+    if(leftName) {
+        result->type = TOKEN_IDENTIFIER_L;
+        TokenSetNode(result, IdentTableGet(ctx->settings->idents, ctx->settings, text, length, IdentHash(text, length)));
+    } else {
+        result->type = TOKEN_PP_NUMBER;
+        TokenSetString(ctx->settings, result, (LexerString) {
+            .buffer = text,
+            .capacity = length + 1,
+            .count = length,
+            .type = STRING_NONE,
+        });
+    }
+    return true;
+}
+
 // join two tokens into one token or return false
 static bool JoinTokens(Phase4Context* ctx, LexerToken* result, LexerToken left, LexerToken right) {
     // placeholder + placeholder => placeholder
     // placeholder + * => placeholder
     // * + placeholder => placeholder
+    // names, numbers and punctuators => JoinTokensFast
     // * + * => run phase 3, error if second token produced, etc
 
     result->isMacroExpanded = true;
@@ -1678,10 +3620,20 @@ static bool JoinTokens(Phase4Context* ctx, LexerToken* result, LexerToken left,
         return true;
     }
 
+    if(JoinTokensFast(ctx, result, &left, &right)) {
+        return true;
+    }
+
     Phase4JoinCtx joinCtx;
     joinCtx.left = left;
     joinCtx.right = right;
+    joinCtx.leftText = joinSpelling(ctx, &left, &joinCtx.leftLength);
+    joinCtx.rightText = joinSpelling(ctx, &right, &joinCtx.rightLength);
     joinCtx.consumed = 0;
+    if(joinCtx.leftText == NULL || joinCtx.rightText == NULL) {
+        fprintf(stderr, "Joining undefined tokens\n");
+        exit(1);
+    }
 
     // create new translation context
     // initialise for phase 3, with no phase 1/2 initialisation
@@ -1770,7 +3722,34 @@ static bool TokenConcatList(Phase4Context* ctx, TokenList* in, TokenList* out) {
     return true;
 }
 
-// expand an object macro
+// give the first token of an expansion the whitespace before the macro name
+static void expansionPadding(LexerToken* first, LexerToken* name) {
+    first->renderStartOfLine |= name->renderStartOfLine;
+    first->whitespaceBefore |= name->whitespaceBefore;
+    TokenSetIndent(first, first->indent + name->indent);
+}
+
+// set the expansion of a macro to be returned
+static EnterContextResult expansionResult(MacroContext* macro, LexerToken* tok, TokenList* result) {
+    if(result->itemCount <= 0) {
+        return CONTEXT_MACRO_NULL;
+    }
+
+    LexerToken name = *tok;
+    *tok = result->items[0];
+    expansionPadding(tok, &name);
+    macro->tokens = result->items + 1;
+    macro->tokenCount = result->itemCount - 1;
+
+    return CONTEXT_MACRO_TOKEN;
+}
+
+// Expand an object macro.  Outside of any other expansion, no macros are
+// disabled, so the expansion only depends on the definitions of the names
+// it uses, unless it reads the tokens after the macro, or uses __LINE__ or
+// __FILE__.  Otherwise it is cached, and used until one of those names is
+// defined or undefined.  The first token is given the macro name's
+// whitespace after expanding, so the cached tokens do not depend on it.
 static EnterContextResult CallObjectMacro(
     MacroContext* macro,
     LexerToken* tok,
@@ -1779,11 +3758,20 @@ static EnterContextResult CallObjectMacro(
     Phase4GetterFn peek,
     void* getCtx
 ) {
-    if(tok->data.node->as.object.itemCount <= 0) {
+    TranslationContext* settings = ctx->settings;
+    HashNode* node = TokenNode(settings, tok);
+    MacroLexReplacement(settings, node);
+    if(node->as.object.itemCount <= 0) {
         return CONTEXT_MACRO_NULL;
     }
 
-    TokenList tokens = tok->data.node->as.object;
+    bool cacheable = settings->expansionDepth == 0;
+    if(cacheable && node->expansion != NULL && node->expansion->generation == settings->macroGeneration) {
+        settings->expansionCacheHits++;
+        return expansionResult(macro, tok, &node->expansion->tokens);
+    }
+
+    TokenList tokens = node->as.object;
     bool hasTokenCat = false;
     for(unsigned int i = 0; i < tokens.itemCount; i++) {
         if(isHashTok(&tokens.items[i])) {
@@ -1804,25 +3792,43 @@ static EnterContextResult CallObjectMacro(
     // from the macro's hash node.
     JointTokenStream stream = {
         .list = &concatenated,
-        .macroContext = tok->data.node,
+        .macroContext = node,
         .second = getCtx,
         .secondAdvance = advance,
         .secondPeek = peek,
+        .readSecond = false,
     };
-    TokenList result;
-    tok->data.node->macroExpansionEnabled = false;
-    ExpandTokenList(ctx, &result, JointTokenAdvance, JointTokenPeek, JointTokenEarlyExit, &stream, true, tok);
-    tok->data.node->macroExpansionEnabled = true;
-
-    if(result.itemCount <= 0) {
-        return CONTEXT_MACRO_NULL;
+    LexerToken padding = *tok;
+    padding.indent = 0;
+    padding.renderStartOfLine = false;
+    padding.whitespaceBefore = false;
+
+    if(cacheable) {
+        settings->expansionCacheMisses++;
+        settings->fillingExpansion = true;
+        settings->expansionUncacheable = false;
+        node->usedByExpansion = true;
     }
 
-    *tok = result.items[0];
-    macro->tokens = result.items + 1;
-    macro->tokenCount = result.itemCount - 1;
+    TokenList result;
+    node->macroExpansionEnabled = false;
+    settings->expansionDepth++;
+    ExpandTokenList(ctx, &result, JointTokenAdvance, JointTokenPeek, JointTokenEarlyExit, &stream, true, &padding);
+    settings->expansionDepth--;
+    node->macroExpansionEnabled = true;
+
+    if(cacheable) {
+        settings->fillingExpansion = false;
+        if(!stream.readSecond && !settings->expansionUncacheable) {
+            if(node->expansion == NULL) {
+                node->expansion = ArenaAlloc(sizeof(CachedExpansion));
+            }
+            node->expansion->generation = settings->macroGeneration;
+            node->expansion->tokens = result;
+        }
+    }
 
-    return CONTEXT_MACRO_TOKEN;
+    return expansionResult(macro, tok, &result);
 }
 
 // Container for the argument tokens passed into a function macro.
@@ -1831,7 +3837,10 @@ static EnterContextResult CallObjectMacro(
 // emitting errors relating to macro expansion, if the argument never undergoes
 // macro expansion.
 typedef struct ArgumentItem {
-    TokenList tokens;
+    // the argument's tokens, in the call's token buffer
+    size_t start;
+    size_t count;
+
     TokenList expanded;
     LexerToken string;
     bool hasExpanded;
@@ -1840,18 +3849,33 @@ typedef struct ArgumentItem {
 
 typedef struct ArgumentItemList {
     ARRAY_DEFINE(ArgumentItem, item);
+
+    // the tokens of every argument, read into one buffer per call
+    TokenList tokens;
 } ArgumentItemList;
 
+// get the tokens of an argument, as a list that can be consumed without
+// changing the argument
+static TokenList argumentTokens(ArgumentItemList* args, ArgumentItem* arg) {
+    return (TokenList) {
+        .items = args->tokens.items + arg->start,
+        .itemCount = arg->count,
+        .itemCapacity = arg->count,
+        .itemElementSize = sizeof(LexerToken),
+    };
+}
+
 // macro expand a function macro argument
 // if the argument was already expanded, return the previous expansion
 // to avoid expanding the argument multiple times
-static TokenList* expandArgument(Phase4Context* ctx, ArgumentItem* arg, LexerToken* padding) {
+static TokenList* expandArgument(Phase4Context* ctx, ArgumentItemList* args, ArgumentItem* arg, LexerToken* padding) {
     if(arg->hasExpanded) {
         return &arg->expanded;
     }
 
+    TokenList tokens = argumentTokens(args, arg);
     arg->expanded = (TokenList){0};
-    ExpandTokenList(ctx, &arg->expanded, TokenListAdvance, TokenListPeek, ReturnFalse, &arg->tokens, false, padding);
+    ExpandTokenList(ctx, &arg->expanded, TokenListAdvance, TokenListPeek, ReturnFalse, &tokens, false, padding);
     arg->hasExpanded = true;
 
     return &arg->expanded;
@@ -1859,25 +3883,26 @@ static TokenList* expandArgument(Phase4Context* ctx, ArgumentItem* arg, LexerTok
 
 // returns the stringified version of a token using the # operator
 // caches the resultant token to avoid recalculation
-static LexerToken* stringifyArgument(Phase4Context* ctx, ArgumentItem* arg) {
+static LexerToken* stringifyArgument(Phase4Context* ctx, ArgumentItemList* args, ArgumentItem* arg) {
     if(arg->hasString) {
         return &arg->string;
     }
 
-    if(arg->tokens.itemCount == 0) {
+    TokenList tokens = argumentTokens(args, arg);
+    if(tokens.itemCount == 0) {
         arg->string = (LexerToken){
             .isStartOfLine = false,
             .indent = 0,
             .renderStartOfLine = false,
             .type = TOKEN_STRING_L,
             .whitespaceBefore = false,
-            .data.string = {
-                .type = STRING_NONE,
-                .count = 0,
-                .capacity = 0,
-                .buffer = "",
-            }
         };
+        TokenSetString(ctx->settings, &arg->string, (LexerString) {
+            .type = STRING_NONE,
+            .count = 0,
+            .capacity = 0,
+            .buffer = "",
+        });
         arg->hasString = true;
         return &arg->string;
     }
@@ -1887,8 +3912,8 @@ static LexerToken* stringifyArgument(Phase4Context* ctx, ArgumentItem* arg) {
     TokenPrintCtxString printCtx;
     TokenPrintCtxInitString(&printCtx, &str, ctx->settings);
 
-    for(unsigned int i = 0; i < arg->tokens.itemCount; i++) {
-        TokenPrintString(&printCtx, &arg->tokens.items[i]);
+    for(unsigned int i = 0; i < tokens.itemCount; i++) {
+        TokenPrintString(&printCtx, &tokens.items[i]);
     }
 
     arg->string = (LexerToken) {
@@ -1897,8 +3922,8 @@ static LexerToken* stringifyArgument(Phase4Context* ctx, ArgumentItem* arg) {
         .renderStartOfLine = false,
         .type = TOKEN_STRING_L,
         .whitespaceBefore = false,
-        .data.string = str,
     };
+    TokenSetStringEscapes(ctx->settings, &arg->string, str);
     arg->hasString = true;
 
     return &arg->string;
@@ -1925,35 +3950,38 @@ static EnterContextResult CallFunctionMacro(
     LexerToken lparen;
     advance(&lparen, getCtx);
 
-    FnMacro* fn = &tok->data.node->as.function;
+    HashNode* node = TokenNode(ctx->settings, tok);
+    MacroLexReplacement(ctx->settings, node);
+    FnMacro* fn = &node->as.function;
 
     ArgumentItemList args;
     ARRAY_ALLOC(ArgumentItem, args, item);
+    ARRAY_ALLOC(LexerToken, args.tokens, item);
 
     // gather arguments and macro expand them
     // this guarantees that there will be at least one argument parsed
     LexerToken* next;
     while(true) {
         ArgumentItem* arg = ARRAY_PUSH_PTR(args, item);
-        ARRAY_ALLOC(LexerToken, arg->tokens, item);
+        arg->start = args.tokens.itemCount;
         arg->hasExpanded = false;
         arg->hasString = false;
 
         int bracketDepth = 0;
         while(true) {
-            next = ARRAY_PUSH_PTR(arg->tokens, item);
+            next = ARRAY_PUSH_PTR(args.tokens, item);
             advance(next, getCtx);
 
             if(next->type == TOKEN_PUNC_COMMA && bracketDepth == 0) {
                 if(fn->variadacArgument < 0  || args.itemCount <= (unsigned int)fn->variadacArgument) {
-                    arg->tokens.itemCount--;
+                    args.tokens.itemCount--;
                     break;
                 }
             } else if(next->type == TOKEN_PUNC_LEFT_PAREN) {
                 bracketDepth++;
             } else if(next->type == TOKEN_PUNC_RIGHT_PAREN) {
                 if(bracketDepth == 0) {
-                    arg->tokens.itemCount--;
+                    args.tokens.itemCount--;
                     break;
                 } else {
                     bracketDepth--;
@@ -1963,8 +3991,9 @@ static EnterContextResult CallFunctionMacro(
             }
         }
 
-        if(arg->tokens.itemCount > 0) {
-            arg->tokens.items[0].indent = 0;
+        arg->count = args.tokens.itemCount - arg->start;
+        if(arg->count > 0) {
+            args.tokens.items[arg->start].indent = 0;
         }
 
         if(next->type == TOKEN_PUNC_RIGHT_PAREN || next->type == TOKEN_EOF_L) {
@@ -1973,7 +4002,8 @@ static EnterContextResult CallFunctionMacro(
     }
 
     if(next->type != TOKEN_PUNC_RIGHT_PAREN) {
-        fprintf(stderr, "Error: Unterminated function macro call [%lld:%lld]\n", tok->loc->line, tok->loc->column);
+        SourcePosition pos = SourceLocationPosition(ctx->settings, tok->loc);
+        fprintf(stderr, "Error: Unterminated function macro call [%lld:%lld]\n", pos.line, pos.column);
         return CONTEXT_MACRO_NULL;
     }
 
@@ -1983,13 +4013,13 @@ static EnterContextResult CallFunctionMacro(
     if(minArgs == 0 && fn->variadacArgument == -1) {
         // empty parens e.g. macrocall() counts as one empty argument, or none
         // depending on what is required
-        if(args.itemCount != 1 || args.items[0].tokens.itemCount != 0) {
-            fprintf(stderr, "Error: Arguments provided to macro call %s\n", tok->data.node->name.data.string.buffer);
+        if(args.itemCount != 1 || args.items[0].count != 0) {
+            fprintf(stderr, "Error: Arguments provided to macro call %s\n", node->name.buffer);
             return CONTEXT_MACRO_NULL;
         }
     } else {
         if(args.itemCount < minArgs) {
-            fprintf(stderr, "Error: Not enough arguments provided to macro call %s - %lld of %lld\n", tok->data.node->name.data.string.buffer, args.itemCount, minArgs);
+            fprintf(stderr, "Error: Not enough arguments provided to macro call %s - %lld of %lld\n", node->name.buffer, args.itemCount, minArgs);
             return CONTEXT_MACRO_NULL;
         }
         if(args.itemCount > minArgs && fn->variadacArgument == -1) {
@@ -2013,13 +4043,13 @@ static EnterContextResult CallFunctionMacro(
 
             // if __VA_ARGS__ is not empty
             if(fn->variadacArgument < (int)args.itemCount) {
-                ArgumentItem* argument = &args.items[fn->variadacArgument];
+                TokenList argument = argumentTokens(&args, &args.items[fn->variadacArgument]);
                 ARRAY_PUSH(substituted, item, *tok);
 
                 LexerToken* hashTok = &fn->replacements[i + 1];
 
-                for(unsigned int j = 0; j < argument->tokens.itemCount; j++) {
-                    ARRAY_PUSH(substituted, item, argument->tokens.items[j]);
+                for(unsigned int j = 0; j < argument.itemCount; j++) {
+                    ARRAY_PUSH(substituted, item, argument.items[j]);
                     if(j == 0) {
                         LexerToken* t = &substituted.items[substituted.itemCount-1];
                         t->indent = hashTok->indent;
@@ -2057,7 +4087,7 @@ static EnterContextResult CallFunctionMacro(
                 }
             }
 
-            size_t argumentNumber = tok->data.integer;
+            size_t argumentNumber = tok->data;
             if(isVaArgs) {
                 argumentNumber = fn->variadacArgument;
             }
@@ -2068,7 +4098,7 @@ static EnterContextResult CallFunctionMacro(
 
             if(isExpanded) {
                 // no relation to token concatanation operator
-                TokenList* arg = expandArgument(ctx, argument, tok);
+                TokenList* arg = expandArgument(ctx, &args, argument, tok);
                 for(unsigned int j = 0; j < arg->itemCount; j++) {
                     ARRAY_PUSH(substituted, item, arg->items[j]);
 
@@ -2081,7 +4111,8 @@ static EnterContextResult CallFunctionMacro(
                     t->isMacroExpanded = true;
                 }
             } else {
-                TokenList* arg = &argument->tokens;
+                TokenList tokens = argumentTokens(&args, argument);
+                TokenList* arg = &tokens;
                 // empty argument -> standard says add placeholder token
                 if(arg->itemCount == 0) {
                     LexerToken* placeholder = ARRAY_PUSH_PTR(substituted, item);
@@ -2108,7 +4139,7 @@ static EnterContextResult CallFunctionMacro(
                 fprintf(stderr, "Error: Stringification operator applied to non-argument token\n");
                 return CONTEXT_MACRO_NULL;
             }
-            LexerToken* str = stringifyArgument(ctx, &args.items[argToken->data.integer]);
+            LexerToken* str = stringifyArgument(ctx, &args, &args.items[argToken->data]);
             str->indent = tok->indent;
             str->renderStartOfLine = tok->renderStartOfLine;
             str->whitespaceBefore = tok->whitespaceBefore;
@@ -2132,15 +4163,17 @@ static EnterContextResult CallFunctionMacro(
 
     JointTokenStream stream = {
         .list = &concatenated,
-        .macroContext = tok->data.node,
+        .macroContext = node,
         .second = getCtx,
         .secondAdvance = advance,
         .secondPeek = peek,
     };
     TokenList result;
-    tok->data.node->macroExpansionEnabled = false;
+    node->macroExpansionEnabled = false;
+    ctx->settings->expansionDepth++;
     ExpandTokenList(ctx, &result, JointTokenAdvance, JointTokenPeek, JointTokenEarlyExit, &stream, true, tok);
-    tok->data.node->macroExpansionEnabled = true;
+    ctx->settings->expansionDepth--;
+    node->macroExpansionEnabled = true;
 
     if(result.itemCount <= 0) {
         return CONTEXT_MACRO_NULL;
@@ -2165,46 +4198,58 @@ static EnterContextResult ExpandSingleMacro(
     Phase4GetterFn peek,
     void* getCtx
 ) {
-    if(tok->type != TOKEN_IDENTIFIER_L || tok->data.node->type == NODE_VOID) {
+    if(tok->type != TOKEN_IDENTIFIER_L) {
         return CONTEXT_NOT_MACRO;
     }
-    if(!tok->data.node->macroExpansionEnabled || !tok->data.attemptExpansion) {
+    HashNode* node = TokenNode(ctx->settings, tok);
+    if(ctx->settings->fillingExpansion) {
+        node->usedByExpansion = true;
+    }
+    if(node->type == NODE_VOID) {
+        return CONTEXT_NOT_MACRO;
+    }
+    if(!node->macroExpansionEnabled || !tok->attemptExpansion) {
         return CONTEXT_DISABLED_MACRO;
     }
 
-    switch(tok->data.node->type) {
+    switch(node->type) {
         case NODE_MACRO_OBJECT:
             return CallObjectMacro(macro, tok, ctx, advance, peek, getCtx);
         case NODE_MACRO_FUNCTION:
             return CallFunctionMacro(macro, tok, ctx, advance, peek, getCtx);
         case NODE_MACRO_INTEGER:
             tok->type = TOKEN_INTEGER_L;
-            tok->data.integer = tok->data.node->as.integer;
+            TokenSetInteger(ctx->settings, tok, node->as.integer);
             macro->tokenCount = 0;
             return CONTEXT_MACRO_TOKEN;
         case NODE_MACRO_STRING: {
             tok->type = TOKEN_STRING_L;
             LexerString str;
-            str.buffer = (char*)tok->data.node->as.string;
-            str.count = strlen(tok->data.node->as.string);
+            str.buffer = (char*)node->as.string;
+            str.capacity = 0;
+            str.count = strlen(node->as.string);
             str.type = STRING_NONE;
-            tok->data.string = str;
+            TokenSetStringEscapes(ctx->settings, tok, str);
             macro->tokenCount = 0;
             return CONTEXT_MACRO_TOKEN;
         }
         case NODE_MACRO_LINE: {
+            ctx->settings->expansionUncacheable = true;
             tok->type = TOKEN_INTEGER_L;
-            tok->data.integer = ctx->previous.loc->line;
+            TokenSetInteger(ctx->settings, tok, SourceLocationPosition(ctx->settings, ctx->previous.loc).line);
             macro->tokenCount = 0;
             return CONTEXT_MACRO_TOKEN;
         }
         case NODE_MACRO_FILE: {
+            ctx->settings->expansionUncacheable = true;
             tok->type = TOKEN_STRING_L;
             LexerString str;
-            str.buffer = (char*)ctx->previous.loc->fileName;
-            str.count = strlen((char*)ctx->previous.loc->fileName);
+            SourceFile* file = SourceLocationFile(ctx->settings, ctx->previous.loc);
+            str.buffer = (char*)(file ? file->fileName : ctx->settings->fileName);
+            str.capacity = 0;
+            str.count = strlen(str.buffer);
             str.type = STRING_NONE;
-            tok->data.string = str;
+            TokenSetStringEscapes(ctx->settings, tok, str);
             macro->tokenCount = 0;
             return CONTEXT_MACRO_TOKEN;
         }
@@ -2239,17 +4284,33 @@ static void TryExitMacroContext(Phase4Context* ctx) {
     }
 }
 
-static void Phase4Get(LexerToken* tok, Phase4Context* ctx) {
-    if(ctx->mode == LEX_MODE_INCLUDE) {
-        Phase4Get(tok, ctx->includeContext);
-        if(tok->type == TOKEN_EOF_L) {
-            ctx->mode = LEX_MODE_NO_HEADER;
-        } else {
-            ctx->previous = *tok;
-            return;
+// Skip from the next token to the next directive, as only directives are
+// needed to find the files included.  Like skipIfContents, the lines are
+// lexed if tokens are being cached, or trigraphs are enabled.
+static void scanSkipLines(Phase4Context* ctx) {
+    if(ctx->cache != NULL || ctx->settings->trigraphs) {
+        LexerToken tok;
+        Phase4Advance(&tok, ctx);
+        LexerToken* peek = Phase4PeekAt(ctx, 0);
+        while(peek->type != TOKEN_EOF_L && !(peek->isStartOfLine &&
+            (peek->type == TOKEN_PUNC_HASH || peek->type == TOKEN_PUNC_PERCENT_COLON))) {
+            Phase4Advance(&tok, ctx);
+            peek = Phase4PeekAt(ctx, 0);
         }
+        return;
     }
 
+    Phase1Context* phase1 = &ctx->phase3.phase2.phase1;
+    LexerToken* peek = Phase4PeekAt(ctx, 0);
+    size_t start = peek->loc.offset - phase1->file->start;
+    size_t end = rawSkipToDirective(phase1->source, phase1->sourceLength,
+        start, peek->isStartOfLine);
+
+    Phase4Restart(ctx, end, true);
+}
+
+// get the next token from one file, which could be from a file it includes
+static void Phase4GetFile(LexerToken* tok, Phase4Context* ctx) {
     TryExitMacroContext(ctx);
     if(ctx->macroCtx.tokens != NULL) {
         AdvanceMacroContext(tok, ctx);
@@ -2268,90 +4329,119 @@ static void Phase4Get(LexerToken* tok, Phase4Context* ctx) {
             if(ctx->ifDirectiveDepth != 0) {
                 fprintf(stderr, "Error: Non-terminated conditional directive\n");
             }
+            if(ctx->guardState == GUARD_AFTER_ENDIF) {
+                Phase4FileGuard(ctx)->macro = ctx->guardMacro;
+            }
             break;
         }
 
         if(previous.type != TOKEN_EOF_L) {
             tok->renderStartOfLine |= previous.renderStartOfLine;
             tok->whitespaceBefore |= previous.whitespaceBefore;
-            tok->indent += previous.indent;
+            TokenSetIndent(tok, tok->indent + previous.indent);
         }
         previous = *tok;
 
         if((tok->type == TOKEN_PUNC_HASH || tok->type == TOKEN_PUNC_PERCENT_COLON) && tok->isStartOfLine) {
-            LexerToken* peekNext = &ctx->peekNext;
+            LexerToken* peekNext = Phase4PeekAt(ctx, 1);
 
             if(peekNext->isStartOfLine) {
                 // NULL directive
+                Phase4Advance(tok, ctx); // consume "#"
                 previous.type = TOKEN_EOF_L;
                 continue;
             }
 
             if(peekNext->type != TOKEN_IDENTIFIER_L) {
                 fprintf(stderr, "Error: Unexpected token at start of directive\n");
+                Phase4Advance(tok, ctx); // consume "#"
                 Phase4SkipLine(tok, ctx);
                 previous.type = TOKEN_EOF_L;
                 continue;
             }
 
-            uint32_t hash = peekNext->data.node->hash;
-            size_t len = peekNext->data.node->name.data.string.count;
-
-            if(hashCompare(len, hash, "include")) {
-                bool success = parseInclude(tok, ctx, false);
+            IdentId directive = tokenIdentId(peekNext);
+            if(ctx->guardState == GUARD_AFTER_ENDIF ||
+                (ctx->guardState == GUARD_START && directive != IDENT_IFNDEF)) {
+                ctx->guardState = GUARD_NONE;
+            }
 
-                // not all header files have source code, they could be all
-                // preprocessor directives, so it could succeed, but produce
-                // an eof token when it is not end of file, causing processing
-                // to halt too early.
-                if(success && tok->type != TOKEN_EOF_L) {
-                    ctx->previous = *tok;
-                    return;
+            switch(directive) {
+                case IDENT_INCLUDE:
+                case IDENT_INCLUDE_NEXT: {
+                    // See https://gcc.gnu.org/onlinedocs/cpp/Wrapper-Headers.html
+                    // for #include_next
+                    bool success = parseInclude(tok, ctx, directive == IDENT_INCLUDE_NEXT);
+
+                    // not all header files have source code, they could be all
+                    // preprocessor directives, so it could succeed, but produce
+                    // an eof token when it is not end of file, causing processing
+                    // to halt too early.
+                    if(success && tok->type != TOKEN_EOF_L) {
+                        ctx->previous = *tok;
+                        return;
+                    }
+                    tok->type = TOKEN_ERROR_L;
+                    previous.type = TOKEN_EOF_L;
+                    continue;
                 }
-                tok->type = TOKEN_ERROR_L;
-                previous.type = TOKEN_EOF_L;
-                continue;
-            } else if(hashCompare(hash, len, "include_next")) {
-                // See https://gcc.gnu.org/onlinedocs/cpp/Wrapper-Headers.html
-                bool success = parseInclude(tok, ctx, true);
-                if(success) {
-                    ctx->previous = *tok;
-                    return;
+                case IDENT_DEFINE:
+                    parseDefine(ctx);
+                    previous.type = TOKEN_EOF_L;
+                    continue;
+                case IDENT_UNDEF:
+                    parseUndef(ctx);
+                    previous.type = TOKEN_EOF_L;
+                    continue;
+                case IDENT_ERROR:
+                    parseError(ctx);
+                    previous.type = TOKEN_EOF_L;
+                    continue;
+                case IDENT_IF:
+                case IDENT_IFDEF:
+                case IDENT_IFNDEF:
+                case IDENT_ELIF:
+                case IDENT_ELSE:
+                case IDENT_ENDIF:
+                    parseIf(ctx);
+                    previous.type = TOKEN_EOF_L;
+                    continue;
+                case IDENT_PRAGMA:
+                    if(parsePragma(ctx)) {
+                        previous.type = TOKEN_EOF_L;
+                        continue;
+                    }
+                    break;
+                default: {
+                    // unknown directives are output unchanged, starting
+                    // with the "#"
+                    LexerToken hash;
+                    Phase4Advance(&hash, ctx);
+                    break;
                 }
-                tok->type = TOKEN_ERROR_L;
-                previous.type = TOKEN_EOF_L;
-                continue;
-            } else if(hashCompare(len, hash, "define")) {
-                parseDefine(ctx);
-                previous.type = TOKEN_EOF_L;
-                continue;
-            } else if(hashCompare(len, hash, "undef")) {
-                parseUndef(ctx);
-                previous.type = TOKEN_EOF_L;
-                continue;
-            } else if(hashCompare(len, hash, "error")) {
-                parseError(ctx);
-                previous.type = TOKEN_EOF_L;
-                continue;
-            } else if(hashCompare(len, hash, "if") || hashCompare(len, hash, "ifdef") || hashCompare(len, hash, "endif") ||
-                hashCompare(len, hash, "ifndef") || hashCompare(len, hash, "elif") || hashCompare(len, hash, "else")) {
-                parseIf(ctx);
-                previous.type = TOKEN_EOF_L;
-                continue;
             }
-
-            //fprintf(stderr, "Error: Unknown preprocessing directive\n");
-            //Phase4Advance(tok, ctx);
-            //Phase4SkipLine(tok, ctx);
             break;
         }
 
+        if(ctx->settings->scanDeps) {
+            if(ctx->guardState != GUARD_IN_IFNDEF) {
+                ctx->guardState = GUARD_NONE;
+            }
+            scanSkipLines(ctx);
+            previous.type = TOKEN_EOF_L;
+            continue;
+        }
+
         LexerToken nullTok;
         // advance, and discard, the actual token was retrieved by the peek
         // and might have been updaed with new whitespace, so not discarding
         // here would overwrite those changes.
         Phase4Advance(&nullTok, ctx);
 
+        // any tokens outside of the #ifndef mean the file is not guarded
+        if(ctx->guardState != GUARD_IN_IFNDEF) {
+            ctx->guardState = GUARD_NONE;
+        }
 
         if(EnterMacroContext(tok, ctx) == CONTEXT_MACRO_NULL) {
             // dont set loop previous token
@@ -2364,7 +4454,25 @@ static void Phase4Get(LexerToken* tok, Phase4Context* ctx) {
         break;
     }
 
-    ctx->previous = *tok;
+    // the end of an included file is not passed on to the file including
+    // it, so is not its previous token, see Phase4PopInclude
+    if(tok->type != TOKEN_EOF_L) {
+        ctx->previous = *tok;
+    }
+}
+
+// get the next token of a translation unit, from the innermost file being
+// read, moving back to the including file at the end of each include
+static void Phase4Get(LexerToken* tok, Phase4Context* ctx) {
+    Phase4Context* root = ctx->root;
+    while(true) {
+        Phase4Context* current = root->current;
+        Phase4GetFile(tok, current);
+        if(tok->type != TOKEN_EOF_L || current == root) {
+            return;
+        }
+        Phase4PopInclude(current);
+    }
 }
 
 // helper to run upto and including phase 4
@@ -2374,12 +4482,26 @@ void runPhase4(TranslationContext* settings) {
 
     LexerToken tok;
     TokenPrintCtxFile printCtx;
-    TokenPrintCtxInitFile(&printCtx, stdout, settings);
+    TokenPrintCtxInitFile(&printCtx, settings->output, settings);
 
     while(Phase4Get(&tok, &ctx), tok.type != TOKEN_EOF_L) {
         TokenPrintFile(&printCtx, &tok);
     }
-    fprintf(stdout, "\n");
+    fprintf(settings->output, "\n");
+}
+
+// Run the directives of a translation unit, skipping everything else, to
+// find the files it includes, see TranslationContext.dependencys
+void runScanDeps(TranslationContext* settings) {
+    settings->scanDeps = true;
+
+    Phase4Context ctx = {0};
+    Phase4Initialise(&ctx, settings, NULL);
+
+    LexerToken tok;
+    do {
+        Phase4Get(&tok, &ctx);
+    } while(tok.type != TOKEN_EOF_L);
 }
 
 // ------- //
@@ -2393,7 +4515,7 @@ static void Phase5Initialise(Phase5Context* ctx, TranslationContext* settings) {
     Phase4Initialise(&ctx->phase4, settings, NULL);
 }
 
-static char simpleEscapeTranslations[] = {
+static const char simpleEscapeTranslations[UCHAR_MAX + 1] = {
     ['\''] = '\'',
     ['"'] = '\"',
     ['?'] = '?',
@@ -2413,45 +4535,42 @@ static void Phase5Get(LexerToken* tok, Phase5Context* ctx) {
     // only strings are changed
     if(tok->type != TOKEN_STRING_L) return;
 
-    LexerString* str = &tok->data.string;
+    LexerString* str = TokenString(ctx->settings, tok);
     if(str->type != STRING_NONE && str->type != STRING_U8) {
         fprintf(stderr, "Error: wide/16bit/32bit strings not currently supported\n");
         return;
     }
 
-    bool hasSlash = false;
-    for(size_t i = 0; i < str->count; i++) {
-        if(str->buffer[i] == '\\') {
-            hasSlash = true;
-            break;
-        }
-    }
-
     // avoid processing escapes unless they exist
-    if(!hasSlash) return;
+    if(!tok->hasEscapes) return;
 
-    LexerString newStr = {0};
-    // escape sequences never end up longer than their source
-    // so using str->count as the buffer size avoids reallocation
-    // when pushing to the new string
+    // Token data is shared by every copy of a token, e.g. in a macro's
+    // replacement list, so cannot be decoded in place.  Escape sequences
+    // never end up longer than their source, so the decoded string is
+    // written straight into a buffer of the same size, in one pass.
+    LexerString newStr;
     LexerStringInit(&newStr, ctx->settings, str->count);
+    newStr.type = str->type;
 
+    const unsigned char* in = (const unsigned char*)str->buffer;
+    char* out = newStr.buffer;
     for(size_t i = 0; i < str->count; i++) {
-        if(str->buffer[i] == '\\') {
-            // as this lexed as a string, the backslash wasn't last in the string
-            unsigned char current = str->buffer[i+1];
+        if(in[i] == '\\') {
+            // the backslash is only last in a string made by the # operator
+            unsigned char current = i + 1 < str->count ? in[i + 1] : '\0';
             if(simpleEscapeTranslations[current] != '\0') {
-                LexerStringAddChar(&newStr, ctx->settings, simpleEscapeTranslations[current]);
+                *out++ = simpleEscapeTranslations[current];
                 i++;
-                continue;
             }
         } else {
-            LexerStringAddChar(&newStr, ctx->settings, str->buffer[i]);
+            *out++ = in[i];
         }
     }
+    *out = '\0';
+    newStr.count = out - newStr.buffer;
 
-    tok->data.string = newStr;
-
+    TokenSetString(ctx->settings, tok, newStr);
+    tok->hasEscapes = false;
 }
 
 void runPhase5(TranslationContext* settings) {
@@ -2460,10 +4579,10 @@ void runPhase5(TranslationContext* settings) {
 
     LexerToken tok;
     TokenPrintCtxFile printCtx;
-    TokenPrintCtxInitFile(&printCtx, stdout, settings);
+    TokenPrintCtxInitFile(&printCtx, settings->output, settings);
 
     while(Phase5Get(&tok, &ctx), tok.type != TOKEN_EOF_L) {
         TokenPrintFile(&printCtx, &tok);
     }
-    fprintf(stdout, "\n");
+    fprintf(settings->output, "\n");
 }
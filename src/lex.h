@@ -7,14 +7,43 @@
 #include "file.h"
 #include "symbolTable.h"
 #include "lexString.h"
+#include "identTable.h"
 
+// A range of bytes in the source code.  The offset is into the concatenation
+// of every file that has been read, see SourceFile, and starts at 1, so a
+// location with offset 0 is not in any file.
 typedef struct SourceLocation {
+    uint32_t offset;
+    uint32_t length;
+} SourceLocation;
+
+// The line and column of a SourceLocation, worked out when required by
+// SourceLocationPosition, as it is only needed for diagnostics and __LINE__
+typedef struct SourcePosition {
     const unsigned char* fileName;
     size_t line;
     size_t column;
-    size_t length;
-    const unsigned char* sourceText;
-} SourceLocation;
+} SourcePosition;
+
+// a file that has been read by the lexer
+typedef struct SourceFile {
+    const unsigned char* fileName;
+
+    // the file's contents, followed by a '\0' sentinel
+    const unsigned char* source;
+    size_t sourceLength;
+
+    // offset of source[0] in SourceLocations
+    uint32_t start;
+
+    // index in source of the first character of every line, created the
+    // first time a position in the file is requested
+    ARRAY_DEFINE(uint32_t, lineStart);
+
+    // index in source of every byte that phase 1 reports an error for, in
+    // order, found when the file is added, see scanInvalidBytes
+    ARRAY_DEFINE(uint32_t, invalidByte);
+} SourceFile;
 
 // What sort of token is it, used for both preprocessor and regular
 // tokens, however not all values are valid in each scenario
@@ -132,56 +161,79 @@ typedef enum LexerTokenType {
     TOKEN_EOF_L,
 } LexerTokenType;
 
-// the smallest non-character unit of code
+// The smallest non-character unit of code.  Tokens are copied by value
+// through every phase, so are kept to 16 bytes, with any data that does not
+// fit stored in a side table in the TranslationContext, see TokenString.
 typedef struct LexerToken {
-    LexerTokenType type;
+    // a LexerTokenType, stored in a byte
+    uint8_t type;
 
     // required to prevent extra macro expansion
-    bool isStartOfLine;
+    bool isStartOfLine : 1;
 
     // should the token be printed on a new line
-    bool renderStartOfLine;
+    bool renderStartOfLine : 1;
 
     // required to tell the difference between
     // #define(a)  - function macro
     // #define (a) - value macro
-    bool whitespaceBefore;
+    bool whitespaceBefore : 1;
 
     // is this token the result of using the ## operator
     // used so # ## # and def ## ined can be detected
     // as different to ## and defined
     // also true after the token has been substituted
-    bool isMacroExpanded;
+    bool isMacroExpanded : 1;
+
+    // for identifiers, can the token be macro expanded, false after the
+    // macro has been found to be disabled where the token was read
+    bool attemptExpansion : 1;
+
+    // for strings and characters, does the text contain a backslash, so
+    // phase 5 only looks at the strings with escape sequences to decode
+    bool hasEscapes : 1;
 
     // stores the quantity of whitespace before the token on the same
     // line as the token (note whitespaceBefore can be true, while this
-    // is equal to 0, so need both of them)
-    size_t indent;
+    // is equal to 0, so need both of them), limited to TOKEN_INDENT_MAX
+    uint16_t indent;
 
     // where the token is in the source file, used for emmitting errors
     // and debugging infomation
-    SourceLocation* loc;
+    SourceLocation loc;
 
     // optional data about the token, what is stored here is dependant
-    // upon token type, could be nothing/uninitialised
-    union {
-        intmax_t integer;
-        double floating;
-        LexerString string;
-        char character;
-        struct {
-            struct HashNode* node;
-            bool attemptExpansion;
-        };
-    } data;
+    // upon token type, could be nothing/uninitialised:
+    //  identifiers - the id of its HashNode, see TokenNode
+    //  strings, characters, pp-numbers and header names - see TokenString
+    //  integers and floating numbers - see TokenValue
+    //  macro arguments - the index of the argument
+    //  unknown characters - the character
+    uint32_t data;
 } LexerToken;
 
+_Static_assert(sizeof(LexerToken) == 16, "tokens should stay 16 bytes");
+
+#define TOKEN_INDENT_MAX UINT16_MAX
+
 typedef struct Phase1Context {
-    unsigned char* source;
+    // the file's contents, followed by a '\0' sentinel
+    const unsigned char* source;
     size_t sourceLength;
     size_t consumed;
+    SourceFile* file;
+
+    // bytes in [cleanStart, cleanEnd) can be passed through phases 1 and 2
+    // unchanged, cleanEnd is the next byte that cannot, see scanSpecialBytes
+    size_t cleanStart;
+    size_t cleanEnd;
+
+    // index in source of the next byte in the file's invalidBytes, or
+    // sourceLength if there are none left, and its index in that array
+    size_t nextInvalid;
+    size_t invalidIndex;
+
     SourceLocation location;
-    unsigned char ignoreNewLine;
     struct TranslationContext* settings;
 } Phase1Context;
 
@@ -200,6 +252,11 @@ typedef enum Phase3LexMode {
 
 typedef struct Phase3Context {
     Phase3LexMode mode;
+
+    // how much of "# include" has just been lexed, as a header name can only
+    // be the token after it, see Phase3Get
+    unsigned char includeTokens;
+
     unsigned char peek;
     SourceLocation peekLoc;
     unsigned char peekNext;
@@ -208,7 +265,7 @@ typedef struct Phase3Context {
     bool AtStart;
     void* getterCtx;
     unsigned char (*getter)(void* ctx, SourceLocation* loc);
-    Table* hashNodes;
+    IdentTable* hashNodes;
     Phase2Context phase2;
     struct TranslationContext* settings;
 } Phase3Context;
@@ -235,13 +292,33 @@ typedef struct FnMacro {
     int variadacArgument;
 } FnMacro;
 
+// the result of fully expanding an object macro outside of any other
+// expansion, see CallObjectMacro
+typedef struct CachedExpansion {
+    // only valid while this is the translation context's macroGeneration
+    size_t generation;
+    TokenList tokens;
+} CachedExpansion;
+
 typedef struct HashNode {
-    LexerToken name;
+    LexerString name;
     HashNodeType type;
     uint32_t hash;
 
+    // an IdentId for predeclared names, see IdentTableGet
+    uint32_t id;
+
     bool macroExpansionEnabled;
 
+    // for object and function macros, the source of the replacement list if
+    // it has not been lexed yet, see MacroLexReplacement, otherwise length 0
+    SourceLocation lazyReplacement;
+
+    // the cached expansion of an object macro, or NULL, and whether any
+    // cached expansion depends on what this name is defined as
+    CachedExpansion* expansion;
+    bool usedByExpansion;
+
     union {
         TokenList object;
         FnMacro function;
@@ -255,17 +332,66 @@ typedef struct MacroContext {
     size_t tokenCount;
 } MacroContext;
 
-typedef enum Phase4LexMode {
-    LEX_MODE_INCLUDE,
-    LEX_MODE_NO_INCLUDE,
-} Phase4LexMode;
+// Detecting the multiple include optimisation, where a file is entirely
+// inside #ifndef X ... #endif, so it does not need to be read again while X
+// is defined.  The file is checked as it is preprocessed, moving through the
+// states in order, or to GUARD_NONE if anything else is found.
+typedef enum IncludeGuardState {
+    GUARD_START,        // nothing found yet
+    GUARD_IN_IFNDEF,    // inside the #ifndef at the start of the file
+    GUARD_AFTER_ENDIF,  // after its #endif, so only the end of file is allowed
+    GUARD_NONE,         // file does not have an include guard
+} IncludeGuardState;
+
+// what is known about an included file, so it can be skipped if included again
+typedef struct IncludeGuard {
+    // the file is skipped if this macro is defined, or NULL
+    struct HashNode* macro;
+
+    // #pragma once was found in the file
+    bool once;
+} IncludeGuard;
+
+// The phase 3 tokens of a file, so it can be replayed instead of lexed again
+// when it is included more than once, see Phase4Initialise
+typedef struct CachedFile {
+    SourceFile* file;
+
+    // how many times the file has been opened
+    size_t openCount;
+
+    // ends with the end of file token, once complete
+    TokenList tokens;
+    bool complete;
+} CachedFile;
+
+// how many tokens phase 4 has phase 3 lex at a time, see Phase4Fill
+#define PHASE4_BLOCK_SIZE 256
 
 typedef struct Phase4Context {
-    Phase4LexMode mode;
-    LexerToken peek;
-    LexerToken peekNext;
-    struct Phase4Context* includeContext;
+    // The file's tokens, with tokens[tokenPosition] being the next one to be
+    // used, so peeking is indexing, not copying.  They are either the file's
+    // token cache, when it is replayed, or block, which phase 3 fills.
+    LexerToken* tokens;
+    size_t tokenCount;
+    size_t tokenPosition;
+    LexerToken block[PHASE4_BLOCK_SIZE];
+
+    // whether the last token put in block was on a directive's line, and how
+    // many more after it are lexed one at a time, see Phase4FillToken
+    bool fillInDirective;
+    unsigned char fillSingleTokens;
+
+    // Each file being read has its own context, with parent being the file
+    // that included it.  The translation unit's context is the root of the
+    // include stack, storing the innermost file's context, so a token is
+    // read from it directly whatever the include depth, and the contexts of
+    // files that have ended, so they are reused by the next #include, linked
+    // through their parent.
     struct Phase4Context* parent;
+    struct Phase4Context* root;
+    struct Phase4Context* current;
+    struct Phase4Context* freeContexts;
     IncludeSearchState searchState;
     unsigned char depth;
     MacroContext macroCtx;
@@ -277,6 +403,15 @@ typedef struct Phase4Context {
     // used for correct __LINE__ and __FILE__ interpretation
     LexerToken previous;
 
+    IncludeGuardState guardState;
+    struct HashNode* guardMacro;
+
+    // the file being read, with the cache its tokens are being recorded into
+    // or replayed from, or NULL
+    SourceFile* file;
+    CachedFile* cache;
+    bool replaying;
+
     Phase3Context phase3;
     struct TranslationContext* settings;
 } Phase4Context;
@@ -286,6 +421,12 @@ typedef struct Phase5Context {
     struct TranslationContext* settings;
 } Phase5Context;
 
+// the value of an integer or floating token
+typedef union TokenNumber {
+    intmax_t integer;
+    double floating;
+} TokenNumber;
+
 // random data used by each translation phase that needs to be stored
 typedef struct TranslationContext {
     // settings (bools cannot be bitfields as they need to be addressable)
@@ -293,24 +434,143 @@ typedef struct TranslationContext {
     bool trigraphs;
     bool optionalVariadacArgs;
     bool gccVariadacComma;
+    bool printStats;
+
+    // only run directives, to find the files included, see runScanDeps
+    bool scanDeps;
+
+    // how many threads a large file is lexed with, and the smallest part of
+    // the file given to each thread, see Phase4LexParallel
+    int lexJobs;
+    int lexChunkSize;
+
+    // precompiled header paths, or NULL, see PchWrite and PchLoad
+    const char* pchCreate;
+    const char* pchUse;
 
     IncludeSearchPath search;
     MemoryPool* pool;
 
+    // where the output of runPhase1 to runPhase5 is written
+    FILE* output;
+
+    // reads included files ahead of time, or NULL, see PrefetcherReadFile
+    struct Prefetcher* prefetch;
+
     // state
     const unsigned char* fileName;
 
+    // every file read by the current translation unit, and the files whose
+    // tokens are cached, in order of their SourceLocation offsets
+    ARRAY_DEFINE(SourceFile*, file);
+    uint32_t nextFileStart;
+
+    // IncludeGuard* for files that might not need including again in the
+    // current translation unit, by the resolved path of the file
+    Table includeGuards;
+
+    // CachedFile* for every included file, by the resolved path of the file
+    Table tokenCache;
+
+    // with scanDeps, the resolved path of every file the current translation
+    // unit uses, in the order they are first used, also stored in a table
+    // so each is only added once
+    ARRAY_DEFINE(const char*, dependency);
+    Table dependencySet;
+
+    // shared by every translation unit, so cached tokens' nodes stay valid
+    IdentTable* idents;
+
+    // the precompiled header being used, mapped once by PchOpen and shared
+    // with the contexts copied from this one, and its text section, added
+    // to the files of each translation unit
+    const void* pchData;
+    SourceFile* pchFile;
+
+    // the data of tokens that does not fit inside of them, see LexerToken
+    ARRAY_DEFINE(LexerString, tokenString);
+    ARRAY_DEFINE(TokenNumber, tokenNumber);
+
+    // changed when a name that a cached expansion used is defined or
+    // undefined, so every cached expansion is no longer valid
+    size_t macroGeneration;
+
+    // set while lexing part of a file on another thread, or ahead of phase
+    // 4, where errors are only recorded, see lexShouldReport
+    bool lexSpeculative;
+    bool lexErrorFound;
+
+    // how many macros are being expanded, and whether the outermost one is
+    // being expanded to be cached, or has done something that means it
+    // cannot be, see CallObjectMacro
+    size_t expansionDepth;
+    bool fillingExpansion;
+    bool expansionUncacheable;
+
+    // statistics printed by -print-stats
+    size_t tokenCacheHits;
+    size_t tokenCacheBytesSaved;
+    size_t guardSkips;
+    size_t macrosDefined;
+    size_t macrosLexed;
+    size_t expansionCacheHits;
+    size_t expansionCacheMisses;
+    size_t parallelFiles;
+    size_t parallelChunks;
+    size_t parallelChunksRelexed;
+
+    // files read by each prefetcher once it is stopped, see
+    // PrefetcherAddStats, only printed if there were any
+    size_t prefetchers;
+    size_t prefetchReady;
+    size_t prefetchWaited;
+    size_t prefetchMissed;
+
     // memory allocators
     MemoryArray stringArr;
-    MemoryArray locations;
 } TranslationContext;
 
 void TranslationContextInit(TranslationContext* ctx, MemoryPool* pool);
 
+SourceFile* TranslationContextAddFile(TranslationContext* ctx, const unsigned char* fileName, const unsigned char* source, size_t length);
+SourceFile* SourceLocationFile(TranslationContext* ctx, SourceLocation loc);
+const unsigned char* SourceLocationText(TranslationContext* ctx, SourceLocation loc);
+SourcePosition SourceLocationPosition(TranslationContext* ctx, SourceLocation loc);
+void TranslationContextPrintStats(TranslationContext* ctx);
+void TranslationContextAddStats(TranslationContext* total, TranslationContext* ctx);
+
+// Token data accessors, the setters add the data to the side tables, so
+// copies of a token made before it is changed keep their original value.
+static inline HashNode* TokenNode(TranslationContext* ctx, const LexerToken* tok) {
+    return ctx->idents->nodes[tok->data];
+}
+static inline void TokenSetNode(LexerToken* tok, HashNode* node) {
+    tok->data = node->id;
+}
+static inline bool TokenHasString(LexerTokenType type) {
+    return type == TOKEN_HEADER_NAME || type == TOKEN_SYS_HEADER_NAME ||
+        type == TOKEN_PP_NUMBER || type == TOKEN_CHARACTER_L || type == TOKEN_STRING_L;
+}
+static inline LexerString* TokenString(TranslationContext* ctx, const LexerToken* tok) {
+    return &ctx->tokenStrings[tok->data];
+}
+static inline TokenNumber* TokenValue(TranslationContext* ctx, const LexerToken* tok) {
+    return &ctx->tokenNumbers[tok->data];
+}
+static inline void TokenSetIndent(LexerToken* tok, size_t indent) {
+    tok->indent = indent > TOKEN_INDENT_MAX ? TOKEN_INDENT_MAX : indent;
+}
+void TokenSetString(TranslationContext* ctx, LexerToken* tok, LexerString str);
+void TokenSetInteger(TranslationContext* ctx, LexerToken* tok, intmax_t value);
+
+// lex the replacement list of a macro, if it was not lexed by #define
+void MacroLexReplacement(TranslationContext* ctx, HashNode* node);
+
 void runPhase1(TranslationContext* ctx);
 void runPhase2(TranslationContext* ctx);
 void runPhase3(TranslationContext* ctx);
 void runPhase4(TranslationContext* ctx);
 void runPhase5(TranslationContext* ctx);
+void runScanDeps(TranslationContext* ctx);
 
 #endif
\ No newline at end of file
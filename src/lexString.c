@@ -13,13 +13,19 @@ void LexerStringInit(LexerString* str, TranslationContext* ctx, size_t size) {
 
 #define max(a,b) ((a)>(b)?(a):(b))
 
+// make sure there is space for len more characters and the '\0' after them.
+// Strings with no capacity are slices of a source file (see Phase3Get), so
+// they are always copied before being modified.
 static void expandString(struct TranslationContext* ctx, LexerString* str, size_t len) {
-    if(str->count + len > str->capacity) {
+    if(str->capacity == 0 || str->count + len > str->capacity) {
         size_t newLen = max(str->capacity * 2, str->count + len) + 1;
         char* buffer = memoryArrayPushN(&ctx->stringArr, newLen);
-        strncpy(buffer, str->buffer, str->capacity);
+        if(str->count > 0) {
+            memcpy(buffer, str->buffer, str->count);
+        }
+        buffer[str->count] = '\0';
         str->buffer = buffer;
-        str->capacity = newLen;
+        str->capacity = newLen - 1;
     }
 }
 
@@ -40,6 +46,23 @@ void LexerStringAddString(LexerString* str, struct TranslationContext* ctx, cons
     str->count += len;
 }
 
+// add len characters, which do not have to be '\0' terminated
+void LexerStringAddSlice(LexerString* str, struct TranslationContext* ctx, const char* c, size_t len) {
+    expandString(ctx, str, len);
+
+    memcpy(&str->buffer[str->count], c, len);
+    str->count += len;
+    str->buffer[str->count] = '\0';
+}
+
+// turn a slice of a source file into a '\0' terminated copy, so it can be
+// used as a c string
+void LexerStringMaterialise(LexerString* str, struct TranslationContext* ctx) {
+    if(str->capacity == 0) {
+        expandString(ctx, str, 0);
+    }
+}
+
 void LexerStringAddInt(LexerString* str, struct TranslationContext* ctx, int val) {
     size_t len = snprintf(NULL, 0, "%d", val)+1;
     expandString(ctx, str, len);
@@ -14,6 +14,9 @@ typedef enum LexerStringType {
     STRING_32,
 } LexerStringType;
 
+// A string built up by the lexer.  A capacity of 0 means that buffer points
+// into a source file's contents, so is not '\0' terminated and is copied
+// before any characters are added.
 typedef struct LexerString {
     char* buffer;
     size_t capacity;
@@ -26,6 +29,8 @@ struct TranslationContext;
 void LexerStringInit(LexerString* str, struct TranslationContext* ctx, size_t size);
 void LexerStringAddString(LexerString* str, struct TranslationContext* ctx, const char* c);
 void LexerStringAddChar(LexerString* str, struct TranslationContext* ctx, char c);
+void LexerStringAddSlice(LexerString* str, struct TranslationContext* ctx, const char* c, size_t len);
+void LexerStringMaterialise(LexerString* str, struct TranslationContext* ctx);
 void LexerStringAddInt(LexerString* str, struct TranslationContext* ctx, int val);
 void LexerStringAddSizeT(LexerString* str, struct TranslationContext* ctx, size_t val);
 void LexerStringAddIntMaxT(LexerString* str, struct TranslationContext* ctx, intmax_t val);
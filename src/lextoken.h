@@ -29,6 +29,8 @@
         ), (value))
 #   define PRINT_ESCAPE(c, value, len) \
         fprintfEscape((c)->file, (value), (len))
+#   define PRINT_SLICE(c, value, len) \
+        fprintf((c)->file, "%.*s", (int)(len), (value))
 #else
 #   define PRINT_TYPE LexerString*
 #   define PRINT_TYPE_NAME String
@@ -43,6 +45,8 @@
         )((c)->file, (c)->ctx, (value))
 #   define PRINT_ESCAPE(c, value, len) \
         LexerStringAddEscapedString((c)->file, (c)->ctx, (value), (len))
+#   define PRINT_SLICE(c, value, len) \
+        LexerStringAddSlice((c)->file, (c)->ctx, (value), (len))
 #endif
 
 #define JOIN(a,b) JOIN_(a,b)
@@ -192,13 +196,14 @@ static LexerTokenType couldBeInNumber[] = {
 // This function is not perfectly accurate, todo in the future
 // Does not deal with TOKEN_INTEGER_L or TOKEN_FLOATING_L, assumes no spacing
 // - todo when integer/floating parsing is implemented
-bool TokenPasteAvoidance(LexerToken* left, LexerToken* right) {
+bool TokenPasteAvoidance(TranslationContext* ctx, LexerToken* left, LexerToken* right) {
     if(left->type == TOKEN_PP_NUMBER && right->type == TOKEN_PUNC_DOT) {
         return true;
     }
 
-    if(left->type == TOKEN_PP_NUMBER && left->data.string.count > 0) {
-        char c = left->data.string.buffer[left->data.string.count-1];
+    LexerString* number = left->type == TOKEN_PP_NUMBER ? TokenString(ctx, left) : NULL;
+    if(number != NULL && number->count > 0) {
+        char c = number->buffer[number->count-1];
         if(c == 'e' || c == 'E' || c == 'p' || c == 'P') {
             for(unsigned int i = 0; i < sizeof(couldBeInNumber)/sizeof(LexerTokenType); i++) {
                 if(couldBeInNumber[i] == right->type) return true;
@@ -212,7 +217,7 @@ bool TokenPasteAvoidance(LexerToken* left, LexerToken* right) {
             return false;
         }
 
-        return right->data.string.type != STRING_NONE;
+        return TokenString(ctx, right)->type != STRING_NONE;
     }
 
     bool leftIncluded = false;
@@ -254,10 +259,11 @@ static void TokenPrintCtxInit(TokenPrintCtx* ctx, PRINT_TYPE file, TranslationCo
 static void TokenPrint(TokenPrintCtx* ctx, LexerToken* tok) {
 #if PRINT_NUMERIC_ID == 0
     if(ctx->debugPrint) {
-        if(tok->loc) {
-            PRINT(ctx, tok->loc->line);
+        if(tok->loc.offset) {
+            SourcePosition pos = SourceLocationPosition(ctx->ctx, tok->loc);
+            PRINT(ctx, pos.line);
             PRINT(ctx, ":");
-            PRINT(ctx, tok->loc->column);
+            PRINT(ctx, pos.column);
         } else {
             PRINT(ctx, "<no location>");
         }
@@ -266,13 +272,13 @@ static void TokenPrint(TokenPrintCtx* ctx, LexerToken* tok) {
         }
         if(tok->whitespaceBefore) {
             PRINT(ctx, " white=");
-            PRINT(ctx, tok->indent);
+            PRINT(ctx, (size_t)tok->indent);
         }
         PRINT(ctx, " token=");
-        PRINT(ctx, tok->type);
+        PRINT(ctx, (LexerTokenType)tok->type);
         PRINT(ctx, " data(");
-        if(tok->loc) {
-            PRINT(ctx, tok->loc->length);
+        if(tok->loc.offset) {
+            PRINT(ctx, (size_t)tok->loc.length);
         } else {
             PRINT(ctx, "<no length>");
         }
@@ -290,7 +296,7 @@ static void TokenPrint(TokenPrintCtx* ctx, LexerToken* tok) {
             }
             printedWhitespace |= tok->indent > 0;
         }
-        if(!printedWhitespace && TokenPasteAvoidance(&ctx->previousPrinted, tok)) {
+        if(!printedWhitespace && TokenPasteAvoidance(ctx->ctx, &ctx->previousPrinted, tok)) {
             PRINT(ctx, " ");
         }
     }
@@ -302,6 +308,7 @@ static void TokenPrint(TokenPrintCtx* ctx, LexerToken* tok) {
     }
 #endif
 
+    LexerString* str = TokenHasString(tok->type) ? TokenString(ctx->ctx, tok) : NULL;
     switch(tok->type) {
         case TOKEN_KW_AUTO: PRINT(ctx, "auto"); break;
         case TOKEN_KW_BREAK: PRINT(ctx, "break"); break;
@@ -403,39 +410,40 @@ static void TokenPrint(TokenPrintCtx* ctx, LexerToken* tok) {
         case TOKEN_PUNC_PERCENT_COLON_PERCENT_COLON: PRINT(ctx, "%:%:"); break;
         case TOKEN_HEADER_NAME:
             PRINT(ctx, "\"");
-            PRINT(ctx, tok->data.string.buffer);
+            PRINT(ctx, str->buffer);
             PRINT(ctx, "\""); break;
         case TOKEN_SYS_HEADER_NAME:
             PRINT(ctx, "<");
-            PRINT(ctx, tok->data.string.buffer);
+            PRINT(ctx, str->buffer);
             PRINT(ctx, ">"); break;
-        case TOKEN_PP_NUMBER: PRINT(ctx, tok->data.string.buffer); break;
-        case TOKEN_IDENTIFIER_L: PRINT(ctx, tok->data.node->name.data.string.buffer); break;
-        case TOKEN_INTEGER_L: PRINT(ctx, tok->data.integer); break;
-        case TOKEN_FLOATING_L: PRINT(ctx, tok->data.floating); break;
+        case TOKEN_PP_NUMBER:
+            PRINT_SLICE(ctx, str->buffer, str->count); break;
+        case TOKEN_IDENTIFIER_L: PRINT(ctx, TokenNode(ctx->ctx, tok)->name.buffer); break;
+        case TOKEN_INTEGER_L: PRINT(ctx, TokenValue(ctx->ctx, tok)->integer); break;
+        case TOKEN_FLOATING_L: PRINT(ctx, TokenValue(ctx->ctx, tok)->floating); break;
         case TOKEN_CHARACTER_L:
-            StringTypePrint(tok->data.string.type, ctx);
+            StringTypePrint(str->type, ctx);
             PRINT(ctx, "\'");
-            PRINT_ESCAPE(ctx, tok->data.string.buffer, tok->data.string.count);
+            PRINT_ESCAPE(ctx, str->buffer, str->count);
             PRINT(ctx, "\'"); break;
         case TOKEN_STRING_L:
-            StringTypePrint(tok->data.string.type, ctx);
+            StringTypePrint(str->type, ctx);
 #if PRINT_NUMERIC_ID == 0
             PRINT(ctx, "\"");
-            PRINT_ESCAPE(ctx, tok->data.string.buffer, tok->data.string.count);
+            PRINT_ESCAPE(ctx, str->buffer, str->count);
             PRINT(ctx, "\"");
 #elif PRINT_NUMERIC_ID == 1
             PRINT(ctx, "\\\"");
-            PRINT_ESCAPE(ctx, tok->data.string.buffer, tok->data.string.count);
+            PRINT_ESCAPE(ctx, str->buffer, str->count);
             PRINT(ctx, "\\\"");
 #endif
             break;
         case TOKEN_MACRO_ARG:
             PRINT(ctx, "argument(");
-            PRINT(ctx, tok->data.integer);
+            PRINT(ctx, (size_t)tok->data);
             PRINT(ctx, ")");
             break;
-        case TOKEN_UNKNOWN_L: PRINT(ctx, tok->data.character); break;
+        case TOKEN_UNKNOWN_L: PRINT(ctx, (char)tok->data); break;
         case TOKEN_PLACEHOLDER_L: PRINT(ctx, "placeholder"); break;
         case TOKEN_ERROR_L: PRINT(ctx, "error token"); break;
         case TOKEN_EOF_L: break;
@@ -452,6 +460,7 @@ static void TokenPrint(TokenPrintCtx* ctx, LexerToken* tok) {
 #undef PRINT_NUMERIC_ID
 #undef PRINT
 #undef PRINT_ESCAPE
+#undef PRINT_SLICE
 #undef JOIN
 #undef JOIN_
 #undef StringTypePrint
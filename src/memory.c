@@ -12,7 +12,9 @@
 // only place memory is stored in the program
 // is not freed, assumes enough memory for all
 // alocations to exist
-static Arena arena;
+// each thread has its own, see ThreadStart, so allocating never needs a lock,
+// memory stays valid after the thread that allocated it exits
+static _Thread_local Arena arena;
 
 // increments pointer until it is aligned to align
 // align (bytes) must be a power of 2
@@ -124,6 +126,12 @@ void memoryPoolAlloc(MemoryPool* pool, size_t pageSize) {
     pool->bytesUsed = 0;
 }
 
+void memoryPoolFree(MemoryPool* pool) {
+    VirtualFree(pool->memory, 0, MEM_RELEASE);
+    pool->memory = NULL;
+    pool->bytesUsed = 0;
+}
+
 // how memory array works:
 // It allocates a memory block (No. 1) of size pageSize at start.  The first
 // MEMORY_ARRAY_INDEX_SIZE bytes of that block act as a lookup table.  The first
@@ -26,7 +26,7 @@ typedef struct Arena {
     size_t align;
 } Arena;
 
-// initialise the arena
+// initialise the arena, for the thread calling it
 void ArenaInit();
 
 // allocate memory in arena with default alignment
@@ -148,6 +148,9 @@ typedef struct MemoryArray {
 // create a new memory pool
 void memoryPoolAlloc(MemoryPool* pool, size_t pageSize);
 
+// release all of a pool's memory, including every array allocated from it
+void memoryPoolFree(MemoryPool* pool);
+
 // create a new memory array from a pool
 void memoryArrayAlloc(MemoryArray* arr, MemoryPool* pool, size_t pageSize, size_t itemSize);
 
@@ -0,0 +1,557 @@
+#include "pch.h"
+
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include "lex.h"
+
+// The file starts with a PchHeader, followed by each of its sections.  All
+// records are made of uint32_t, so every section stays 4 byte aligned.
+
+// changed whenever the layout of the file changes
+#define PCH_MAGIC "MCCPCH2"
+
+// an offset or index that does not refer to anything
+#define PCH_NONE UINT32_MAX
+
+typedef struct PchHeader {
+    char magic[8];
+
+    // of the whole file, so truncated files are found
+    uint32_t size;
+
+    uint32_t nameCount;
+    uint32_t nameOffset;
+    uint32_t macroCount;
+    uint32_t macroOffset;
+    uint32_t tokenCount;
+    uint32_t tokenOffset;
+    uint32_t guardCount;
+    uint32_t guardOffset;
+    uint32_t textLength;
+    uint32_t textOffset;
+} PchHeader;
+
+// an identifier, with its spelling in the text section
+typedef struct PchName {
+    uint32_t text;
+    uint32_t length;
+} PchName;
+
+typedef struct PchMacro {
+    uint32_t name;
+    uint32_t type;
+    int32_t variadacArgument;
+
+    // the tokens are stored together, parameters first for function macros
+    uint32_t firstToken;
+    uint32_t argumentCount;
+    uint32_t replacementCount;
+} PchMacro;
+
+#define PCH_START_OF_LINE 0x01
+#define PCH_RENDER_START_OF_LINE 0x02
+#define PCH_WHITESPACE_BEFORE 0x04
+#define PCH_MACRO_EXPANDED 0x08
+#define PCH_ATTEMPT_EXPANSION 0x10
+#define PCH_HAS_ESCAPES 0x20
+
+typedef struct PchToken {
+    uint32_t type;
+    uint32_t flags;
+    uint32_t indent;
+
+    // the source text of the token, required by ##, or PCH_NONE if the
+    // token did not have a location
+    uint32_t spelling;
+    uint32_t spellingLength;
+
+    // a name index for identifiers, a text offset for strings, otherwise
+    // the token's integer or character value
+    uint32_t data;
+    uint32_t dataLength;
+    uint32_t stringType;
+} PchToken;
+
+typedef struct PchGuard {
+    // '\0' terminated resolved path of the file
+    uint32_t path;
+    uint32_t pathLength;
+
+    // name index of the guard macro, or PCH_NONE
+    uint32_t macro;
+    uint32_t once;
+} PchGuard;
+
+// ------- //
+// Writing //
+// ------- //
+
+typedef struct PchWriter {
+    ARRAY_DEFINE(PchName, name);
+    ARRAY_DEFINE(PchMacro, macro);
+    ARRAY_DEFINE(PchToken, token);
+    ARRAY_DEFINE(PchGuard, guard);
+    ARRAY_DEFINE(char, text);
+
+    // name index of each node, by node id, or PCH_NONE if not written yet
+    uint32_t* nameIndex;
+
+    TranslationContext* ctx;
+} PchWriter;
+
+// add a '\0' terminated copy of a string to the text section
+static uint32_t pchAddText(PchWriter* w, const char* str, size_t length) {
+    uint32_t offset = w->textCount;
+    for(size_t i = 0; i < length; i++) {
+        ARRAY_PUSH(*w, text, str[i]);
+    }
+    ARRAY_PUSH(*w, text, (char)'\0');
+    return offset;
+}
+
+static uint32_t pchAddName(PchWriter* w, HashNode* node) {
+    if(w->nameIndex[node->id] != PCH_NONE) {
+        return w->nameIndex[node->id];
+    }
+
+    LexerString* name = &node->name;
+    PchName out = {
+        .text = pchAddText(w, name->buffer, name->count),
+        .length = name->count,
+    };
+    w->nameIndex[node->id] = w->nameCount;
+    ARRAY_PUSH(*w, name, out);
+    return w->nameIndex[node->id];
+}
+
+static void pchAddToken(PchWriter* w, LexerToken* tok) {
+    PchToken out = {
+        .type = tok->type,
+        .flags = (tok->isStartOfLine ? PCH_START_OF_LINE : 0) |
+            (tok->renderStartOfLine ? PCH_RENDER_START_OF_LINE : 0) |
+            (tok->whitespaceBefore ? PCH_WHITESPACE_BEFORE : 0) |
+            (tok->isMacroExpanded ? PCH_MACRO_EXPANDED : 0) |
+            (tok->hasEscapes ? PCH_HAS_ESCAPES : 0),
+        .indent = tok->indent,
+        .spelling = PCH_NONE,
+        .spellingLength = 0,
+        .data = 0,
+        .dataLength = 0,
+        .stringType = 0,
+    };
+
+    if(tok->type == TOKEN_IDENTIFIER_L) {
+        out.data = pchAddName(w, TokenNode(w->ctx, tok));
+        if(tok->attemptExpansion) out.flags |= PCH_ATTEMPT_EXPANSION;
+    } else if(tok->type == TOKEN_MACRO_ARG || tok->type == TOKEN_UNKNOWN_L) {
+        out.data = tok->data;
+    } else if(tok->type == TOKEN_INTEGER_L) {
+        out.data = TokenValue(w->ctx, tok)->integer;
+    } else if(TokenHasString(tok->type)) {
+        LexerString* str = TokenString(w->ctx, tok);
+        out.data = pchAddText(w, str->buffer, str->count);
+        out.dataLength = str->count;
+        out.stringType = str->type;
+    }
+
+    if(tok->loc.offset != 0) {
+        const char* spelling = (const char*)SourceLocationText(w->ctx, tok->loc);
+        out.spellingLength = tok->loc.length;
+
+        // most identifiers are spelt the same as their name
+        PchName* name = tok->type == TOKEN_IDENTIFIER_L ? &w->names[out.data] : NULL;
+        if(name != NULL && name->length == tok->loc.length &&
+            memcmp(&w->texts[name->text], spelling, name->length) == 0) {
+            out.spelling = name->text;
+        } else {
+            out.spelling = pchAddText(w, spelling, tok->loc.length);
+        }
+    }
+
+    ARRAY_PUSH(*w, token, out);
+}
+
+static void pchAddMacro(PchWriter* w, HashNode* node) {
+    PchMacro out = {
+        .name = pchAddName(w, node),
+        .type = node->type,
+        .variadacArgument = -1,
+        .firstToken = w->tokenCount,
+        .argumentCount = 0,
+        .replacementCount = 0,
+    };
+
+    if(node->type == NODE_MACRO_OBJECT) {
+        for(size_t i = 0; i < node->as.object.itemCount; i++) {
+            pchAddToken(w, &node->as.object.items[i]);
+        }
+        out.replacementCount = node->as.object.itemCount;
+    } else {
+        FnMacro* fn = &node->as.function;
+        for(size_t i = 0; i < fn->argumentCount; i++) {
+            pchAddToken(w, &fn->arguments[i]);
+        }
+        for(size_t i = 0; i < fn->replacementCount; i++) {
+            pchAddToken(w, &fn->replacements[i]);
+        }
+        out.variadacArgument = fn->variadacArgument;
+        out.argumentCount = fn->argumentCount;
+        out.replacementCount = fn->replacementCount;
+    }
+
+    ARRAY_PUSH(*w, macro, out);
+}
+
+static bool pchWriteSection(FILE* f, const void* data, size_t size) {
+    return size == 0 || fwrite(data, size, 1, f) == 1;
+}
+
+bool PchWrite(TranslationContext* ctx, const char* path) {
+    if(ctx->idents == NULL) {
+        fprintf(stderr, "Error: precompiled headers can only be created when "
+            "running phase 4 or later\n");
+        return false;
+    }
+
+    PchWriter w;
+    ARRAY_ALLOC(PchName, w, name);
+    ARRAY_ALLOC(PchMacro, w, macro);
+    ARRAY_ALLOC(PchToken, w, token);
+    ARRAY_ALLOC(PchGuard, w, guard);
+    ARRAY_ALLOC(char, w, text);
+    w.ctx = ctx;
+
+    IdentTable* idents = ctx->idents;
+
+    // lexing a replacement list can add names, so is done before sizing the
+    // name index, going through the nodes by id as the table can be resized
+    for(size_t i = IDENT_NONE + 1; i < idents->nodeCount; i++) {
+        HashNode* node = idents->nodes[i];
+        if(node->type != NODE_MACRO_OBJECT && node->type != NODE_MACRO_FUNCTION) continue;
+        MacroLexReplacement(ctx, node);
+    }
+
+    w.nameIndex = ArenaAlloc(sizeof(uint32_t) * idents->nodeCount);
+    for(size_t i = 0; i < idents->nodeCount; i++) {
+        w.nameIndex[i] = PCH_NONE;
+    }
+
+    // only macros from #define, the predefined macros are created by every
+    // translation unit anyway
+    for(size_t i = 0; i < idents->entryCapacity; i++) {
+        HashNode* node = idents->entrys[i].node;
+        if(node == NULL) continue;
+        if(node->type != NODE_MACRO_OBJECT && node->type != NODE_MACRO_FUNCTION) continue;
+        pchAddMacro(&w, node);
+    }
+
+    Table* guards = &ctx->includeGuards;
+    for(size_t i = 0; i < guards->entryCapacity; i++) {
+        Entry* entry = &guards->entrys[i];
+        if(entry->key.key == NULL) continue;
+
+        IncludeGuard* guard = entry->value;
+        if(guard->macro == NULL && !guard->once) continue;
+
+        PchGuard out = {
+            .path = pchAddText(&w, entry->key.key, entry->key.length),
+            .pathLength = entry->key.length,
+            .macro = guard->macro == NULL ? PCH_NONE : pchAddName(&w, guard->macro),
+            .once = guard->once,
+        };
+        ARRAY_PUSH(w, guard, out);
+    }
+
+    PchHeader header = {
+        .magic = PCH_MAGIC,
+        .nameCount = w.nameCount,
+        .macroCount = w.macroCount,
+        .tokenCount = w.tokenCount,
+        .guardCount = w.guardCount,
+    };
+    header.nameOffset = sizeof(header);
+    header.macroOffset = header.nameOffset + sizeof(PchName) * w.nameCount;
+    header.tokenOffset = header.macroOffset + sizeof(PchMacro) * w.macroCount;
+    header.guardOffset = header.tokenOffset + sizeof(PchToken) * w.tokenCount;
+    header.textOffset = header.guardOffset + sizeof(PchGuard) * w.guardCount;
+
+    // files that are an exact number of pages cannot be mapped with a '\0'
+    // after them, see mapFileLen, so are made one byte longer
+    if(w.textCount == 0 || (header.textOffset + w.textCount) % 4096 == 0) {
+        ARRAY_PUSH(w, text, (char)'\0');
+    }
+    header.textLength = w.textCount;
+    header.size = header.textOffset + header.textLength;
+
+    FILE* f = fopen(path, "wb");
+    if(f == NULL) {
+        fprintf(stderr, "Error: could not create precompiled header %s\n", path);
+        return false;
+    }
+
+    bool ok = pchWriteSection(f, &header, sizeof(header)) &&
+        pchWriteSection(f, w.names, sizeof(PchName) * w.nameCount) &&
+        pchWriteSection(f, w.macros, sizeof(PchMacro) * w.macroCount) &&
+        pchWriteSection(f, w.tokens, sizeof(PchToken) * w.tokenCount) &&
+        pchWriteSection(f, w.guards, sizeof(PchGuard) * w.guardCount) &&
+        pchWriteSection(f, w.texts, w.textCount);
+    ok = fclose(f) == 0 && ok;
+
+    if(!ok) {
+        fprintf(stderr, "Error: could not write precompiled header %s\n", path);
+    }
+    return ok;
+}
+
+// ------- //
+// Loading //
+// ------- //
+// The whole file is checked by PchOpen, so that a corrupt file is found
+// before any translation unit has used part of it, and loading it into
+// each translation unit cannot fail.
+
+typedef struct PchReader {
+    const PchHeader* header;
+    const PchName* names;
+    const PchMacro* macros;
+    const PchToken* tokens;
+    const PchGuard* guards;
+    const char* text;
+
+    // node for each name, looked up as needed
+    HashNode** nodes;
+
+    TranslationContext* ctx;
+} PchReader;
+
+static void pchReaderInit(PchReader* r, const char* data) {
+    const PchHeader* header = (const PchHeader*)data;
+    r->header = header;
+    r->names = (const PchName*)(data + header->nameOffset);
+    r->macros = (const PchMacro*)(data + header->macroOffset);
+    r->tokens = (const PchToken*)(data + header->tokenOffset);
+    r->guards = (const PchGuard*)(data + header->guardOffset);
+    r->text = data + header->textOffset;
+    r->nodes = NULL;
+    r->ctx = NULL;
+}
+
+// is a section inside of the file
+static bool pchSectionValid(const PchHeader* header, uint32_t offset, uint32_t count, size_t size) {
+    return offset % sizeof(uint32_t) == 0 && offset <= header->size &&
+        (uint64_t)count * size <= header->size - offset;
+}
+
+static bool pchHeaderValid(const PchHeader* header, size_t length) {
+    if(length < sizeof(*header) || memcmp(header->magic, PCH_MAGIC, sizeof(header->magic)) != 0) {
+        return false;
+    }
+
+    return header->size == length &&
+        pchSectionValid(header, header->nameOffset, header->nameCount, sizeof(PchName)) &&
+        pchSectionValid(header, header->macroOffset, header->macroCount, sizeof(PchMacro)) &&
+        pchSectionValid(header, header->tokenOffset, header->tokenCount, sizeof(PchToken)) &&
+        pchSectionValid(header, header->guardOffset, header->guardCount, sizeof(PchGuard)) &&
+        header->textLength > 0 && (uint64_t)header->textOffset + header->textLength == header->size;
+}
+
+// is a '\0' terminated string inside the text section
+static bool pchTextValid(PchReader* r, uint32_t offset, uint32_t length) {
+    return offset < r->header->textLength && length < r->header->textLength - offset &&
+        r->text[offset + length] == '\0';
+}
+
+static bool pchNameValid(PchReader* r, uint32_t index) {
+    return index < r->header->nameCount;
+}
+
+static bool pchTokenValid(PchReader* r, const PchToken* tok) {
+    if(tok->type > TOKEN_EOF_L) return false;
+
+    if(tok->spelling != PCH_NONE && !pchTextValid(r, tok->spelling, tok->spellingLength)) {
+        return false;
+    }
+
+    if(tok->type == TOKEN_IDENTIFIER_L) {
+        return pchNameValid(r, tok->data);
+    } else if(TokenHasString(tok->type)) {
+        return pchTextValid(r, tok->data, tok->dataLength);
+    }
+    return true;
+}
+
+static bool pchMacroValid(PchReader* r, const PchMacro* macro) {
+    if(!pchNameValid(r, macro->name)) return false;
+    if(macro->type != NODE_MACRO_OBJECT && macro->type != NODE_MACRO_FUNCTION) return false;
+
+    uint32_t total = macro->argumentCount + macro->replacementCount;
+    if(total < macro->argumentCount) return false;
+    if(macro->firstToken > r->header->tokenCount || total > r->header->tokenCount - macro->firstToken) {
+        return false;
+    }
+
+    for(uint32_t i = 0; i < total; i++) {
+        if(!pchTokenValid(r, &r->tokens[macro->firstToken + i])) return false;
+    }
+    return true;
+}
+
+static bool pchGuardValid(PchReader* r, const PchGuard* guard) {
+    return pchTextValid(r, guard->path, guard->pathLength) &&
+        (guard->macro == PCH_NONE || pchNameValid(r, guard->macro));
+}
+
+static bool pchRecordsValid(PchReader* r) {
+    for(uint32_t i = 0; i < r->header->nameCount; i++) {
+        if(!pchTextValid(r, r->names[i].text, r->names[i].length)) return false;
+    }
+    for(uint32_t i = 0; i < r->header->macroCount; i++) {
+        if(!pchMacroValid(r, &r->macros[i])) return false;
+    }
+    for(uint32_t i = 0; i < r->header->guardCount; i++) {
+        if(!pchGuardValid(r, &r->guards[i])) return false;
+    }
+    return true;
+}
+
+bool PchOpen(TranslationContext* ctx, const char* path) {
+    size_t length;
+    const char* data = mapFileLen(path, &length);
+    if(!pchHeaderValid((const PchHeader*)data, length)) {
+        fprintf(stderr, "Error: %s is not a precompiled header created by "
+            "this version of mcc\n", path);
+        return false;
+    }
+
+    PchReader r;
+    pchReaderInit(&r, data);
+    if(!pchRecordsValid(&r)) {
+        fprintf(stderr, "Error: precompiled header %s is corrupt\n", path);
+        return false;
+    }
+
+    ctx->pchData = data;
+    return true;
+}
+
+static HashNode* pchNode(PchReader* r, uint32_t index) {
+    if(r->nodes[index] == NULL) {
+        const PchName* name = &r->names[index];
+        const char* text = &r->text[name->text];
+        r->nodes[index] = IdentTableGet(r->ctx->idents, r->ctx, text, name->length,
+            IdentHash(text, name->length));
+    }
+    return r->nodes[index];
+}
+
+static void pchReadToken(PchReader* r, const PchToken* in, LexerToken* out) {
+    *out = (LexerToken) {
+        .type = in->type,
+        .isStartOfLine = (in->flags & PCH_START_OF_LINE) != 0,
+        .renderStartOfLine = (in->flags & PCH_RENDER_START_OF_LINE) != 0,
+        .whitespaceBefore = (in->flags & PCH_WHITESPACE_BEFORE) != 0,
+        .isMacroExpanded = (in->flags & PCH_MACRO_EXPANDED) != 0,
+        .attemptExpansion = (in->flags & PCH_ATTEMPT_EXPANSION) != 0,
+        .hasEscapes = (in->flags & PCH_HAS_ESCAPES) != 0,
+        .loc = {0},
+    };
+    TokenSetIndent(out, in->indent);
+
+    if(in->spelling != PCH_NONE) {
+        // the text section is added as a source file, so the spelling
+        // has a location like any other token
+        SourceFile* file = r->ctx->pchFile;
+        out->loc.offset = file->start + in->spelling;
+        out->loc.length = in->spellingLength;
+    }
+
+    if(in->type == TOKEN_IDENTIFIER_L) {
+        TokenSetNode(out, pchNode(r, in->data));
+    } else if(in->type == TOKEN_MACRO_ARG || in->type == TOKEN_UNKNOWN_L) {
+        out->data = in->data;
+    } else if(in->type == TOKEN_INTEGER_L) {
+        TokenSetInteger(r->ctx, out, in->data);
+    } else if(TokenHasString(in->type)) {
+        // strings are used from the mapping, without being copied
+        TokenSetString(r->ctx, out, (LexerString) {
+            .buffer = (char*)&r->text[in->data],
+            .capacity = 0,
+            .count = in->dataLength,
+            .type = in->stringType,
+        });
+    }
+}
+
+static void pchReadMacro(PchReader* r, const PchMacro* in) {
+    HashNode* node = pchNode(r, in->name);
+
+    // the tokens are read into one exactly sized array, as the macro's
+    // lists are never added to after its definition
+    uint32_t total = in->argumentCount + in->replacementCount;
+    LexerToken* tokens = ArenaAlloc(sizeof(LexerToken) * total);
+    for(uint32_t i = 0; i < total; i++) {
+        pchReadToken(r, &r->tokens[in->firstToken + i], &tokens[i]);
+    }
+
+    if(in->type == NODE_MACRO_OBJECT) {
+        TokenList* list = &node->as.object;
+        list->items = tokens;
+        list->itemCount = in->replacementCount;
+        list->itemCapacity = in->replacementCount;
+        list->itemElementSize = sizeof(LexerToken);
+    } else {
+        FnMacro* fn = &node->as.function;
+        fn->arguments = tokens;
+        fn->argumentCount = in->argumentCount;
+        fn->argumentCapacity = in->argumentCount;
+        fn->argumentElementSize = sizeof(LexerToken);
+        fn->replacements = tokens + in->argumentCount;
+        fn->replacementCount = in->replacementCount;
+        fn->replacementCapacity = in->replacementCount;
+        fn->replacementElementSize = sizeof(LexerToken);
+        fn->variadacArgument = in->variadacArgument;
+    }
+
+    if(node->usedByExpansion) {
+        r->ctx->macroGeneration++;
+    }
+    node->type = in->type;
+    node->lazyReplacement = (SourceLocation) {
+        .offset = 0,
+        .length = 0,
+    };
+}
+
+static void pchReadGuard(PchReader* r, const PchGuard* in) {
+    IncludeGuard* guard = ArenaAlloc(sizeof(*guard));
+    guard->macro = in->macro == PCH_NONE ? NULL : pchNode(r, in->macro);
+    guard->once = in->once != 0;
+
+    TABLE_SET(r->ctx->includeGuards, &r->text[in->path], in->pathLength, guard);
+}
+
+void PchLoad(TranslationContext* ctx) {
+    PchReader r;
+    pchReaderInit(&r, ctx->pchData);
+    r.ctx = ctx;
+
+    // added once for each translation unit, as each has its own locations,
+    // see TranslationContextStartUnit
+    if(ctx->pchFile == NULL) {
+        ctx->pchFile = TranslationContextAddFile(ctx, (const unsigned char*)ctx->pchUse,
+            (const unsigned char*)r.text, r.header->textLength);
+    }
+
+    r.nodes = ArenaAlloc(sizeof(HashNode*) * r.header->nameCount);
+    for(uint32_t i = 0; i < r.header->nameCount; i++) {
+        r.nodes[i] = NULL;
+    }
+
+    for(uint32_t i = 0; i < r.header->macroCount; i++) {
+        pchReadMacro(&r, &r.macros[i]);
+    }
+    for(uint32_t i = 0; i < r.header->guardCount; i++) {
+        pchReadGuard(&r, &r.guards[i]);
+    }
+}
@@ -0,0 +1,26 @@
+#ifndef PCH_H
+#define PCH_H
+
+#include <stdbool.h>
+
+// Precompiled headers, saving the macros defined and the include guards
+// found by one translation unit, so another can start with them instead of
+// preprocessing the same headers again.  The file is made of fixed size
+// records that refer to each other by index and to a text section by
+// offset, so it can be memory mapped and used without being parsed.
+
+struct TranslationContext;
+
+// write the macro definitions and include guards of the translation unit
+// that was just preprocessed, returns false if the file could not be written
+bool PchWrite(struct TranslationContext* ctx, const char* path);
+
+// map a precompiled header and check all of it, so it can be used by every
+// translation unit, returns false if it is not valid
+bool PchOpen(struct TranslationContext* ctx, const char* path);
+
+// define the macros and add the include guards stored in the precompiled
+// header opened by PchOpen to the current translation unit
+void PchLoad(struct TranslationContext* ctx);
+
+#endif
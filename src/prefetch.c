@@ -0,0 +1,292 @@
+#include "prefetch.h"
+
+#include <string.h>
+#include "file.h"
+#include "symbolTable.h"
+#include "thread.h"
+
+// how many files can wait to be read, requests are dropped after that
+#define PREFETCH_QUEUE_SIZE 64
+
+typedef enum PrefetchState {
+    // in the queue, not read yet
+    PREFETCH_QUEUED,
+
+    // being read by the thread, or by PrefetcherReadFile
+    PREFETCH_READING,
+
+    // the contents have been read, but the file could still be in the queue
+    // for its includes to be found
+    PREFETCH_READ,
+} PrefetchState;
+
+typedef struct PrefetchFile {
+    const char* fileName;
+    PrefetchState state;
+
+    const char* source;
+    size_t length;
+} PrefetchFile;
+
+struct Prefetcher {
+    // everything below is only used while holding lock, apart from search
+    ThreadMutex lock;
+
+    // woken when the queue is added to, or the thread should stop
+    ThreadCondition queueChanged;
+
+    // woken when a file has finished being read
+    ThreadCondition fileRead;
+
+    // PrefetchFile* by file name, for every file requested
+    Table files;
+
+    // ring buffer of files that need reading, or their includes finding
+    PrefetchFile* queue[PREFETCH_QUEUE_SIZE];
+    size_t queueStart;
+    size_t queueCount;
+
+    bool stopping;
+    Thread thread;
+
+    // only used by the thread, as searching caches results
+    const char** includePaths;
+    size_t includeCount;
+    IncludeSearchPath search;
+
+    // statistics, files that were already read when used, that were being
+    // read, and that had not been read yet
+    size_t readyCount;
+    size_t waitCount;
+    size_t missCount;
+};
+
+// add a file to the queue, returns false if it is full, needs the lock
+static bool prefetchPush(Prefetcher* prefetch, PrefetchFile* file) {
+    if(prefetch->queueCount == PREFETCH_QUEUE_SIZE) {
+        return false;
+    }
+
+    size_t index = (prefetch->queueStart + prefetch->queueCount) % PREFETCH_QUEUE_SIZE;
+    prefetch->queue[index] = file;
+    prefetch->queueCount++;
+    ThreadConditionWakeAll(prefetch->queueChanged);
+    return true;
+}
+
+// queue a file to be read, if it has not been seen before, needs the lock
+static void prefetchRequest(Prefetcher* prefetch, const char* fileName) {
+    size_t length = strlen(fileName);
+    if(tableHas(&prefetch->files, fileName, length)) {
+        return;
+    }
+
+    PrefetchFile* file = ArenaAlloc(sizeof(*file));
+    file->fileName = fileName;
+    file->state = PREFETCH_QUEUED;
+    file->source = NULL;
+    file->length = 0;
+
+    // if it cannot be queued, it is read when it is used instead
+    if(prefetchPush(prefetch, file)) {
+        TABLE_SET(prefetch->files, fileName, length, file);
+    }
+}
+
+// Queue the files named by the #include lines in a file.  Comments, strings
+// and conditional directives are not looked at, as a file that is read but
+// never used only costs the time taken to read it.
+static void prefetchFindIncludes(Prefetcher* prefetch, const char* source, size_t length) {
+    const char* end = source + length;
+    const char* line = source;
+
+    while(line < end) {
+        const char* lineEnd = memchr(line, '\n', end - line);
+        if(lineEnd == NULL) lineEnd = end;
+
+        const char* c = line;
+        line = lineEnd + 1;
+
+        while(c < lineEnd && (*c == ' ' || *c == '\t')) c++;
+        if(c == lineEnd || *c != '#') continue;
+        c++;
+        while(c < lineEnd && (*c == ' ' || *c == '\t')) c++;
+
+        if((size_t)(lineEnd - c) < 7 || memcmp(c, "include", 7) != 0) continue;
+        c += 7;
+        while(c < lineEnd && (*c == ' ' || *c == '\t')) c++;
+        if(c == lineEnd || (*c != '"' && *c != '<')) continue;
+
+        bool isUser = *c == '"';
+        const char* nameStart = c + 1;
+        const char* nameEnd = memchr(nameStart, isUser ? '"' : '>', lineEnd - nameStart);
+        if(nameEnd == NULL) continue;
+
+        size_t nameLength = nameEnd - nameStart;
+        char* name = ArenaAlloc(nameLength + 1);
+        memcpy(name, nameStart, nameLength);
+        name[nameLength] = '\0';
+
+        IncludeSearchState state = {0};
+        const char* fileName;
+        if(isUser) {
+            fileName = IncludeSearchPathFindUser(&state, &prefetch->search, name);
+        } else {
+            fileName = IncludeSearchPathFindSys(&state, &prefetch->search, name);
+        }
+        if(fileName == NULL) continue;
+
+        ThreadMutexLock(prefetch->lock);
+        prefetchRequest(prefetch, fileName);
+        ThreadMutexUnlock(prefetch->lock);
+    }
+}
+
+static void prefetchThread(void* voidPrefetch) {
+    Prefetcher* prefetch = voidPrefetch;
+
+    IncludeSearchPathInit(&prefetch->search, SYSTEM_MINGW_W64, prefetch->includePaths, prefetch->includeCount);
+
+    ThreadMutexLock(prefetch->lock);
+    while(true) {
+        while(!prefetch->stopping && prefetch->queueCount == 0) {
+            ThreadConditionWait(prefetch->queueChanged, prefetch->lock);
+        }
+        if(prefetch->stopping) break;
+
+        PrefetchFile* file = prefetch->queue[prefetch->queueStart];
+        prefetch->queueStart = (prefetch->queueStart + 1) % PREFETCH_QUEUE_SIZE;
+        prefetch->queueCount--;
+
+        // the file could have been read by PrefetcherReadFile while it
+        // was queued, in which case only its includes are needed
+        while(file->state == PREFETCH_READING) {
+            ThreadConditionWait(prefetch->fileRead, prefetch->lock);
+        }
+        if(file->state == PREFETCH_QUEUED) {
+            file->state = PREFETCH_READING;
+            ThreadMutexUnlock(prefetch->lock);
+
+            size_t length;
+            const char* source = mapFileLen(file->fileName, &length);
+
+            // a mapped file is only read when it is first used, so use every
+            // page now, the sum is only so the reads are not removed
+            volatile unsigned char sum = 0;
+            for(size_t i = 0; i < length; i += 4096) {
+                sum += source[i];
+            }
+            (void)sum;
+
+            ThreadMutexLock(prefetch->lock);
+            file->source = source;
+            file->length = length;
+            file->state = PREFETCH_READ;
+            ThreadConditionWakeAll(prefetch->fileRead);
+        }
+
+        const char* source = file->source;
+        size_t length = file->length;
+        ThreadMutexUnlock(prefetch->lock);
+
+        prefetchFindIncludes(prefetch, source, length);
+
+        ThreadMutexLock(prefetch->lock);
+    }
+    ThreadMutexUnlock(prefetch->lock);
+}
+
+Prefetcher* PrefetcherStart(const char** includePaths, size_t includeCount) {
+    Prefetcher* prefetch = ArenaAlloc(sizeof(*prefetch));
+    prefetch->lock = ThreadMutexCreate();
+    prefetch->queueChanged = ThreadConditionCreate();
+    prefetch->fileRead = ThreadConditionCreate();
+    TABLE_INIT(prefetch->files, PrefetchFile*);
+    prefetch->queueStart = 0;
+    prefetch->queueCount = 0;
+    prefetch->stopping = false;
+    prefetch->includePaths = includePaths;
+    prefetch->includeCount = includeCount;
+    prefetch->readyCount = 0;
+    prefetch->waitCount = 0;
+    prefetch->missCount = 0;
+
+    prefetch->thread = ThreadStart(prefetchThread, prefetch);
+    if(prefetch->thread == NULL) {
+        return NULL;
+    }
+    return prefetch;
+}
+
+void PrefetcherStop(Prefetcher* prefetch) {
+    ThreadMutexLock(prefetch->lock);
+    prefetch->stopping = true;
+    ThreadConditionWakeAll(prefetch->queueChanged);
+    ThreadMutexUnlock(prefetch->lock);
+
+    ThreadJoin(prefetch->thread);
+}
+
+const char* PrefetcherReadFile(Prefetcher* prefetch, const char* fileName, size_t* length) {
+    size_t nameLength = strlen(fileName);
+
+    ThreadMutexLock(prefetch->lock);
+    PrefetchFile* file = tableGet(&prefetch->files, fileName, nameLength);
+
+    if(file != NULL && file->state == PREFETCH_READING) {
+        prefetch->waitCount++;
+        while(file->state == PREFETCH_READING) {
+            ThreadConditionWait(prefetch->fileRead, prefetch->lock);
+        }
+    } else if(file != NULL && file->state == PREFETCH_READ) {
+        prefetch->readyCount++;
+    }
+
+    if(file != NULL && file->state == PREFETCH_READ) {
+        *length = file->length;
+        const char* source = file->source;
+        ThreadMutexUnlock(prefetch->lock);
+        return source;
+    }
+
+    // not read yet, so it is marked as being read here, so the thread does
+    // not read it as well, if it is already queued the thread only finds its
+    // includes once it has been read
+    bool queued = file != NULL;
+    if(!queued) {
+        // the table keeps the key, so it needs its own copy
+        char* name = ArenaAlloc(nameLength + 1);
+        memcpy(name, fileName, nameLength + 1);
+
+        file = ArenaAlloc(sizeof(*file));
+        file->fileName = name;
+        TABLE_SET(prefetch->files, name, nameLength, file);
+    }
+    file->state = PREFETCH_READING;
+    prefetch->missCount++;
+    ThreadMutexUnlock(prefetch->lock);
+
+    // the lock is not held, so the thread can carry on while this is read
+    const char* source = mapFileLen(fileName, length);
+
+    ThreadMutexLock(prefetch->lock);
+    file->source = source;
+    file->length = *length;
+    file->state = PREFETCH_READ;
+    ThreadConditionWakeAll(prefetch->fileRead);
+    if(!queued) {
+        // dropped if the queue is full, as its includes are only a hint
+        prefetchPush(prefetch, file);
+    }
+    ThreadMutexUnlock(prefetch->lock);
+
+    return source;
+}
+
+void PrefetcherAddStats(Prefetcher* prefetch, size_t* ready, size_t* waited, size_t* missed) {
+    ThreadMutexLock(prefetch->lock);
+    *ready += prefetch->readyCount;
+    *waited += prefetch->waitCount;
+    *missed += prefetch->missCount;
+    ThreadMutexUnlock(prefetch->lock);
+}
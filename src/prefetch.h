@@ -0,0 +1,34 @@
+#ifndef PREFETCH_H
+#define PREFETCH_H
+
+#include <stdbool.h>
+#include <stddef.h>
+
+// Reading included files on a background thread, before phase 4 reaches the
+// #include that needs them.  Once a file has been read, its #include lines
+// are found and the files they name are queued to be read next, so most
+// headers are already in memory when they are included.  This is only a
+// hint: files are still used in the order they are included, any file that
+// has not been read yet is read as normal, and requests are dropped if the
+// queue is full.
+
+typedef struct Prefetcher Prefetcher;
+
+// start the background thread, includePaths are the same paths given to
+// IncludeSearchPathInit, so the includes found resolve to the same files
+Prefetcher* PrefetcherStart(const char** includePaths, size_t includeCount);
+
+// wait for the file being read to finish, then stop the thread
+void PrefetcherStop(Prefetcher* prefetch);
+
+// Get the contents of a file, using the copy read by the thread if there is
+// one, otherwise reading it like mapFileLen, then queue the files it
+// includes to be read.
+const char* PrefetcherReadFile(Prefetcher* prefetch, const char* fileName, size_t* length);
+
+// add the number of files that were already read when they were used, that
+// were being read, and that had not been read yet, to the counts given, for
+// the statistics enabled with -print-stats
+void PrefetcherAddStats(Prefetcher* prefetch, size_t* ready, size_t* waited, size_t* missed);
+
+#endif
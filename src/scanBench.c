@@ -0,0 +1,161 @@
+#include "scanBench.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "byteScan.h"
+#include "memory.h"
+
+// Throughput of the searches in byteScan.c at each level they can be
+// limited to, so the vector paths can be compared with the scalar loops
+// they replace.  Each search is given a buffer it has to read to the end,
+// or nearly so, and the fastest of several runs is reported.
+
+typedef struct ScanBench {
+    const char* name;
+
+    // fill the buffer with text the search reads all of
+    void (*fill)(unsigned char* buf, size_t length);
+
+    // run the search over the buffer, returning its result so it can be
+    // checked against the other levels
+    size_t (*run)(const unsigned char* buf, size_t length);
+} ScanBench;
+
+// repeat a pattern over the whole buffer
+static void fillPattern(unsigned char* buf, size_t length, const char* pattern) {
+    size_t patternLength = strlen(pattern);
+    for(size_t i = 0; i < length; i++) {
+        buf[i] = pattern[i % patternLength];
+    }
+}
+
+static void fillText(unsigned char* buf, size_t length) {
+    fillPattern(buf, length, "int identifier = other + 42; // words\t");
+}
+
+static void fillComment(unsigned char* buf, size_t length) {
+    fillPattern(buf, length, " * a comment, with a / and a * in it\n");
+}
+
+static void fillBlank(unsigned char* buf, size_t length) {
+    fillPattern(buf, length, "    \t  \f    \t\v        \t      ");
+}
+
+static void fillLines(unsigned char* buf, size_t length) {
+    fillPattern(buf, length, "int x = 1;\n    return x;\n\n");
+}
+
+static size_t runSpecial(const unsigned char* buf, size_t length) {
+    return scanSpecialBytes(buf, 0, length, false);
+}
+
+static size_t runInvalid(const unsigned char* buf, size_t length) {
+    return scanInvalidBytes(buf, 0, length);
+}
+
+static size_t runCommentEnd(const unsigned char* buf, size_t length) {
+    return scanCommentEnd(buf, 0, length);
+}
+
+static size_t runNewLine(const unsigned char* buf, size_t length) {
+    return scanNewLine(buf, 0, length);
+}
+
+static size_t runWhitespace(const unsigned char* buf, size_t length) {
+    return scanWhitespace(buf, 0, length);
+}
+
+static size_t runCountNewLines(const unsigned char* buf, size_t length) {
+    size_t last = 0;
+    return countNewLines(buf, 0, length, &last) + last;
+}
+
+static ScanBench benches[] = {
+    {"special bytes", fillText, runSpecial},
+    {"invalid utf8", fillText, runInvalid},
+    {"\"*/\" search", fillComment, runCommentEnd},
+    {"new line search", fillText, runNewLine},
+    {"whitespace run", fillBlank, runWhitespace},
+    {"count new lines", fillLines, runCountNewLines},
+};
+
+static const char* levelNames[] = {
+    [SCAN_LEVEL_SCALAR] = "scalar",
+    [SCAN_LEVEL_SSE2] = "sse2",
+    [SCAN_LEVEL_AVX2] = "avx2",
+};
+
+// the fastest time of the runs, in seconds
+static double timeBench(ScanBench* bench, const unsigned char* buf, size_t length,
+    int runs, size_t* result) {
+
+    double best = 0;
+    for(int i = 0; i < runs; i++) {
+        clock_t start = clock();
+        *result = bench->run(buf, length);
+        double time = (double)(clock() - start) / CLOCKS_PER_SEC;
+        if(i == 0 || time < best) best = time;
+    }
+    return best;
+}
+
+int runScanBenchmark(int sizeMiB, int runs) {
+    if(sizeMiB < 1 || runs < 1) {
+        fprintf(stderr, "Error: the benchmark size and run count must be at least 1\n");
+        return EXIT_FAILURE;
+    }
+
+    size_t length = (size_t)sizeMiB * MiB;
+    unsigned char* buf = malloc(length);
+    if(buf == NULL) {
+        fprintf(stderr, "Error: could not allocate %d MiB to benchmark\n", sizeMiB);
+        return EXIT_FAILURE;
+    }
+
+    ByteScanLevel maxLevel = byteScanMaxLevel();
+    bool hadError = false;
+
+    printf("%-20s", "GB/s");
+    for(int level = SCAN_LEVEL_SCALAR; level <= (int)maxLevel; level++) {
+        printf("%10s", levelNames[level]);
+    }
+    printf("\n");
+
+    for(size_t i = 0; i < sizeof(benches) / sizeof(benches[0]); i++) {
+        ScanBench* bench = &benches[i];
+        bench->fill(buf, length);
+        printf("%-20s", bench->name);
+
+        size_t scalarResult = 0;
+        for(int level = SCAN_LEVEL_SCALAR; level <= (int)maxLevel; level++) {
+            byteScanSetLevel(level);
+
+            size_t result;
+            double time = timeBench(bench, buf, length, runs, &result);
+            if(time > 0) {
+                printf("%10.2f", length / time / 1e9);
+            } else {
+                printf("%10s", "-");
+            }
+
+            if(level == SCAN_LEVEL_SCALAR) {
+                scalarResult = result;
+            } else if(result != scalarResult) {
+                hadError = true;
+            }
+        }
+        printf("\n");
+
+        if(hadError) {
+            fprintf(stderr, "Error: %s gave a different result to the scalar "
+                "search\n", bench->name);
+            break;
+        }
+    }
+
+    byteScanSetLevel(maxLevel);
+    free(buf);
+    return hadError ? EXIT_FAILURE : EXIT_SUCCESS;
+}
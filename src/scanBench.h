@@ -0,0 +1,9 @@
+#ifndef SCAN_BENCH_H
+#define SCAN_BENCH_H
+
+// print the throughput of each search in byteScan.h over a buffer of
+// sizeMiB, for the scalar loops and each vector instruction set supported,
+// taking the fastest of runs.  Fails if the levels give different results.
+int runScanBenchmark(int sizeMiB, int runs);
+
+#endif
@@ -27,6 +27,8 @@
 #define stdInFileName "stdin"
 #define outCheckFileName "stdout"
 #define errCheckFileName "stderr"
+#define setupFileName "setup"
+#define setupOutFileName "setupOut.txt"
 
 // Simple? end-to-end tests.
 // note: This most definitely uses the Win32 api, good luck to myself
@@ -384,6 +386,9 @@ static bool createDirectoryFromTest(harContext* ctx, const char* tempPath) {
         if(strcmp((char*)harFile->path, errCheckFileName) == 0) {
             continue;
         }
+        if(strcmp((char*)harFile->path, setupFileName) == 0) {
+            continue;
+        }
 
         wchar_t* filePath;
         PathAllocCombine(path, pathToWchar((char*)harFile->path), LongPath, &filePath);
@@ -649,6 +654,83 @@ static bool writeToFs(harContext* ctx, HANDLE file, wchar_t* newFileName) {
     return true;
 }
 
+// the program's name, quoted, followed by its arguments
+static wchar_t* createCommandLine(wchar_t* wideProgramName, const char* arguments) {
+    wchar_t* wideArguments = charToWchar(arguments, NULL);
+
+    size_t len = 1 + wcslen(wideProgramName) + 2 + wcslen(wideArguments) + 1;
+    wchar_t* wideCommandLine = ArenaAlloc(len * sizeof(wchar_t));
+    wideCommandLine[0] = L'\0';
+    wcscat(wideCommandLine, L"\"");
+    wcscat(wideCommandLine, wideProgramName);
+    wcscat(wideCommandLine, L"\" ");
+    wcscat(wideCommandLine, wideArguments);
+
+    return wideCommandLine;
+}
+
+// Run each line of the setup section as a command, before the test's own
+// command, e.g. to create a file that it reads.  Each has to exit with 0,
+// their output is only written to disk if one does not.
+static bool runSetupCommands(harContext* ctx, wchar_t* wideProgramName) {
+    harSingleFile* setupFile = findFile(ctx, setupFileName);
+    if(setupFile == NULL) {
+        return true;
+    }
+
+    char* line = (char*)setupFile->content;
+    line += strspn(line, "\r\n");
+    while(*line != '\0') {
+        size_t length = strcspn(line, "\r\n");
+        char* next = line + length;
+        next += strspn(next, "\r\n");
+        line[length] = '\0';
+
+        HANDLE output;
+        if(!createTempFile(ctx->basePath, &output)) {
+            printTestFail();
+            printf("\t\tTemp file creation failed: setup\n");
+            return false;
+        }
+
+        PROCESS_INFORMATION procInfo = {0};
+        STARTUPINFOW startupinfo = {0};
+        startupinfo.cb = sizeof(STARTUPINFOW);
+        startupinfo.hStdError = output;
+        startupinfo.hStdOutput = output;
+        startupinfo.hStdInput = INVALID_HANDLE_VALUE;
+        startupinfo.dwFlags |= STARTF_USESTDHANDLES;
+
+        bool success = CreateProcessW(wideProgramName, createCommandLine(wideProgramName, line),
+            NULL, NULL, true, 0, NULL, ctx->basePath, &startupinfo, &procInfo);
+
+        DWORD exitCode = 1;
+        if(success) {
+            if(WaitForSingleObject(procInfo.hProcess, 10000) != WAIT_OBJECT_0) {
+                TerminateProcess(procInfo.hProcess, -1);
+            }
+            success = GetExitCodeProcess(procInfo.hProcess, &exitCode);
+            CloseHandle(procInfo.hProcess);
+            CloseHandle(procInfo.hThread);
+        }
+
+        if(!success || exitCode != 0) {
+            printTestFail();
+            printf("\t\tSetup command failed: %s\n", line);
+            if(!writeToFs(ctx, output, TEXT(setupOutFileName))) {
+                printf("\t\tUnable to write setup output to disk\n");
+            }
+            CloseHandle(output);
+            return false;
+        }
+
+        CloseHandle(output);
+        line = next;
+    }
+
+    return true;
+}
+
 static bool createChildProcess(harContext* ctx) {
 
     HANDLE childOut = INVALID_HANDLE_VALUE;
@@ -699,15 +781,14 @@ static bool createChildProcess(harContext* ctx) {
         printf("\t\tNo test command section found\n");
         return false;
     }
-    wchar_t* commandFileContent = charToWchar((char*)commandFile->content, NULL);
+    wchar_t* wideCommandLine = createCommandLine(wideProgramName, (char*)commandFile->content);
 
-    size_t len = 1 + wcslen(wideProgramName) + 2 + wcslen(commandFileContent) + 1;
-    wchar_t* wideCommandLine = ArenaAlloc(len * sizeof(wchar_t));
-    wideCommandLine[0] = L'\0';
-    wcscat(wideCommandLine, L"\"");
-    wcscat(wideCommandLine, wideProgramName);
-    wcscat(wideCommandLine, L"\" ");
-    wcscat(wideCommandLine, commandFileContent);
+    if(!runSetupCommands(ctx, wideProgramName)) {
+        CloseHandle(childOut);
+        CloseHandle(childErr);
+        if(childIn != INVALID_HANDLE_VALUE) CloseHandle(childIn);
+        return false;
+    }
 
     // windows metadata infomation, specifies the previously created
     // stdin/stdout handles that should be used
@@ -884,6 +965,11 @@ static void runSingleTest(testDescriptor* test, const char* tempPath) {
         fprintf(stderr, "\t\ttest file cannot specify files named \""stdErrFileName"\"\n");
         return;
     }
+    if(findFile(&ctx, setupOutFileName)) {
+        printTestFail();
+        fprintf(stderr, "\t\ttest file cannot specify files named \""setupOutFileName"\"\n");
+        return;
+    }
 
     for(unsigned int i = 0; i < ctx.fileCount; i++) {
         harSingleFile* file = &ctx.files[i];
@@ -0,0 +1,70 @@
+#include "thread.h"
+
+#include <stdio.h>
+#include <windows.h>
+#include "memory.h"
+
+typedef struct ThreadStartData {
+    ThreadFn fn;
+    void* arg;
+} ThreadStartData;
+
+static DWORD WINAPI threadEntry(LPVOID voidData) {
+    ThreadStartData* data = voidData;
+
+    ArenaInit();
+    data->fn(data->arg);
+
+    return 0;
+}
+
+Thread ThreadStart(ThreadFn fn, void* arg) {
+    // allocated by the starting thread, as the new thread's arena does not
+    // exist yet
+    ThreadStartData* data = ArenaAlloc(sizeof(*data));
+    data->fn = fn;
+    data->arg = arg;
+
+    HANDLE thread = CreateThread(NULL, 0, threadEntry, data, 0, NULL);
+    if(thread == NULL) {
+        fprintf(stderr, "Error: could not start thread\n");
+    }
+    return thread;
+}
+
+void ThreadJoin(Thread thread) {
+    WaitForSingleObject(thread, INFINITE);
+    CloseHandle(thread);
+}
+
+long ThreadCounterIncrement(ThreadCounter* counter) {
+    return InterlockedIncrement(counter) - 1;
+}
+
+ThreadMutex ThreadMutexCreate() {
+    CRITICAL_SECTION* mutex = ArenaAlloc(sizeof(*mutex));
+    InitializeCriticalSection(mutex);
+    return mutex;
+}
+
+void ThreadMutexLock(ThreadMutex mutex) {
+    EnterCriticalSection(mutex);
+}
+
+void ThreadMutexUnlock(ThreadMutex mutex) {
+    LeaveCriticalSection(mutex);
+}
+
+ThreadCondition ThreadConditionCreate() {
+    CONDITION_VARIABLE* condition = ArenaAlloc(sizeof(*condition));
+    InitializeConditionVariable(condition);
+    return condition;
+}
+
+void ThreadConditionWait(ThreadCondition condition, ThreadMutex mutex) {
+    SleepConditionVariableCS(condition, mutex, INFINITE);
+}
+
+void ThreadConditionWakeAll(ThreadCondition condition) {
+    WakeAllConditionVariable(condition);
+}
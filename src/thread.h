@@ -0,0 +1,37 @@
+#ifndef THREAD_H
+#define THREAD_H
+
+// Wrapper around the operating system's threads.  Each thread started has
+// its own arena, so anything it allocates should only be used by other
+// threads once it has been joined, or handed to them while holding a
+// ThreadMutex.
+
+typedef void* Thread;
+typedef void (*ThreadFn)(void* arg);
+typedef void* ThreadMutex;
+typedef void* ThreadCondition;
+
+// a value that is shared between threads, only changed by the functions below
+typedef volatile long ThreadCounter;
+
+// start running fn(arg) on a new thread, or returns NULL if it could not be
+// started
+Thread ThreadStart(ThreadFn fn, void* arg);
+
+// wait for a thread to exit
+void ThreadJoin(Thread thread);
+
+// add one to a counter, returning its previous value
+long ThreadCounterIncrement(ThreadCounter* counter);
+
+ThreadMutex ThreadMutexCreate();
+void ThreadMutexLock(ThreadMutex mutex);
+void ThreadMutexUnlock(ThreadMutex mutex);
+
+// a condition can be waited on while holding a mutex, which is released
+// until the condition is woken, the wait can also end without being woken
+ThreadCondition ThreadConditionCreate();
+void ThreadConditionWait(ThreadCondition condition, ThreadMutex mutex);
+void ThreadConditionWakeAll(ThreadCondition condition);
+
+#endif
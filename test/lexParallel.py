@@ -0,0 +1,118 @@
+import os
+import random
+import subprocess
+import sys
+import tempfile
+import time
+
+# Checks and times lexing a file on several threads, see Phase4LexParallel.
+#
+#   python lexParallel.py fuzz <mcc> [file count] [seed]
+#     lexes random files with -j 1, then with -j 2 to 9 and small chunk
+#     sizes, and fails if the output, errors or exit code ever differ
+#
+#   python lexParallel.py bench <mcc> [MiB] [max jobs]
+#     generates a table file and prints the wall clock time of -E4 with
+#     each number of jobs, the best of three runs
+
+# parts that cross chunk boundaries in every way a chunk can start wrong
+fuzzParts = [
+    "ident", "x1", "42", "0x1f", "1.5e+3", " ", "\t", "\n", "\n", "\n",
+    "+", "++", "<<=", "#", "##", "%:", "...", ";", "{", "}",
+    "/* comment */", "/* comment\nover lines\n*/", "/*", "*/",
+    "// line comment\n", "//", "\\\n", "\\\n\\\n", "\\",
+    "\"string\"", "\"str\\\"ing\"", "\"\\\n\"", "\"", "'c'", "'\\''", "'",
+    "L\"wide\"", "u8\"utf\"", "??=", "??/\n", "??(", "??'",
+    "\n#include \"header.h\"\n", "\n#include <header.h>\n", "\n# define X 1\n",
+]
+
+def randomSource(rand):
+    length = rand.randint(1, 400)
+    return "".join(rand.choice(fuzzParts) for _ in range(length)) + "\n"
+
+def run(mcc, args, cwd):
+    result = subprocess.run([mcc] + args, cwd=cwd, capture_output=True, timeout=60)
+    return result.returncode, result.stdout, result.stderr
+
+def fuzz(mcc, fileCount, seed):
+    rand = random.Random(seed)
+    failures = 0
+    relexed = 0
+
+    with tempfile.TemporaryDirectory() as folder:
+        with open(os.path.join(folder, "header.h"), "w") as f:
+            f.write("header\n")
+
+        for i in range(fileCount):
+            with open(os.path.join(folder, "main.c"), "w", newline="\n") as f:
+                f.write(randomSource(rand))
+
+            flags = ["-E4", "./main.c", "-I."]
+            if rand.random() < 0.5:
+                flags.append("-ftrigraphs")
+            expected = run(mcc, flags + ["-j", "1"], folder)
+
+            for jobs in range(2, 10):
+                chunkSize = rand.choice([1, 2, 3, 7, 16, 64])
+                args = flags + ["-j", str(jobs), f"-flex-chunk-size={chunkSize}", "--print-stats"]
+                code, out, err = run(mcc, args, folder)
+
+                # the statistics are only printed with the parallel run
+                statsStart = err.find(b"Token cache:")
+                stats = err[statsStart:]
+                err = err[:statsStart]
+                if b" 0 chunks lexed again" not in stats:
+                    relexed += 1
+
+                if (code, out, err) != expected:
+                    failures += 1
+                    failedPath = f"lexParallelFailure{failures}.c"
+                    with open(os.path.join(folder, "main.c"), "rb") as src:
+                        with open(failedPath, "wb") as dst:
+                            dst.write(src.read())
+                    print(f"File {i} differs with {' '.join(args)}, saved as {failedPath}")
+
+    print(f"{fileCount} files, {fileCount * 8} parallel runs, {relexed} lexed a chunk again, {failures} differed")
+    return failures == 0
+
+def benchSource(size):
+    lines = []
+    length = 0
+    row = 0
+    while length < size:
+        line = f"    {{ {row}, 0x{row * 2654435761 % 2**32:08x}, \"entry {row}\" }}, /* row {row} */\n"
+        lines.append(line)
+        length += len(line)
+        row += 1
+    return "static const struct { int a; unsigned b; const char* c; } table[] = {\n" + "".join(lines) + "};\n"
+
+def bench(mcc, sizeMiB, maxJobs):
+    with tempfile.TemporaryDirectory() as folder:
+        with open(os.path.join(folder, "table.c"), "w", newline="\n") as f:
+            f.write(benchSource(sizeMiB * 1024 * 1024))
+
+        print(f"{sizeMiB} MiB table, {os.cpu_count()} cores")
+        for jobs in range(1, maxJobs + 1):
+            best = None
+            for _ in range(3):
+                start = time.perf_counter()
+                subprocess.run([mcc, "-E4", "./table.c", "-j", str(jobs)], cwd=folder,
+                    stdout=subprocess.DEVNULL, check=True)
+                elapsed = time.perf_counter() - start
+                best = elapsed if best is None else min(best, elapsed)
+            print(f"-j {jobs}: {best:.2f} s")
+
+if len(sys.argv) < 3 or sys.argv[1] not in ("fuzz", "bench"):
+    print("usage: lexParallel.py fuzz|bench <mcc> [count or MiB] [seed or max jobs]")
+    sys.exit(2)
+
+mcc = os.path.abspath(sys.argv[2])
+if sys.argv[1] == "fuzz":
+    fileCount = int(sys.argv[3]) if len(sys.argv) > 3 else 600
+    seed = int(sys.argv[4]) if len(sys.argv) > 4 else 0
+    if not fuzz(mcc, fileCount, seed):
+        sys.exit(1)
+else:
+    sizeMiB = int(sys.argv[3]) if len(sys.argv) > 3 else 32
+    maxJobs = int(sys.argv[4]) if len(sys.argv) > 4 else 8
+    bench(mcc, sizeMiB, maxJobs)